@@ -231,34 +231,90 @@ irc_fnmatch (const char *pattern, const char *string)
 //   http://tools.ietf.org/html/rfc7230#appendix-B
 //   http://tools.ietf.org/html/rfc5234#appendix-B.1
 
-#define HTTP_TOKENIZER_CLASS(name, definition)                                 \
+enum
+{
+	HTTP_CLASS_VCHAR       = 1 << 0,    ///< Visible characters
+	HTTP_CLASS_DELIMITER   = 1 << 1,    ///< Delimiters
+	HTTP_CLASS_WHITESPACE  = 1 << 2,    ///< SP and HTAB
+	HTTP_CLASS_OBS_TEXT    = 1 << 3,    ///< Non-ASCII octets
+	HTTP_CLASS_TCHAR       = 1 << 4,    ///< "tchar"
+	HTTP_CLASS_QDTEXT      = 1 << 5,    ///< "qdtext"
+	HTTP_CLASS_QUOTED_PAIR = 1 << 6     ///< Escapable by "quoted-pair"
+};
+
+// The definitions are only evaluated at compile time, to fill in a table
+
+#define HTTP_IS_VCHAR(c)      ((c) >= 0x21 && (c) <= 0x7E)
+#define HTTP_IS_WHITESPACE(c) ((c) == '\t' || (c) == ' ')
+#define HTTP_IS_OBS_TEXT(c)   ((c) >= 0x80 && (c) <= 0xFF)
+#define HTTP_IS_DELIMITER(c)                                                   \
+	((c) == '"' || (c) == '(' || (c) == ')' || (c) == ',' || (c) == '/'        \
+	|| ((c) >= ':' && (c) <= '@') || ((c) >= '[' && (c) <= ']')               \
+	|| (c) == '{' || (c) == '}')
+
+#define HTTP_CLASSES(c) (                                                      \
+	(HTTP_IS_VCHAR (c)      ? HTTP_CLASS_VCHAR      : 0) |                     \
+	(HTTP_IS_DELIMITER (c)  ? HTTP_CLASS_DELIMITER  : 0) |                     \
+	(HTTP_IS_WHITESPACE (c) ? HTTP_CLASS_WHITESPACE : 0) |                     \
+	(HTTP_IS_OBS_TEXT (c)   ? HTTP_CLASS_OBS_TEXT   : 0) |                     \
+	(HTTP_IS_VCHAR (c) && !HTTP_IS_DELIMITER (c) ? HTTP_CLASS_TCHAR : 0) |     \
+	((c) == '\t' || (c) == ' ' || (c) == '!'                                   \
+	|| ((c) >= 0x23 && (c) <= 0x5B)                                            \
+	|| ((c) >= 0x5D && (c) <= 0x7E)                                            \
+	|| HTTP_IS_OBS_TEXT (c) ? HTTP_CLASS_QDTEXT : 0) |                         \
+	(HTTP_IS_WHITESPACE (c) || HTTP_IS_VCHAR (c)                               \
+	|| HTTP_IS_OBS_TEXT (c) ? HTTP_CLASS_QUOTED_PAIR : 0))
+
+#define HTTP_CLASSES_4(c)  HTTP_CLASSES (c), HTTP_CLASSES ((c) + 1),           \
+	HTTP_CLASSES ((c) + 2), HTTP_CLASSES ((c) + 3)
+#define HTTP_CLASSES_16(c) HTTP_CLASSES_4 (c), HTTP_CLASSES_4 ((c) + 4),       \
+	HTTP_CLASSES_4 ((c) + 8), HTTP_CLASSES_4 ((c) + 12)
+#define HTTP_CLASSES_64(c) HTTP_CLASSES_16 (c), HTTP_CLASSES_16 ((c) + 16),    \
+	HTTP_CLASSES_16 ((c) + 32), HTTP_CLASSES_16 ((c) + 48)
+
+static const uint8_t http_char_classes[256] =
+{
+	HTTP_CLASSES_64 (0),   HTTP_CLASSES_64 (64),
+	HTTP_CLASSES_64 (128), HTTP_CLASSES_64 (192),
+};
+
+#undef HTTP_CLASSES_64
+#undef HTTP_CLASSES_16
+#undef HTTP_CLASSES_4
+#undef HTTP_CLASSES
+#undef HTTP_IS_DELIMITER
+#undef HTTP_IS_OBS_TEXT
+#undef HTTP_IS_WHITESPACE
+#undef HTTP_IS_VCHAR
+
+#define HTTP_TOKENIZER_CLASS(name, class)                                      \
 	static inline bool                                                         \
 	http_tokenizer_is_ ## name (int c)                                         \
 	{                                                                          \
-		return (definition);                                                   \
+		return http_char_classes[(unsigned char) c] & (class);                 \
 	}
 
-HTTP_TOKENIZER_CLASS (vchar, c >= 0x21 && c <= 0x7E)
-HTTP_TOKENIZER_CLASS (delimiter, !!strchr ("\"(),/:;<=>?@[\\]{}", c))
-HTTP_TOKENIZER_CLASS (whitespace, c == '\t' || c == ' ')
-HTTP_TOKENIZER_CLASS (obs_text, c >= 0x80 && c <= 0xFF)
-
-HTTP_TOKENIZER_CLASS (tchar,
-	http_tokenizer_is_vchar (c) && !http_tokenizer_is_delimiter (c))
-
-HTTP_TOKENIZER_CLASS (qdtext,
-	c == '\t' || c == ' ' || c == '!'
-	|| (c >= 0x23 && c <= 0x5B)
-	|| (c >= 0x5D && c <= 0x7E)
-	|| http_tokenizer_is_obs_text (c))
-
-HTTP_TOKENIZER_CLASS (quoted_pair,
-	c == '\t' || c == ' '
-	|| http_tokenizer_is_vchar (c)
-	|| http_tokenizer_is_obs_text (c))
+HTTP_TOKENIZER_CLASS (vchar,       HTTP_CLASS_VCHAR)
+HTTP_TOKENIZER_CLASS (delimiter,   HTTP_CLASS_DELIMITER)
+HTTP_TOKENIZER_CLASS (whitespace,  HTTP_CLASS_WHITESPACE)
+HTTP_TOKENIZER_CLASS (obs_text,    HTTP_CLASS_OBS_TEXT)
+HTTP_TOKENIZER_CLASS (tchar,       HTTP_CLASS_TCHAR)
+HTTP_TOKENIZER_CLASS (qdtext,      HTTP_CLASS_QDTEXT)
+HTTP_TOKENIZER_CLASS (quoted_pair, HTTP_CLASS_QUOTED_PAIR)
 
 #undef HTTP_TOKENIZER_CLASS
 
+/// Return the length of the longest prefix made of the given classes
+static size_t
+http_span (const char *p, size_t len, unsigned classes)
+{
+	const unsigned char *s = (const unsigned char *) p;
+	size_t i = 0;
+	while (i < len && (http_char_classes[s[i]] & classes))
+		i++;
+	return i;
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 enum http_tokenizer_token
@@ -302,26 +358,24 @@ http_tokenizer_free (struct http_tokenizer *self)
 static enum http_tokenizer_token
 http_tokenizer_quoted_string (struct http_tokenizer *self)
 {
-	bool quoted_pair = false;
 	while (self->offset < self->input_len)
 	{
-		int c = self->input[self->offset++];
-		if (quoted_pair)
-		{
-			if (!http_tokenizer_is_quoted_pair (c))
-				return HTTP_T_ERROR;
+		// Copy whole runs of plain characters at once
+		const char *p = (const char *) self->input + self->offset;
+		size_t len = http_span (p, self->input_len - self->offset,
+			HTTP_CLASS_QDTEXT);
+		str_append_data (&self->string, p, len);
+		if ((self->offset += len) >= self->input_len)
+			break;
 
-			str_append_c (&self->string, c);
-			quoted_pair = false;
-		}
-		else if (c == '\\')
-			quoted_pair = true;
-		else if (c == '"')
+		int c = self->input[self->offset++];
+		if (c == '"')
 			return HTTP_T_QUOTED_STRING;
-		else if (http_tokenizer_is_qdtext (c))
-			str_append_c (&self->string, c);
-		else
+		if (c != '\\' || self->offset >= self->input_len
+		 || !http_tokenizer_is_quoted_pair (c = self->input[self->offset++]))
 			return HTTP_T_ERROR;
+
+		str_append_c (&self->string, c);
 	}
 
 	// Premature end of input
@@ -332,53 +386,48 @@ static enum http_tokenizer_token
 http_tokenizer_next (struct http_tokenizer *self, bool skip_ows)
 {
 	str_reset (&self->string);
+	if (skip_ows)
+		self->offset += http_span ((const char *) self->input + self->offset,
+			self->input_len - self->offset, HTTP_CLASS_WHITESPACE);
 	if (self->offset >= self->input_len)
 		return HTTP_T_EOF;
 
-	int c = self->input[self->offset++];
-
-	if (skip_ows)
-		while (http_tokenizer_is_whitespace (c))
-		{
-			if (self->offset >= self->input_len)
-				return HTTP_T_EOF;
-			c = self->input[self->offset++];
-		}
-
+	int c = self->input[self->offset];
 	if (c == '"')
+	{
+		self->offset++;
 		return http_tokenizer_quoted_string (self);
-
+	}
 	if (http_tokenizer_is_delimiter (c))
 	{
+		self->offset++;
 		self->delimiter = c;
 		return HTTP_T_DELIMITER;
 	}
 
 	// Simple variable-length tokens
 	enum http_tokenizer_token result;
-	bool (*eater) (int c) = NULL;
+	unsigned classes;
 	if (http_tokenizer_is_whitespace (c))
 	{
-		eater = http_tokenizer_is_whitespace;
+		classes = HTTP_CLASS_WHITESPACE;
 		result = HTTP_T_WHITESPACE;
 	}
 	else if (http_tokenizer_is_tchar (c))
 	{
-		eater = http_tokenizer_is_tchar;
+		classes = HTTP_CLASS_TCHAR;
 		result = HTTP_T_TOKEN;
 	}
 	else
-		return HTTP_T_ERROR;
-
-	str_append_c (&self->string, c);
-	while (self->offset < self->input_len)
 	{
-		if (!eater (c = self->input[self->offset]))
-			break;
-
-		str_append_c (&self->string, c);
 		self->offset++;
+		return HTTP_T_ERROR;
 	}
+
+	const char *p = (const char *) self->input + self->offset;
+	size_t len = http_span (p, self->input_len - self->offset, classes);
+	str_append_data (&self->string, p, len);
+	self->offset += len;
 	return result;
 }
 
@@ -576,210 +625,1108 @@ end:
 	return result;
 }
 
-#endif
+// --- HTTP messages -----------------------------------------------------------
+
+#define HTTP_HEADER_TABLE(XX)                              \
+	XX (ACCEPT,                "Accept")                   \
+	XX (ACCEPT_ENCODING,       "Accept-Encoding")          \
+	XX (AUTHORIZATION,         "Authorization")            \
+	XX (CONNECTION,            "Connection")               \
+	XX (CONTENT_ENCODING,      "Content-Encoding")         \
+	XX (CONTENT_LENGTH,        "Content-Length")           \
+	XX (CONTENT_TYPE,          "Content-Type")             \
+	XX (COOKIE,                "Cookie")                   \
+	XX (DATE,                  "Date")                     \
+	XX (EXPECT,                "Expect")                   \
+	XX (HOST,                  "Host")                     \
+	XX (LOCATION,              "Location")                 \
+	XX (ORIGIN,                "Origin")                   \
+	XX (SEC_WEBSOCKET_KEY,     "Sec-WebSocket-Key")        \
+	XX (SEC_WEBSOCKET_VERSION, "Sec-WebSocket-Version")    \
+	XX (SERVER,                "Server")                   \
+	XX (SET_COOKIE,            "Set-Cookie")               \
+	XX (TE,                    "TE")                       \
+	XX (TRAILER,               "Trailer")                  \
+	XX (TRANSFER_ENCODING,     "Transfer-Encoding")        \
+	XX (UPGRADE,               "Upgrade")                  \
+	XX (USER_AGENT,            "User-Agent")
+
+enum http_header_id
+{
+	HTTP_HEADER_OTHER,                  ///< Not a well-known header
+#define XX(a, b) HTTP_HEADER_ ## a,
+	HTTP_HEADER_TABLE (XX)
+#undef XX
+	HTTP_HEADER_COUNT
+};
 
-#ifdef LIBERTY_WANT_PROTO_SCGI
+/// Return the canonical name of a well-known header, or NULL
+static const char *
+http_header_name (enum http_header_id id)
+{
+	static const char *names[HTTP_HEADER_COUNT] =
+	{
+#define XX(a, b) [HTTP_HEADER_ ## a] = b,
+		HTTP_HEADER_TABLE (XX)
+#undef XX
+	};
+	return id < HTTP_HEADER_COUNT ? names[id] : NULL;
+}
 
-// --- SCGI --------------------------------------------------------------------
+// perfhash.awk: http_header_lookup 0 fold xmacro HTTP_HEADER_TABLE HTTP_HEADER_
+static int
+http_header_lookup (const char *s, size_t len)
+{
+	static const struct { const char *key; size_t len; int value; }
+	table[30] =
+	{
+		[1] = { "Content-Encoding", 16, HTTP_HEADER_CONTENT_ENCODING },
+		[2] = { "Host", 4, HTTP_HEADER_HOST },
+		[3] = { "Trailer", 7, HTTP_HEADER_TRAILER },
+		[4] = { "Content-Length", 14, HTTP_HEADER_CONTENT_LENGTH },
+		[5] = { "Expect", 6, HTTP_HEADER_EXPECT },
+		[6] = { "Sec-WebSocket-Version", 21,
+			HTTP_HEADER_SEC_WEBSOCKET_VERSION },
+		[8] = { "Upgrade", 7, HTTP_HEADER_UPGRADE },
+		[9] = { "Authorization", 13, HTTP_HEADER_AUTHORIZATION },
+		[10] = { "Cookie", 6, HTTP_HEADER_COOKIE },
+		[12] = { "Origin", 6, HTTP_HEADER_ORIGIN },
+		[13] = { "Sec-WebSocket-Key", 17, HTTP_HEADER_SEC_WEBSOCKET_KEY },
+		[14] = { "Content-Type", 12, HTTP_HEADER_CONTENT_TYPE },
+		[16] = { "Accept", 6, HTTP_HEADER_ACCEPT },
+		[17] = { "TE", 2, HTTP_HEADER_TE },
+		[19] = { "User-Agent", 10, HTTP_HEADER_USER_AGENT },
+		[22] = { "Connection", 10, HTTP_HEADER_CONNECTION },
+		[23] = { "Server", 6, HTTP_HEADER_SERVER },
+		[25] = { "Location", 8, HTTP_HEADER_LOCATION },
+		[26] = { "Date", 4, HTTP_HEADER_DATE },
+		[27] = { "Transfer-Encoding", 17, HTTP_HEADER_TRANSFER_ENCODING },
+		[28] = { "Accept-Encoding", 15, HTTP_HEADER_ACCEPT_ENCODING },
+		[29] = { "Set-Cookie", 10, HTTP_HEADER_SET_COOKIE },
+	};
 
-enum scgi_parser_state
+	uint32_t hash = 42;
+	for (size_t i = 0; i < len; i++)
+		hash = (hash * 33 + tolower_ascii ((unsigned char) s[i])) & 0xFFFFFF;
+
+	size_t slot = hash % 30;
+	if (!table[slot].key || table[slot].len != len
+	 || strncasecmp_ascii (table[slot].key, s, len))
+		return 0;
+	return table[slot].value;
+}
+// perfhash.awk: end
+
+static enum http_header_id
+http_header_resolve (const char *name, size_t len)
 {
-	SCGI_READING_NETSTRING_LENGTH,      ///< The length of the header netstring
-	SCGI_READING_NAME,                  ///< Header name
-	SCGI_READING_VALUE,                 ///< Header value
-	SCGI_READING_CONTENT                ///< Incoming data
+	return http_header_lookup (name, len);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+struct http_header
+{
+	enum http_header_id id;             ///< Interned name, if well-known
+	const char *name;                   ///< Header name, not 0-terminated
+	size_t name_len;                    ///< Length of the name
+	const char *value;                  ///< Trimmed value, not 0-terminated
+	size_t value_len;                   ///< Length of the value
 };
 
-struct scgi_parser
+/// Parse a "field-name: field-value" line, without obsolete line folding
+static bool
+http_parse_field (const char *line, size_t len, struct http_header *field)
 {
-	enum scgi_parser_state state;       ///< Parsing state
-	struct str input;                   ///< Input buffer
+	size_t name_len = http_span (line, len, HTTP_CLASS_TCHAR);
+	if (!name_len || name_len == len || line[name_len] != ':')
+		return false;
 
-	struct str_map headers;             ///< Headers parsed
+	const char *value = line + name_len + 1, *end = line + len;
+	while (value < end && http_tokenizer_is_whitespace (*value))
+		value++;
+	while (end > value && http_tokenizer_is_whitespace (end[-1]))
+		end--;
+
+	field->id = http_header_resolve (line, name_len);
+	field->name = line;
+	field->name_len = name_len;
+	field->value = value;
+	field->value_len = end - value;
+	return true;
+}
 
-	size_t headers_len;                 ///< Length of the netstring contents
-	struct str name;                    ///< Header name so far
-	struct str value;                   ///< Header value so far
+static int
+http_hex_value (int c)
+{
+	if (isdigit_ascii (c))
+		return c - '0';
+	if ((c = tolower_ascii (c)) >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
 
-	/// Finished parsing request headers.
+// - - Chunked transfer coding - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// The decoder is independent of http_parser, so that it can also be used
+// on bodies that arrive by other means, such as from a FastCGI stream.
+// Unlike a message head, chunk framing can be split at any byte, so only
+// incomplete lines get buffered, never chunk data.
+
+// Recommended literature:
+//   http://tools.ietf.org/html/rfc7230#section-4.1
+
+/// Limit for chunk size lines and trailer fields
+#define HTTP_CHUNKED_MAX_LINE  8192
+
+enum http_chunked_state
+{
+	HTTP_CHUNKED_SIZE,                  ///< Reading a chunk size line
+	HTTP_CHUNKED_DATA,                  ///< Reading chunk data
+	HTTP_CHUNKED_DATA_END,              ///< Reading CRLF after chunk data
+	HTTP_CHUNKED_TRAILER,               ///< Reading the trailer section
+	HTTP_CHUNKED_DONE                   ///< The last chunk has been read
+};
+
+struct http_chunked_decoder
+{
+	enum http_chunked_state state;      ///< Decoding state
+	uint64_t remaining;                 ///< Remaining chunk data
+	struct str line;                    ///< Incomplete line
+
+	/// Decoded data is available, as a view into the input.
 	/// Return false to abort further processing of input.
-	bool (*on_headers_read) (void *user_data);
+	bool (*on_data) (void *user_data, const void *data, size_t len);
 
-	/// Content available; len == 0 means end of file.
+	/// A trailer field has been read; it may be NULL.
 	/// Return false to abort further processing of input.
-	bool (*on_content) (void *user_data, const void *data, size_t len);
+	bool (*on_trailer) (void *user_data, const struct http_header *field);
 
 	void *user_data;                    ///< User data passed to callbacks
 };
 
-static struct scgi_parser
-scgi_parser_make (void)
+static struct http_chunked_decoder
+http_chunked_decoder_make (void)
 {
-	return (struct scgi_parser)
-	{
-		.input = str_make (),
-		.headers = str_map_make (free),
-		.name = str_make (),
-		.value = str_make (),
-	};
+	return (struct http_chunked_decoder) { .line = str_make () };
 }
 
 static void
-scgi_parser_free (struct scgi_parser *self)
+http_chunked_decoder_free (struct http_chunked_decoder *self)
 {
-	str_free (&self->input);
-	str_map_free (&self->headers);
-	str_free (&self->name);
-	str_free (&self->value);
+	str_free (&self->line);
+}
+
+/// Prepare the decoder for another body
+static void
+http_chunked_decoder_reset (struct http_chunked_decoder *self)
+{
+	self->state = HTTP_CHUNKED_SIZE;
+	self->remaining = 0;
+	str_reset (&self->line);
 }
 
 static bool
-scgi_parser_push (struct scgi_parser *self,
-	const void *data, size_t len, struct error **e)
+http_chunked_decoder_size (struct http_chunked_decoder *self,
+	const char *line, size_t len, struct error **e)
 {
-	if (!len)
+	// We ignore chunk extensions, there's nothing useful to do with them
+	size_t i = 0;
+	uint64_t size = 0;
+	for (int digit; i < len && (digit = http_hex_value (line[i])) >= 0; i++)
 	{
-		if (self->state != SCGI_READING_CONTENT)
-			return error_set (e, "premature EOF");
-
-		// Indicate end of file
-		return self->on_content (self->user_data, NULL, 0);
+		if (size >> 60)
+			return error_set (e, "chunk size is too large");
+		size = size << 4 | digit;
 	}
+	if (!i || (i < len && line[i] != ';'
+		&& !http_tokenizer_is_whitespace (line[i])))
+		return error_set (e, "invalid chunk size");
 
-	// Notice that this madness is significantly harder to parse than FastCGI;
-	// this procedure could also be optimized significantly
-	str_append_data (&self->input, data, len);
+	self->remaining = size;
+	self->state = size ? HTTP_CHUNKED_DATA : HTTP_CHUNKED_TRAILER;
+	return true;
+}
 
-	bool keep_running = true;
-	while (keep_running)
+static bool
+http_chunked_decoder_line (struct http_chunked_decoder *self,
+	const char *line, size_t len, struct error **e)
+{
+	struct http_header field;
 	switch (self->state)
 	{
-	case SCGI_READING_NETSTRING_LENGTH:
-	{
-		if (self->input.len < 1)
-			return true;
-
-		char digit = *self->input.str;
-		// XXX: this allows for omitting the netstring length altogether
-		if (digit == ':')
+	case HTTP_CHUNKED_SIZE:
+		return http_chunked_decoder_size (self, line, len, e);
+	case HTTP_CHUNKED_DATA_END:
+		if (len)
+			return error_set (e, "chunk data not followed by CRLF");
+		self->state = HTTP_CHUNKED_SIZE;
+		return true;
+	case HTTP_CHUNKED_TRAILER:
+		if (!len)
 		{
-			self->state = SCGI_READING_NAME;
-			str_remove_slice (&self->input, 0, 1);
-			break;
+			self->state = HTTP_CHUNKED_DONE;
+			return true;
 		}
-
-		if (digit < '0' || digit > '9')
-			return error_set (e, "invalid header netstring");
-
-		size_t new_len = self->headers_len * 10 + (digit - '0');
-		if (new_len < self->headers_len)
-			return error_set (e, "header netstring is too long");
-
-		self->headers_len = new_len;
-		str_remove_slice (&self->input, 0, 1);
-		break;
+		if (http_tokenizer_is_whitespace (*line)
+		 || !http_parse_field (line, len, &field))
+			return error_set (e, "invalid trailer field");
+		return !self->on_trailer || self->on_trailer (self->user_data, &field);
+	default:
+		hard_assert (!"invalid state");
+		return false;
 	}
-	case SCGI_READING_NAME:
-	{
-		if (self->input.len < 1)
-			return true;
+}
 
-		char c = *self->input.str;
-		if (!self->headers_len)
+/// Decode a chunked body, returning how much of the input has been used,
+/// or -1 on failure.  Incomplete lines are buffered within the decoder.
+/// Decoding stops after the last chunk, when "state" becomes DONE.
+static ssize_t
+http_chunked_decoder_push (struct http_chunked_decoder *self,
+	const void *data, size_t len, struct error **e)
+{
+	const char *p = data, *end = p + len, *nl;
+	while (p < end && self->state != HTTP_CHUNKED_DONE)
+	{
+		if (self->state == HTTP_CHUNKED_DATA)
 		{
-			// The netstring is ending but we haven't finished parsing it,
-			// or the netstring doesn't end with a comma
-			if (self->name.len || c != ',')
-				return error_set (e, "invalid header netstring");
+			size_t n = MIN ((size_t) (end - p), self->remaining);
+			if (!self->on_data (self->user_data, p, n))
+				return -1;
 
-			self->state = SCGI_READING_CONTENT;
-			keep_running = self->on_headers_read (self->user_data);
+			p += n;
+			if (!(self->remaining -= n))
+				self->state = HTTP_CHUNKED_DATA_END;
+			continue;
 		}
-		else if (c != '\0')
-			str_append_c (&self->name, c);
-		else
-			self->state = SCGI_READING_VALUE;
-
-		str_remove_slice (&self->input, 0, 1);
-		self->headers_len--;
-		break;
-	}
-	case SCGI_READING_VALUE:
-	{
-		if (self->input.len < 1)
-			return true;
 
-		char c = *self->input.str;
-		if (!self->headers_len)
+		if (!(nl = memchr (p, '\n', end - p)))
 		{
-			// The netstring is ending but we haven't finished parsing it
-			return error_set (e, "invalid header netstring");
+			if (self->line.len + (end - p) > HTTP_CHUNKED_MAX_LINE)
+			{
+				error_set (e, "line too long");
+				return -1;
+			}
+			str_append_data (&self->line, p, end - p);
+			p = end;
+			break;
 		}
-		else if (c != '\0')
-			str_append_c (&self->value, c);
-		else
-		{
-			// We've got a name-value pair, let's put it in the map
-			str_map_set (&self->headers,
-				self->name.str, str_steal (&self->value));
-
-			str_reset (&self->name);
-			self->value = str_make ();
 
-			self->state = SCGI_READING_NAME;
+		// Avoid copying when the whole line is available
+		const char *line = p;
+		size_t line_len = nl - p;
+		if (self->line.len)
+		{
+			str_append_data (&self->line, p, nl - p);
+			line = self->line.str;
+			line_len = self->line.len;
 		}
-
-		str_remove_slice (&self->input, 0, 1);
-		self->headers_len--;
-		break;
-	}
-	case SCGI_READING_CONTENT:
-		keep_running = self->on_content
-			(self->user_data, self->input.str, self->input.len);
-		str_remove_slice (&self->input, 0, self->input.len);
-		return keep_running;
+		if (line_len && line[line_len - 1] == '\r')
+			line_len--;
+
+		p = nl + 1;
+		bool ok = http_chunked_decoder_line (self, line, line_len, e);
+		str_reset (&self->line);
+		if (!ok)
+			return -1;
 	}
-	return false;
+	return p - (const char *) data;
 }
 
-#endif
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-#ifdef LIBERTY_WANT_PROTO_FASTCGI
+/// Space needed for a chunk header: the size in hexadecimal, and CRLF
+#define HTTP_CHUNK_HEADER_MAX  (2 * sizeof (uint64_t) + 2)
 
-// --- FastCGI -----------------------------------------------------------------
+/// Frame non-empty data as a single chunk, without copying it.
+/// The header buffer must be kept alive for as long as the vectors are.
+static void
+http_chunked_encode (char header[HTTP_CHUNK_HEADER_MAX],
+	const void *data, size_t len, struct iovec iov[3])
+{
+	hard_assert (len);
 
-// Constants from the FastCGI specification document
+	char digits[2 * sizeof (uint64_t)], *p = digits + sizeof digits;
+	for (uint64_t n = len; n; n >>= 4)
+		*--p = "0123456789abcdef"[n & 0xf];
 
-#define FCGI_HEADER_LEN       8
+	size_t header_len = digits + sizeof digits - p;
+	memcpy (header, p, header_len);
+	memcpy (header + header_len, "\r\n", 2);
 
-#define FCGI_VERSION_1        1
-#define FCGI_NULL_REQUEST_ID  0
-#define FCGI_KEEP_CONN        1
+	iov[0] = (struct iovec) { header, header_len + 2 };
+	iov[1] = (struct iovec) { (void *) data, len };
+	iov[2] = (struct iovec) { "\r\n", 2 };
+}
 
-enum fcgi_type
+/// Append the last chunk, followed by an optional map of trailer fields
+static void
+http_chunked_encode_last (struct str *output, struct str_map *trailers)
 {
-	FCGI_BEGIN_REQUEST     =  1,
-	FCGI_ABORT_REQUEST     =  2,
-	FCGI_END_REQUEST       =  3,
-	FCGI_PARAMS            =  4,
-	FCGI_STDIN             =  5,
-	FCGI_STDOUT            =  6,
-	FCGI_STDERR            =  7,
-	FCGI_DATA              =  8,
-	FCGI_GET_VALUES        =  9,
-	FCGI_GET_VALUES_RESULT = 10,
-	FCGI_UNKNOWN_TYPE      = 11,
-	FCGI_MAXTYPE           = FCGI_UNKNOWN_TYPE
-};
+	str_append (output, "0\r\n");
+	if (trailers)
+	{
+		struct str_map_iter iter = str_map_iter_make (trailers);
+		const char *value;
+		while ((value = str_map_iter_next (&iter)))
+			str_append_printf (output, "%s: %s\r\n", iter.link->key, value);
+	}
+	str_append (output, "\r\n");
+}
 
-enum fcgi_role
+// - - Message parser  - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// An incremental HTTP/1.1 request or response parser.  The message head
+// is parsed in place once it has been received in full, so all fields are
+// just views into the input.  Bodies are passed through as they arrive.
+
+// Recommended literature:
+//   http://tools.ietf.org/html/rfc7230#section-3
+//   http://tools.ietf.org/html/rfc7230#section-6
+
+enum http_parser_type
 {
-	FCGI_RESPONDER         =  1,
-	FCGI_AUTHORIZER        =  2,
-	FCGI_FILTER            =  3
+	HTTP_PARSER_REQUEST,                ///< Parse requests
+	HTTP_PARSER_RESPONSE                ///< Parse responses
 };
 
-enum fcgi_protocol_status
+enum http_parser_state
+{
+	HTTP_PARSER_HEAD,                   ///< Reading the message head
+	HTTP_PARSER_BODY,                   ///< Reading a body of known length
+	HTTP_PARSER_CHUNKED,                ///< Reading a chunked body
+	HTTP_PARSER_UNTIL_EOF               ///< Reading until the connection ends
+};
+
+struct http_parser
+{
+	enum http_parser_type type;         ///< What kind of messages to parse
+	enum http_parser_state state;       ///< Parsing state
+	struct str input;                   ///< Incomplete data
+	size_t head_scanned;                ///< How much of the head we've seen
+	size_t max_head_len;                ///< Limit for the message head
+
+	// The message head, only valid within on_headers_read:
+
+	const char *method;                 ///< Request method
+	size_t method_len;                  ///< Length of the method
+	const char *target;                 ///< Request target
+	size_t target_len;                  ///< Length of the target
+	unsigned status;                    ///< Response status code
+	const char *reason;                 ///< Response reason phrase
+	size_t reason_len;                  ///< Length of the reason phrase
+	unsigned version_major;             ///< Major HTTP version
+	unsigned version_minor;             ///< Minor HTTP version
+
+	ARRAY (struct http_header, headers) ///< All headers in order
+
+	/// The first occurence of each well-known header, or NULL
+	const struct http_header *known[HTTP_HEADER_COUNT];
+
+	// Message framing:
+
+	bool keep_alive;                    ///< Connection may be reused
+	bool chunked;                       ///< Body uses chunked coding
+	bool no_body;                       ///< The response has no body
+	uint64_t content_remaining;         ///< Body bytes remaining
+	struct http_chunked_decoder chunked_decoder;    ///< Chunked body decoder
+
+	/// Finished parsing the message head.  For responses to HEAD requests,
+	/// set "no_body" from within the callback.
+	/// Return false to abort further processing of input.
+	bool (*on_headers_read) (void *user_data);
+
+	/// Content available; len == 0 means end of the message.
+	/// Return false to abort further processing of input.
+	bool (*on_content) (void *user_data, const void *data, size_t len);
+
+	/// Optionally receive trailer fields of chunked bodies.
+	/// Return false to abort further processing of input.
+	bool (*on_trailer) (void *user_data, const struct http_header *field);
+
+	void *user_data;                    ///< User data passed to callbacks
+};
+
+static struct http_parser
+http_parser_make (enum http_parser_type type)
+{
+	struct http_parser self =
+	{
+		.type = type,
+		.input = str_make (),
+		.max_head_len = 1 << 16,
+		.chunked_decoder = http_chunked_decoder_make (),
+	};
+	ARRAY_INIT (self.headers);
+	return self;
+}
+
+static void
+http_parser_free (struct http_parser *self)
+{
+	str_free (&self->input);
+	free (self->headers);
+	http_chunked_decoder_free (&self->chunked_decoder);
+}
+
+/// Return the trimmed value of the first header with the given ID
+static bool
+http_parser_get_header (const struct http_parser *self,
+	enum http_header_id id, const char **value, size_t *value_len)
+{
+	const struct http_header *header = self->known[id];
+	if (!header)
+		return false;
+
+	*value = header->value;
+	*value_len = header->value_len;
+	return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// Find the length of the message head including the empty line, or 0
+static size_t
+http_parser_find_head_end (const char *p, size_t len, size_t *scanned)
+{
+	const char *nl;
+	size_t offset = *scanned;
+	while ((nl = memchr (p + offset, '\n', len - offset)))
+	{
+		size_t next = nl - p + 1;
+		if (next < len && p[next] == '\r')
+			next++;
+		if (next >= len)
+		{
+			// Look at this line ending again once there's more data
+			*scanned = nl - p;
+			return 0;
+		}
+		if (p[next] == '\n')
+			return next + 1;
+		offset = nl - p + 1;
+	}
+	*scanned = len;
+	return 0;
+}
+
+/// Cut out the next line, accepting both CRLF and LF as line terminators
+static bool
+http_parser_next_line (const char **p, const char *end,
+	const char **line, size_t *line_len)
+{
+	const char *nl = memchr (*p, '\n', end - *p);
+	if (!nl)
+		return false;
+
+	*line = *p;
+	*line_len = nl - *p;
+	if (*line_len && nl[-1] == '\r')
+		(*line_len)--;
+	*p = nl + 1;
+	return true;
+}
+
+static bool
+http_parser_parse_version (struct http_parser *self,
+	const char *p, size_t len)
+{
+	if (len != 8 || memcmp (p, "HTTP/", 5) || p[6] != '.'
+	 || !isdigit_ascii (p[5]) || !isdigit_ascii (p[7]))
+		return false;
+
+	self->version_major = p[5] - '0';
+	self->version_minor = p[7] - '0';
+	return true;
+}
+
+static bool
+http_parser_parse_request_line (struct http_parser *self,
+	const char *line, size_t len)
+{
+	const char *end = line + len, *sp;
+	size_t method_len = http_span (line, len, HTTP_CLASS_TCHAR);
+	if (!method_len || method_len == len || line[method_len] != ' ')
+		return false;
+
+	self->method = line;
+	self->method_len = method_len;
+
+	self->target = line + method_len + 1;
+	if (!(sp = memchr (self->target, ' ', end - self->target))
+	 || sp == self->target)
+		return false;
+
+	self->target_len = sp - self->target;
+	return http_parser_parse_version (self, sp + 1, end - sp - 1);
+}
+
+static bool
+http_parser_parse_status_line (struct http_parser *self,
+	const char *line, size_t len)
+{
+	if (len < 12 || !http_parser_parse_version (self, line, 8)
+	 || line[8] != ' ' || (len > 12 && line[12] != ' '))
+		return false;
+
+	self->status = 0;
+	for (int i = 9; i < 12; i++)
+	{
+		if (!isdigit_ascii (line[i]))
+			return false;
+		self->status = self->status * 10 + (line[i] - '0');
+	}
+
+	// Some servers omit the space when the reason phrase is empty
+	self->reason = line + MIN (len, 13);
+	self->reason_len = len - MIN (len, 13);
+	return true;
+}
+
+static bool
+http_parser_parse_header (struct http_parser *self,
+	const char *line, size_t len)
+{
+	ARRAY_RESERVE (self->headers, 1);
+	if (!http_parse_field (line, len, &self->headers[self->headers_len]))
+		return false;
+
+	self->headers_len++;
+	return true;
+}
+
+static bool
+http_parser_parse_head (struct http_parser *self,
+	const char *p, size_t len, struct error **e)
+{
+	const char *end = p + len, *line;
+	size_t line_len;
+
+	self->headers_len = 0;
+	if (!http_parser_next_line (&p, end, &line, &line_len)
+	 || (self->type == HTTP_PARSER_REQUEST
+		? !http_parser_parse_request_line (self, line, line_len)
+		: !http_parser_parse_status_line (self, line, line_len)))
+		return error_set (e, "invalid start line");
+	if (self->version_major != 1)
+		return error_set (e, "unsupported HTTP version");
+
+	while (http_parser_next_line (&p, end, &line, &line_len) && line_len)
+	{
+		// Obsolete line folding is something we may reject
+		if (http_tokenizer_is_whitespace (*line)
+		 || !http_parser_parse_header (self, line, line_len))
+			return error_set (e, "invalid header field");
+	}
+
+	// Only fill this in now, as the array may have been reallocated
+	memset (self->known, 0, sizeof self->known);
+	for (size_t i = self->headers_len; i--; )
+		self->known[self->headers[i].id] = &self->headers[i];
+	return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// Check whether a comma-separated header list contains a token
+static bool
+http_parser_list_has (const struct http_parser *self,
+	enum http_header_id id, const char *token)
+{
+	size_t token_len = strlen (token);
+	for (size_t i = 0; i < self->headers_len; i++)
+	{
+		const struct http_header *header = &self->headers[i];
+		if (header->id != id)
+			continue;
+
+		const char *p = header->value, *end = p + header->value_len;
+		while (p < end)
+		{
+			p += http_span (p, end - p, HTTP_CLASS_WHITESPACE);
+			size_t len = http_span (p, end - p, HTTP_CLASS_TCHAR);
+			if (len == token_len && !strncasecmp_ascii (p, token, len))
+				return true;
+
+			const char *comma = memchr (p, ',', end - p);
+			p = comma ? comma + 1 : end;
+		}
+	}
+	return false;
+}
+
+/// Check whether the last transfer coding is "chunked"
+static bool
+http_parser_is_chunked (const struct http_parser *self)
+{
+	const struct http_header *last = NULL;
+	for (size_t i = 0; i < self->headers_len; i++)
+		if (self->headers[i].id == HTTP_HEADER_TRANSFER_ENCODING)
+			last = &self->headers[i];
+
+	const char *p = last->value, *end = p + last->value_len;
+	for (const char *comma; (comma = memchr (p, ',', end - p)); )
+		p = comma + 1;
+
+	p += http_span (p, end - p, HTTP_CLASS_WHITESPACE);
+	return end - p == 7 && !strncasecmp_ascii (p, "chunked", 7);
+}
+
+static bool
+http_parser_parse_content_length (struct http_parser *self,
+	struct error **e)
+{
+	bool seen = false;
+	for (size_t i = 0; i < self->headers_len; i++)
+	{
+		const struct http_header *header = &self->headers[i];
+		if (header->id != HTTP_HEADER_CONTENT_LENGTH)
+			continue;
+
+		uint64_t value = 0;
+		if (!header->value_len)
+			return error_set (e, "invalid Content-Length");
+		for (size_t k = 0; k < header->value_len; k++)
+		{
+			int c = header->value[k];
+			if (!isdigit_ascii (c) || value > (UINT64_MAX - 9) / 10)
+				return error_set (e, "invalid Content-Length");
+			value = value * 10 + (c - '0');
+		}
+
+		// Differing values would allow for request smuggling
+		if (seen && value != self->content_remaining)
+			return error_set (e, "conflicting Content-Length");
+		self->content_remaining = value;
+		seen = true;
+	}
+	return true;
+}
+
+/// Figure out how the message body is delimited
+static bool
+http_parser_set_framing (struct http_parser *self, struct error **e)
+{
+	bool version_1_1 = self->version_minor >= 1;
+	if (http_parser_list_has (self, HTTP_HEADER_CONNECTION, "close"))
+		self->keep_alive = false;
+	else if (version_1_1)
+		self->keep_alive = true;
+	else
+		self->keep_alive =
+			http_parser_list_has (self, HTTP_HEADER_CONNECTION, "keep-alive");
+
+	self->chunked = false;
+	self->no_body = false;
+	self->content_remaining = 0;
+
+	if (self->type == HTTP_PARSER_RESPONSE
+	 && ((self->status >= 100 && self->status < 200)
+	  || self->status == 204 || self->status == 304))
+		self->no_body = true;
+
+	if (self->known[HTTP_HEADER_TRANSFER_ENCODING])
+	{
+		if (self->known[HTTP_HEADER_CONTENT_LENGTH])
+			return error_set (e, "both Transfer-Encoding and Content-Length");
+		if (!version_1_1)
+			return error_set (e, "Transfer-Encoding in HTTP/1.0");
+
+		self->chunked = http_parser_is_chunked (self);
+		if (!self->chunked && self->type == HTTP_PARSER_REQUEST)
+			return error_set (e, "unsupported Transfer-Encoding");
+		if (!self->chunked)
+			self->keep_alive = false;
+		return true;
+	}
+	if (self->known[HTTP_HEADER_CONTENT_LENGTH])
+		return http_parser_parse_content_length (self, e);
+
+	// Responses without a length are delimited by the connection closing
+	if (self->type == HTTP_PARSER_RESPONSE)
+		self->keep_alive = false;
+	return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// Each of these processes a prefix of the input, returning its length,
+// or -1 on failure; 0 means that more data is needed
+
+static ssize_t
+http_parser_fail (struct error **e, const char *message)
+{
+	error_set (e, "%s", message);
+	return -1;
+}
+
+static ssize_t
+http_parser_end_message (struct http_parser *self, size_t consumed)
+{
+	self->state = HTTP_PARSER_HEAD;
+	if (!self->on_content (self->user_data, NULL, 0))
+		return -1;
+	return consumed;
+}
+
+static bool
+http_parser_on_chunk_data (void *user_data, const void *data, size_t len)
+{
+	struct http_parser *self = user_data;
+	return self->on_content (self->user_data, data, len);
+}
+
+static bool
+http_parser_on_chunk_trailer (void *user_data,
+	const struct http_header *field)
+{
+	struct http_parser *self = user_data;
+	return !self->on_trailer || self->on_trailer (self->user_data, field);
+}
+
+static void
+http_parser_start_chunked (struct http_parser *self)
+{
+	struct http_chunked_decoder *decoder = &self->chunked_decoder;
+	http_chunked_decoder_reset (decoder);
+	decoder->on_data = http_parser_on_chunk_data;
+	decoder->on_trailer = http_parser_on_chunk_trailer;
+	decoder->user_data = self;
+	self->state = HTTP_PARSER_CHUNKED;
+}
+
+static ssize_t
+http_parser_head (struct http_parser *self,
+	const char *p, size_t len, struct error **e)
+{
+	// Servers should ignore at least one empty line before a request
+	if (*p == '\n')
+		return 1;
+	if (*p == '\r' && len < 2)
+		return 0;
+	if (*p == '\r')
+		return p[1] == '\n' ? 2 : http_parser_fail (e, "invalid CR");
+
+	size_t head_len = http_parser_find_head_end (p, len, &self->head_scanned);
+	if (!head_len)
+	{
+		if (len > self->max_head_len)
+			return http_parser_fail (e, "message head is too long");
+		return 0;
+	}
+
+	self->head_scanned = 0;
+	if (!http_parser_parse_head (self, p, head_len, e)
+	 || !http_parser_set_framing (self, e))
+		return -1;
+	if (!self->on_headers_read (self->user_data))
+		return -1;
+
+	if (self->no_body)
+		return http_parser_end_message (self, head_len);
+	if (self->chunked)
+		http_parser_start_chunked (self);
+	else if (self->known[HTTP_HEADER_CONTENT_LENGTH])
+		self->state = HTTP_PARSER_BODY;
+	else if (self->type == HTTP_PARSER_RESPONSE)
+		self->state = HTTP_PARSER_UNTIL_EOF;
+	else
+		return http_parser_end_message (self, head_len);
+
+	if (self->state == HTTP_PARSER_BODY && !self->content_remaining)
+		return http_parser_end_message (self, head_len);
+	return head_len;
+}
+
+static ssize_t
+http_parser_content (struct http_parser *self, const char *p, size_t len)
+{
+	size_t n = MIN (len, self->content_remaining);
+	if (!self->on_content (self->user_data, p, n))
+		return -1;
+
+	if ((self->content_remaining -= n))
+		return n;
+	return http_parser_end_message (self, n);
+}
+
+static ssize_t
+http_parser_chunked (struct http_parser *self,
+	const char *p, size_t len, struct error **e)
+{
+	ssize_t processed =
+		http_chunked_decoder_push (&self->chunked_decoder, p, len, e);
+	if (processed == -1
+	 || self->chunked_decoder.state != HTTP_CHUNKED_DONE)
+		return processed;
+	return http_parser_end_message (self, processed);
+}
+
+static ssize_t
+http_parser_step (struct http_parser *self,
+	const char *p, size_t len, struct error **e)
+{
+	switch (self->state)
+	{
+	case HTTP_PARSER_HEAD:
+		return http_parser_head (self, p, len, e);
+	case HTTP_PARSER_BODY:
+		return http_parser_content (self, p, len);
+	case HTTP_PARSER_CHUNKED:
+		return http_parser_chunked (self, p, len, e);
+	case HTTP_PARSER_UNTIL_EOF:
+		return self->on_content (self->user_data, p, len) ? (ssize_t) len : -1;
+	}
+	return -1;
+}
+
+/// Process incoming data; len == 0 means end of file.
+/// Any number of pipelined messages can be processed in one go.
+static bool
+http_parser_push (struct http_parser *self,
+	const void *data, size_t len, struct error **e)
+{
+	if (!len)
+	{
+		if (self->state == HTTP_PARSER_UNTIL_EOF)
+			return http_parser_end_message (self, 0) != -1;
+		if (self->state != HTTP_PARSER_HEAD || self->input.len)
+			return error_set (e, "premature EOF");
+		return true;
+	}
+
+	// Only a split message head gets buffered, line by line, so that
+	// whatever follows it can be used in place again
+	const char *p = data, *end = p + len;
+	ssize_t processed = 0;
+	while (self->input.len && p < end && processed != -1)
+	{
+		const char *nl = memchr (p, '\n', end - p);
+		const char *line_end = nl ? nl + 1 : end;
+		str_append_data (&self->input, p, line_end - p);
+		p = line_end;
+
+		const char *q = self->input.str, *q_end = q + self->input.len;
+		while (q < q_end
+			&& (processed = http_parser_step (self, q, q_end - q, e)) > 0)
+			q += processed;
+		str_remove_slice (&self->input, 0, q - self->input.str);
+	}
+
+	while (p < end && processed != -1
+		&& (processed = http_parser_step (self, p, end - p, e)) > 0)
+		p += processed;
+	if (processed == -1)
+		return false;
+
+	str_append_data (&self->input, p, end - p);
+	return true;
+}
+
+#endif
+
+#ifdef LIBERTY_WANT_PROTO_SCGI
+
+// --- SCGI --------------------------------------------------------------------
+
+enum scgi_parser_state
+{
+	SCGI_READING_NETSTRING_LENGTH,      ///< The length of the header netstring
+	SCGI_READING_NAME,                  ///< Header name
+	SCGI_READING_VALUE,                 ///< Header value
+	SCGI_READING_CONTENT                ///< Incoming data
+};
+
+struct scgi_parser
+{
+	enum scgi_parser_state state;       ///< Parsing state
+	struct str input;                   ///< Input buffer
+
+	struct str_map headers;             ///< Headers parsed
+
+	size_t headers_len;                 ///< Length of the netstring contents
+	struct str name;                    ///< Header name so far
+	struct str value;                   ///< Header value so far
+
+	/// Finished parsing request headers.
+	/// Return false to abort further processing of input.
+	bool (*on_headers_read) (void *user_data);
+
+	/// Content available; len == 0 means end of file.
+	/// Return false to abort further processing of input.
+	bool (*on_content) (void *user_data, const void *data, size_t len);
+
+	void *user_data;                    ///< User data passed to callbacks
+};
+
+static struct scgi_parser
+scgi_parser_make (void)
+{
+	return (struct scgi_parser)
+	{
+		.input = str_make (),
+		.headers = str_map_make (free),
+		.name = str_make (),
+		.value = str_make (),
+	};
+}
+
+static void
+scgi_parser_free (struct scgi_parser *self)
+{
+	str_free (&self->input);
+	str_map_free (&self->headers);
+	str_free (&self->name);
+	str_free (&self->value);
+}
+
+static bool
+scgi_parser_push (struct scgi_parser *self,
+	const void *data, size_t len, struct error **e)
+{
+	if (!len)
+	{
+		if (self->state != SCGI_READING_CONTENT)
+			return error_set (e, "premature EOF");
+
+		// Indicate end of file
+		return self->on_content (self->user_data, NULL, 0);
+	}
+
+	// Notice that this madness is significantly harder to parse than FastCGI;
+	// this procedure could also be optimized significantly
+	str_append_data (&self->input, data, len);
+
+	bool keep_running = true;
+	while (keep_running)
+	switch (self->state)
+	{
+	case SCGI_READING_NETSTRING_LENGTH:
+	{
+		if (self->input.len < 1)
+			return true;
+
+		char digit = *self->input.str;
+		// XXX: this allows for omitting the netstring length altogether
+		if (digit == ':')
+		{
+			self->state = SCGI_READING_NAME;
+			str_remove_slice (&self->input, 0, 1);
+			break;
+		}
+
+		if (digit < '0' || digit > '9')
+			return error_set (e, "invalid header netstring");
+
+		size_t new_len = self->headers_len * 10 + (digit - '0');
+		if (new_len < self->headers_len)
+			return error_set (e, "header netstring is too long");
+
+		self->headers_len = new_len;
+		str_remove_slice (&self->input, 0, 1);
+		break;
+	}
+	case SCGI_READING_NAME:
+	{
+		if (self->input.len < 1)
+			return true;
+
+		char c = *self->input.str;
+		if (!self->headers_len)
+		{
+			// The netstring is ending but we haven't finished parsing it,
+			// or the netstring doesn't end with a comma
+			if (self->name.len || c != ',')
+				return error_set (e, "invalid header netstring");
+
+			self->state = SCGI_READING_CONTENT;
+			keep_running = self->on_headers_read (self->user_data);
+		}
+		else if (c != '\0')
+			str_append_c (&self->name, c);
+		else
+			self->state = SCGI_READING_VALUE;
+
+		str_remove_slice (&self->input, 0, 1);
+		self->headers_len--;
+		break;
+	}
+	case SCGI_READING_VALUE:
+	{
+		if (self->input.len < 1)
+			return true;
+
+		char c = *self->input.str;
+		if (!self->headers_len)
+		{
+			// The netstring is ending but we haven't finished parsing it
+			return error_set (e, "invalid header netstring");
+		}
+		else if (c != '\0')
+			str_append_c (&self->value, c);
+		else
+		{
+			// We've got a name-value pair, let's put it in the map
+			str_map_set (&self->headers,
+				self->name.str, str_steal (&self->value));
+
+			str_reset (&self->name);
+			self->value = str_make ();
+
+			self->state = SCGI_READING_NAME;
+		}
+
+		str_remove_slice (&self->input, 0, 1);
+		self->headers_len--;
+		break;
+	}
+	case SCGI_READING_CONTENT:
+		keep_running = self->on_content
+			(self->user_data, self->input.str, self->input.len);
+		str_remove_slice (&self->input, 0, self->input.len);
+		return keep_running;
+	}
+	return false;
+}
+
+#endif
+
+#ifdef LIBERTY_WANT_PROTO_FASTCGI
+
+// --- FastCGI -----------------------------------------------------------------
+
+// Constants from the FastCGI specification document
+
+#define FCGI_HEADER_LEN       8
+
+#define FCGI_VERSION_1        1
+#define FCGI_NULL_REQUEST_ID  0
+#define FCGI_KEEP_CONN        1
+
+enum fcgi_type
+{
+	FCGI_BEGIN_REQUEST     =  1,
+	FCGI_ABORT_REQUEST     =  2,
+	FCGI_END_REQUEST       =  3,
+	FCGI_PARAMS            =  4,
+	FCGI_STDIN             =  5,
+	FCGI_STDOUT            =  6,
+	FCGI_STDERR            =  7,
+	FCGI_DATA              =  8,
+	FCGI_GET_VALUES        =  9,
+	FCGI_GET_VALUES_RESULT = 10,
+	FCGI_UNKNOWN_TYPE      = 11,
+	FCGI_MAXTYPE           = FCGI_UNKNOWN_TYPE
+};
+
+enum fcgi_role
+{
+	FCGI_RESPONDER         =  1,
+	FCGI_AUTHORIZER        =  2,
+	FCGI_FILTER            =  3
+};
+
+enum fcgi_protocol_status
 {
 	FCGI_REQUEST_COMPLETE  =  0,
 	FCGI_CANT_MPX_CONN     =  1,
@@ -787,278 +1734,945 @@ enum fcgi_protocol_status
 	FCGI_UNKNOWN_ROLE      =  3
 };
 
-#define FCGI_MAX_CONNS   "FCGI_MAX_CONNS"
-#define FCGI_MAX_REQS    "FCGI_MAX_REQS"
-#define FCGI_MPXS_CONNS  "FCGI_MPXS_CONNS"
+#define FCGI_MAX_CONNS   "FCGI_MAX_CONNS"
+#define FCGI_MAX_REQS    "FCGI_MAX_REQS"
+#define FCGI_MPXS_CONNS  "FCGI_MPXS_CONNS"
+
+// - - Message stream parser - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+struct fcgi_parser;
+
+/// Message handler, returns false if further processing should be stopped
+typedef bool (*fcgi_message_fn)
+	(const struct fcgi_parser *parser, void *user_data);
+
+struct fcgi_parser
+{
+	struct str input;                   ///< Incomplete record carried over
+
+	// The next block of fields is considered public:
+
+	uint8_t version;                    ///< FastCGI protocol version
+	uint8_t type;                       ///< FastCGI record type
+	uint16_t request_id;                ///< FastCGI request ID
+	const char *content;                ///< Message data, not null-terminated
+
+	uint16_t content_length;            ///< Message content length
+	uint8_t padding_length;             ///< Message padding length
+
+	/// Callback on message.  The content only lives until it returns,
+	/// as it usually points straight into the data being pushed.
+	fcgi_message_fn on_message;
+	void *user_data;                    ///< User data
+};
+
+static struct fcgi_parser
+fcgi_parser_make (void)
+{
+	return (struct fcgi_parser) { .input = str_make () };
+}
+
+static void
+fcgi_parser_free (struct fcgi_parser *self)
+{
+	str_free (&self->input);
+}
+
+/// Return how many bytes of the record starting with @a header we need
+static size_t
+fcgi_parser_record_len (const uint8_t *header)
+{
+	return FCGI_HEADER_LEN + peek_u16be (header + 4) + header[6];
+}
+
+/// Return how many bytes of input we need to finish the carried over record
+static size_t
+fcgi_parser_wanted (const struct fcgi_parser *self)
+{
+	if (self->input.len < FCGI_HEADER_LEN)
+		return FCGI_HEADER_LEN;
+	return fcgi_parser_record_len ((const uint8_t *) self->input.str);
+}
+
+static bool
+fcgi_parser_dispatch (struct fcgi_parser *self, const uint8_t *record)
+{
+	self->version        = record[0];
+	self->type           = record[1];
+	self->request_id     = peek_u16be (record + 2);
+	self->content_length = peek_u16be (record + 4);
+	self->padding_length = record[6];
+	self->content        = (const char *) record + FCGI_HEADER_LEN;
+
+	return self->on_message (self, self->user_data);
+}
+
+static bool
+fcgi_parser_push (struct fcgi_parser *self, const void *data, size_t len)
+{
+	const uint8_t *p = data, *end = p + len;
+
+	// Only a record that has been cut off by the end of the previous push
+	// needs to be buffered, and we only take as much as it is missing
+	size_t wanted;
+	while (self->input.len
+		&& self->input.len < (wanted = fcgi_parser_wanted (self)))
+	{
+		if (p == end)
+			return true;
+
+		size_t n = MIN (wanted - self->input.len, (size_t) (end - p));
+		str_append_data (&self->input, p, n);
+		p += n;
+	}
+	if (self->input.len)
+	{
+		const uint8_t *record = (const uint8_t *) self->input.str;
+		bool ok = fcgi_parser_dispatch (self, record);
+		str_remove_slice (&self->input, 0, self->input.len);
+		if (!ok)
+			return false;
+	}
+
+	// Everything else is processed in place, so that even large STDIN records
+	// reach the callback without being copied anywhere
+	while ((size_t) (end - p) >= FCGI_HEADER_LEN
+		&& (size_t) (end - p) >= (wanted = fcgi_parser_record_len (p)))
+	{
+		const uint8_t *record = p;
+		p += wanted;
+		if (!fcgi_parser_dispatch (self, record))
+			return false;
+	}
+
+	str_append_data (&self->input, p, end - p);
+	return true;
+}
+
+// - - Name-value pair parser  - - - - - - - - - - - - - - - - - - - - - - - - -
+
+struct fcgi_nv_pair
+{
+	const char *name;                   ///< The name, not 0-terminated
+	const char *value;                  ///< The value, not 0-terminated
+	uint32_t name_len;                  ///< Length of the name
+	uint32_t value_len;                 ///< Length of the value
+};
+
+/// Decode a length, returning the number of octets used, or 0 if incomplete
+static size_t
+fcgi_nv_decode_len (const uint8_t *p, size_t len, uint32_t *result)
+{
+	if (!len)
+		return 0;
+	if (!(p[0] >> 7))
+	{
+		*result = p[0];
+		return 1;
+	}
+	if (len < 4)
+		return 0;
+	*result = peek_u32be (p) & ~(1U << 31);
+	return 4;
+}
 
-// - - Message stream parser - - - - - - - - - - - - - - - - - - - - - - - - - -
+/// Decode a name-value pair, returning its length, or 0 if incomplete
+static size_t
+fcgi_nv_decode (const char *data, size_t len, struct fcgi_nv_pair *pair)
+{
+	const uint8_t *p = (const uint8_t *) data;
+	size_t name_len_len, value_len_len;
+	if (!(name_len_len = fcgi_nv_decode_len (p, len, &pair->name_len))
+	 || !(value_len_len = fcgi_nv_decode_len (p + name_len_len,
+			len - name_len_len, &pair->value_len)))
+		return 0;
+
+	size_t header_len = name_len_len + value_len_len;
+	if (len - header_len < (size_t) pair->name_len + pair->value_len)
+		return 0;
+
+	pair->name = data + header_len;
+	pair->value = pair->name + pair->name_len;
+	return header_len + pair->name_len + pair->value_len;
+}
 
-struct fcgi_parser;
+/// Store a pair in the map, copying the value to the given buffer.
+/// The key buffer is only used to 0-terminate the name.
+static void
+fcgi_nv_store (struct str_map *output, struct str *key,
+	const struct fcgi_nv_pair *pair, char *value)
+{
+	memcpy (value, pair->value, pair->value_len);
+	value[pair->value_len] = '\0';
 
-/// Message handler, returns false if further processing should be stopped
-typedef bool (*fcgi_message_fn)
-	(const struct fcgi_parser *parser, void *user_data);
+	str_reset (key);
+	str_append_data (key, pair->name, pair->name_len);
+	str_map_set (output, key->str, value);
+}
+
+/// Parse a complete name-value pair stream, such as FCGI_PARAMS, at once.
+/// With @a values, all values are stored in a single allocation returned
+/// there, which must outlive the map, and the map mustn't free its values.
+/// Otherwise, values are allocated separately.
+static bool
+fcgi_nv_parse (const void *data, size_t len,
+	struct str_map *output, char **values)
+{
+	const char *p = data, *end = p + len;
+	struct fcgi_nv_pair pair;
+	size_t pair_len, pairs = 0, values_len = 0;
+
+	// Validate and count the pairs first, so that we only allocate once
+	for (; p != end; p += pair_len, pairs++)
+	{
+		if (!(pair_len = fcgi_nv_decode (p, end - p, &pair)))
+			return false;
+		values_len += pair.value_len + 1;
+	}
+	str_map_reserve (output, output->len + pairs);
+
+	char *arena = NULL;
+	if (values)
+		*values = arena = xmalloc (values_len + 1);
+
+	struct str key = str_make ();
+	for (p = data; p != end; p += pair_len)
+	{
+		pair_len = fcgi_nv_decode (p, end - p, &pair);
+		if (!arena)
+			fcgi_nv_store (output, &key, &pair, xmalloc (pair.value_len + 1));
+		else
+		{
+			fcgi_nv_store (output, &key, &pair, arena);
+			arena += pair.value_len + 1;
+		}
+	}
+	str_free (&key);
+	return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-enum fcgi_parser_state
+// An incremental parser, for when the stream arrives piecewise
+
+struct fcgi_nv_parser
 {
-	FCGI_READING_HEADER,                ///< Reading the fixed header portion
-	FCGI_READING_CONTENT,               ///< Reading the message content
-	FCGI_READING_PADDING                ///< Reading the padding
+	struct str_map *output;             ///< Where the pairs will be stored
+
+	struct str input;                   ///< Incomplete pair
+	struct str key;                     ///< Buffer for the current name
 };
 
-struct fcgi_parser
+static struct fcgi_nv_parser
+fcgi_nv_parser_make (void)
 {
-	enum fcgi_parser_state state;       ///< Parsing state
-	struct str input;                   ///< Input buffer
+	return (struct fcgi_nv_parser)
+		{ .input = str_make (), .key = str_make () };
+}
 
-	// The next block of fields is considered public:
+static void
+fcgi_nv_parser_free (struct fcgi_nv_parser *self)
+{
+	str_free (&self->input);
+	str_free (&self->key);
+}
 
-	uint8_t version;                    ///< FastCGI protocol version
-	uint8_t type;                       ///< FastCGI record type
-	uint16_t request_id;                ///< FastCGI request ID
-	struct str content;                 ///< Message data
+static void
+fcgi_nv_parser_push (struct fcgi_nv_parser *self, const void *data, size_t len)
+{
+	// Only incomplete pairs get buffered, everything else is read in place
+	const char *p = data, *end = p + len;
+	bool buffered = self->input.len != 0;
+	if (buffered)
+	{
+		str_append_data (&self->input, data, len);
+		p = self->input.str;
+		end = p + self->input.len;
+	}
 
-	uint16_t content_length;            ///< Message content length
-	uint8_t padding_length;             ///< Message padding length
+	struct fcgi_nv_pair pair;
+	size_t pair_len;
+	for (; (pair_len = fcgi_nv_decode (p, end - p, &pair)); p += pair_len)
+		fcgi_nv_store (self->output, &self->key, &pair,
+			xmalloc (pair.value_len + 1));
 
-	fcgi_message_fn on_message;         ///< Callback on message
-	void *user_data;                    ///< User data
+	if (buffered)
+		str_remove_slice (&self->input, 0, p - self->input.str);
+	else
+		str_append_data (&self->input, p, end - p);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void
+fcgi_nv_convert_len (size_t len, struct str *output)
+{
+	if (len < 0x80)
+		str_pack_u8 (output, len);
+	else
+	{
+		len |= (uint32_t) 1 << 31;
+		str_pack_u32 (output, len);
+	}
+}
+
+static size_t
+fcgi_nv_convert_len_size (size_t len)
+{
+	return len < 0x80 ? 1 : 4;
+}
+
+static void
+fcgi_nv_convert (struct str_map *map, struct str *output)
+{
+	// Compute the final size first, so that the output only grows once
+	size_t size = 0;
+	struct str_map_iter iter = str_map_iter_make (map);
+	while (str_map_iter_next (&iter))
+	{
+		size_t name_len  = iter.link->key_length;
+		size_t value_len = strlen (iter.link->data);
+		size += fcgi_nv_convert_len_size (name_len)  + name_len
+			+ fcgi_nv_convert_len_size (value_len) + value_len;
+	}
+	str_reserve (output, size);
+
+	iter = str_map_iter_make (map);
+	while (str_map_iter_next (&iter))
+	{
+		const char *name  = iter.link->key;
+		const char *value = iter.link->data;
+		size_t name_len   = iter.link->key_length;
+		size_t value_len  = strlen (value);
+
+		fcgi_nv_convert_len (name_len,  output);
+		fcgi_nv_convert_len (value_len, output);
+		str_append_data (output, name,  name_len);
+		str_append_data (output, value, value_len);
+	}
+}
+
+// - - Stream writer - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// Splits a stream such as FCGI_STDOUT into records.  Small writes are copied
+// and coalesced into full records, large ones are passed through untouched,
+// with headers and padding provided in separate buffers.
+
+/// The specification recommends aligning records to 8 bytes
+#define FCGI_ALIGNMENT          8
+/// The largest aligned record content length
+#define FCGI_MAX_CONTENT        (UINT16_MAX & ~(FCGI_ALIGNMENT - 1))
+/// Writes shorter than this get copied into the buffer
+#define FCGI_WRITER_COPY_LIMIT  4096
+/// The maximum number of records in one call to the write callback
+#define FCGI_WRITER_BATCH       16
+
+struct fcgi_writer
+{
+	enum fcgi_type type;                ///< Stream record type
+	uint16_t request_id;                ///< Request ID
+	struct str buffer;                  ///< Header space and coalesced data
+
+	void *user_data;                    ///< User data for callbacks
+
+	/// Write out records; the data is only valid for the duration of the call
+	void (*write_cb) (void *user_data, const struct iovec *iov, int iovcnt);
 };
 
-static struct fcgi_parser
-fcgi_parser_make (void)
+struct fcgi_writer_batch
+{
+	struct iovec iov[3 * FCGI_WRITER_BATCH];    ///< Header, content, padding
+	int iovcnt;                                 ///< Number of used vectors
+	uint8_t headers[FCGI_WRITER_BATCH][FCGI_HEADER_LEN];    ///< Headers
+	size_t headers_len;                         ///< Number of used headers
+};
+
+static const char fcgi_padding[FCGI_ALIGNMENT];
+
+static void
+fcgi_pack_header (uint8_t *header, enum fcgi_type type, uint16_t request_id,
+	uint16_t content_length, uint8_t padding_length)
+{
+	header[0] = FCGI_VERSION_1;
+	header[1] = type;
+	header[2] = request_id >> 8;
+	header[3] = request_id;
+	header[4] = content_length >> 8;
+	header[5] = content_length;
+	header[6] = padding_length;
+	header[7] = 0;
+}
+
+static struct fcgi_writer
+fcgi_writer_make (enum fcgi_type type, uint16_t request_id)
 {
-	return (struct fcgi_parser)
-		{ .input = str_make (), .content = str_make () };
+	struct fcgi_writer self = { .type = type, .request_id = request_id };
+	self.buffer = str_make ();
+	str_append_data (&self.buffer, fcgi_padding, FCGI_HEADER_LEN);
+	return self;
 }
 
 static void
-fcgi_parser_free (struct fcgi_parser *self)
+fcgi_writer_free (struct fcgi_writer *self)
 {
-	str_free (&self->input);
-	str_free (&self->content);
+	str_free (&self->buffer);
 }
 
 static void
-fcgi_parser_unpack_header (struct fcgi_parser *self)
+fcgi_writer_batch_flush (struct fcgi_writer *self,
+	struct fcgi_writer_batch *batch)
 {
-	struct msg_unpacker unpacker =
-		msg_unpacker_make (self->input.str, self->input.len);
+	if (batch->iovcnt)
+		self->write_cb (self->user_data, batch->iov, batch->iovcnt);
+	batch->iovcnt = 0;
+	batch->headers_len = 0;
+}
 
-	bool success = true;
-	uint8_t reserved;
-	success &= msg_unpacker_u8  (&unpacker, &self->version);
-	success &= msg_unpacker_u8  (&unpacker, &self->type);
-	success &= msg_unpacker_u16 (&unpacker, &self->request_id);
-	success &= msg_unpacker_u16 (&unpacker, &self->content_length);
-	success &= msg_unpacker_u8  (&unpacker, &self->padding_length);
-	success &= msg_unpacker_u8  (&unpacker, &reserved);
-	hard_assert (success);
+static void
+fcgi_writer_batch_add (struct fcgi_writer *self,
+	struct fcgi_writer_batch *batch,
+	enum fcgi_type type, const void *data, size_t len)
+{
+	hard_assert (len <= UINT16_MAX);
+	if (batch->headers_len == FCGI_WRITER_BATCH)
+		fcgi_writer_batch_flush (self, batch);
+
+	size_t padding = -len & (FCGI_ALIGNMENT - 1);
+	uint8_t *header = batch->headers[batch->headers_len++];
+	fcgi_pack_header (header, type, self->request_id, len, padding);
+
+	struct iovec *iov = batch->iov;
+	iov[batch->iovcnt++] = (struct iovec) { header, FCGI_HEADER_LEN };
+	if (len)
+		iov[batch->iovcnt++] = (struct iovec) { (void *) data, len };
+	if (padding)
+		iov[batch->iovcnt++] =
+			(struct iovec) { (void *) fcgi_padding, padding };
+}
 
-	str_remove_slice (&self->input, 0, unpacker.offset);
+/// Turn any coalesced data into a record within the batch.  The buffer must
+/// be reset with fcgi_writer_batch_commit() afterwards.
+static void
+fcgi_writer_batch_add_buffer (struct fcgi_writer *self,
+	struct fcgi_writer_batch *batch)
+{
+	size_t len = self->buffer.len - FCGI_HEADER_LEN;
+	if (!len)
+		return;
+
+	// The header goes into the headroom, so that it's all just one vector
+	size_t padding = -len & (FCGI_ALIGNMENT - 1);
+	fcgi_pack_header ((uint8_t *) self->buffer.str,
+		self->type, self->request_id, len, padding);
+	str_append_data (&self->buffer, fcgi_padding, padding);
+
+	if (batch->headers_len == FCGI_WRITER_BATCH)
+		fcgi_writer_batch_flush (self, batch);
+	batch->iov[batch->iovcnt++] =
+		(struct iovec) { self->buffer.str, self->buffer.len };
+	batch->headers_len++;
 }
 
-static bool
-fcgi_parser_push (struct fcgi_parser *self, const void *data, size_t len)
+static void
+fcgi_writer_batch_commit (struct fcgi_writer *self,
+	struct fcgi_writer_batch *batch)
 {
-	// This could be made considerably faster for high-throughput applications
-	// if we use a circular buffer instead of constantly calling memmove()
-	str_append_data (&self->input, data, len);
+	fcgi_writer_batch_flush (self, batch);
+	str_remove_slice (&self->buffer,
+		FCGI_HEADER_LEN, self->buffer.len - FCGI_HEADER_LEN);
+}
 
-	while (true)
-	switch (self->state)
+/// Write out any coalesced data
+static void
+fcgi_writer_flush (struct fcgi_writer *self)
+{
+	struct fcgi_writer_batch batch = {};
+	fcgi_writer_batch_add_buffer (self, &batch);
+	fcgi_writer_batch_commit (self, &batch);
+}
+
+static void
+fcgi_writer_write (struct fcgi_writer *self, const void *data, size_t len)
+{
+	if (len < FCGI_WRITER_COPY_LIMIT)
 	{
-	case FCGI_READING_HEADER:
-		if (self->input.len < FCGI_HEADER_LEN)
-			return true;
+		if (self->buffer.len - FCGI_HEADER_LEN + len > FCGI_MAX_CONTENT)
+			fcgi_writer_flush (self);
+		str_append_data (&self->buffer, data, len);
+		return;
+	}
 
-		fcgi_parser_unpack_header (self);
-		self->state = FCGI_READING_CONTENT;
-		break;
-	case FCGI_READING_CONTENT:
-		if (self->input.len < self->content_length)
-			return true;
+	struct fcgi_writer_batch batch = {};
+	fcgi_writer_batch_add_buffer (self, &batch);
+	for (const char *p = data; len; )
+	{
+		size_t chunk = MIN (len, FCGI_MAX_CONTENT);
+		fcgi_writer_batch_add (self, &batch, self->type, p, chunk);
+		p += chunk;
+		len -= chunk;
+	}
+	fcgi_writer_batch_commit (self, &batch);
+}
 
-		// Move an appropriate part of the input buffer to the content buffer
-		str_reset (&self->content);
-		str_append_data (&self->content, self->input.str, self->content_length);
-		str_remove_slice (&self->input, 0, self->content_length);
-		self->state = FCGI_READING_PADDING;
-		break;
-	case FCGI_READING_PADDING:
-		if (self->input.len < self->padding_length)
-			return true;
+/// Terminate the stream and send an FCGI_END_REQUEST record
+static void
+fcgi_writer_end_request (struct fcgi_writer *self,
+	uint32_t app_status, enum fcgi_protocol_status protocol_status)
+{
+	uint8_t content[8] = { app_status >> 24, app_status >> 16,
+		app_status >> 8, app_status, protocol_status };
+
+	struct fcgi_writer_batch batch = {};
+	fcgi_writer_batch_add_buffer (self, &batch);
+	fcgi_writer_batch_add (self, &batch, self->type, NULL, 0);
+	fcgi_writer_batch_add (self, &batch,
+		FCGI_END_REQUEST, content, sizeof content);
+	fcgi_writer_batch_commit (self, &batch);
+}
+
+// - - Request multiplexer - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// Implements the application side of a FastCGI connection, which may carry
+// any number of concurrent requests.  Only the Responder role is supported.
+
+struct fcgi_muxer;
+
+enum fcgi_request_state
+{
+	FCGI_REQUEST_PARAMS,                ///< Reading headers
+	FCGI_REQUEST_STDIN,                 ///< Reading input
+	FCGI_REQUEST_STDIN_EOF              ///< Input has ended
+};
+
+struct fcgi_request
+{
+	struct fcgi_muxer *muxer;           ///< The parent muxer
+	uint16_t request_id;                ///< The ID of this request
+	uint8_t flags;                      ///< Request flags
+
+	enum fcgi_request_state state;      ///< Parsing state
+	bool started;                       ///< Accepted by request_start_cb
+	struct str_map headers;             ///< Headers
+	struct str params;                  ///< Raw FCGI_PARAMS stream
+	char *params_values;                ///< Storage for header values
+	struct fcgi_writer output;          ///< Output stream writer
+
+	void *handler_data;                 ///< Handler data
+};
+
+struct fcgi_muxer
+{
+	struct fcgi_parser parser;          ///< FastCGI message parser
+
+	struct fcgi_request **requests;     ///< Request ID -> request, or NULL
+	size_t requests_alloc;              ///< Number of allocated entries
+	size_t requests_active;             ///< Number of active requests
+
+	size_t max_requests;                ///< Limit of concurrent requests
+	bool in_push;                       ///< Processing input right now
+	bool closing;                       ///< Waiting to close the transport
+
+	// User configuration:
+
+	void *user_data;                    ///< User data for callbacks
+
+	/// Write data to the underlying transport.  The data is only valid
+	/// for the duration of the call.
+	void (*write_cb) (void *user_data, const struct iovec *iov, int iovcnt);
+
+	/// Close the underlying transport.  It is safe to destroy the muxer
+	/// from within the callback.
+	void (*close_cb) (void *user_data);
+
+	/// Start processing a request, once all of its headers are known.
+	/// Return false to reject it.  The request may also be finished
+	/// from within the callback, in which case the return value is ignored.
+	bool (*request_start_cb) (struct fcgi_request *request);
+
+	/// Handle incoming data; len == 0 means end of file.
+	/// The request may be finished from within the callback.
+	void (*request_push_cb)
+		(struct fcgi_request *request, const void *data, size_t len);
+
+	/// The request is being destroyed, release any handler data
+	void (*request_finalize_cb) (struct fcgi_request *request);
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void
+fcgi_muxer_send (struct fcgi_muxer *self,
+	enum fcgi_type type, uint16_t request_id, const void *data, size_t len)
+{
+	hard_assert (len <= UINT16_MAX);
+
+	uint8_t header[FCGI_HEADER_LEN];
+	size_t padding = -len & (FCGI_ALIGNMENT - 1);
+	fcgi_pack_header (header, type, request_id, len, padding);
+
+	struct iovec iov[3] =
+	{
+		{ header, sizeof header },
+		{ (void *) data, len },
+		{ (void *) fcgi_padding, padding },
+	};
+	self->write_cb (self->user_data, iov, N_ELEMENTS (iov));
+}
+
+static void
+fcgi_muxer_send_end_request (struct fcgi_muxer *self, uint16_t request_id,
+	uint32_t app_status, enum fcgi_protocol_status protocol_status)
+{
+	uint8_t content[8] = { app_status >> 24, app_status >> 16,
+		app_status >> 8, app_status, protocol_status };
+	fcgi_muxer_send (self, FCGI_END_REQUEST, request_id,
+		content, sizeof content);
+}
+
+/// Close the transport, possibly deferred until we stop processing input
+static void
+fcgi_muxer_close (struct fcgi_muxer *self)
+{
+	self->closing = true;
+	if (!self->in_push)
+		self->close_cb (self->user_data);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static struct fcgi_request *
+fcgi_muxer_get_request (struct fcgi_muxer *self, uint16_t request_id)
+{
+	if (request_id >= self->requests_alloc)
+		return NULL;
+	return self->requests[request_id];
+}
+
+static void
+fcgi_muxer_set_request (struct fcgi_muxer *self, uint16_t request_id,
+	struct fcgi_request *request)
+{
+	// Web servers allocate request IDs from the bottom, so this stays small
+	if (request_id >= self->requests_alloc)
+	{
+		size_t old_alloc = self->requests_alloc;
+		while (self->requests_alloc <= request_id)
+			self->requests_alloc <<= 1;
+
+		self->requests = xreallocarray (self->requests,
+			self->requests_alloc, sizeof *self->requests);
+		memset (self->requests + old_alloc, 0,
+			(self->requests_alloc - old_alloc) * sizeof *self->requests);
+	}
+
+	if (request && !self->requests[request_id])
+		self->requests_active++;
+	if (!request && self->requests[request_id])
+		self->requests_active--;
+	self->requests[request_id] = request;
+}
+
+static void
+fcgi_request_on_output (void *user_data, const struct iovec *iov, int iovcnt)
+{
+	struct fcgi_request *self = user_data;
+	self->muxer->write_cb (self->muxer->user_data, iov, iovcnt);
+}
+
+static struct fcgi_request *
+fcgi_request_new (struct fcgi_muxer *muxer, uint16_t request_id, uint8_t flags)
+{
+	struct fcgi_request *self = xcalloc (1, sizeof *self);
+	self->muxer = muxer;
+	self->request_id = request_id;
+	self->flags = flags;
+
+	self->state = FCGI_REQUEST_PARAMS;
+	self->headers = str_map_make (NULL);
+	self->params = str_make ();
+
+	self->output = fcgi_writer_make (FCGI_STDOUT, request_id);
+	self->output.user_data = self;
+	self->output.write_cb = fcgi_request_on_output;
+	return self;
+}
+
+/// Destroy the request, without telling the web server anything
+static void
+fcgi_request_destroy (struct fcgi_request *self)
+{
+	// Handlers only get to know about requests that have been started
+	if (self->started && self->muxer->request_finalize_cb)
+		self->muxer->request_finalize_cb (self);
+
+	fcgi_muxer_set_request (self->muxer, self->request_id, NULL);
+	str_map_free (&self->headers);
+	str_free (&self->params);
+	free (self->params_values);
+	fcgi_writer_free (&self->output);
+	free (self);
+}
+
+/// Send response data; requests are free to interleave their outputs.
+/// Small writes are buffered until fcgi_request_flush() or the end.
+static void
+fcgi_request_write (struct fcgi_request *self, const void *data, size_t len)
+{
+	fcgi_writer_write (&self->output, data, len);
+}
+
+static void
+fcgi_request_flush (struct fcgi_request *self)
+{
+	fcgi_writer_flush (&self->output);
+}
+
+/// Finish the request, destroying it in the process
+static void
+fcgi_request_finish (struct fcgi_request *self, uint32_t app_status)
+{
+	struct fcgi_muxer *muxer = self->muxer;
+	bool keep_conn = self->flags & FCGI_KEEP_CONN;
+
+	fcgi_writer_end_request (&self->output, app_status, FCGI_REQUEST_COMPLETE);
+	fcgi_request_destroy (self);
+
+	if (!keep_conn)
+		fcgi_muxer_close (muxer);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void
+fcgi_muxer_on_get_values (struct fcgi_muxer *self,
+	const struct fcgi_parser *parser)
+{
+	struct str_map values = str_map_make (free);
+	struct str_map response = str_map_make (free);
 
-		// Call the callback to further process the message
-		if (!self->on_message (self, self->user_data))
-			return false;
+	(void) fcgi_nv_parse (parser->content, parser->content_length,
+		&values, NULL);
 
-		// Remove the padding from the input buffer
-		str_remove_slice (&self->input, 0, self->padding_length);
-		self->state = FCGI_READING_HEADER;
-		break;
+	// Only answer what we have been asked about, as per the specification
+	struct str_map_iter iter = str_map_iter_make (&values);
+	while (str_map_iter_next (&iter))
+	{
+		const char *key = iter.link->key;
+		if (!strcmp (key, FCGI_MAX_REQS))
+			str_map_set (&response, key,
+				xstrdup_printf ("%zu", self->max_requests));
+		else if (!strcmp (key, FCGI_MPXS_CONNS))
+			str_map_set (&response, key, xstrdup ("1"));
 	}
-}
 
-// - - Name-value pair parser  - - - - - - - - - - - - - - - - - - - - - - - - -
+	struct str content = str_make ();
+	fcgi_nv_convert (&response, &content);
+	fcgi_muxer_send (self, FCGI_GET_VALUES_RESULT, FCGI_NULL_REQUEST_ID,
+		content.str, content.len);
+	str_free (&content);
 
-enum fcgi_nv_parser_state
-{
-	FCGI_NV_PARSER_NAME_LEN,            ///< The first name length octet
-	FCGI_NV_PARSER_NAME_LEN_FULL,       ///< Remaining name length octets
-	FCGI_NV_PARSER_VALUE_LEN,           ///< The first value length octet
-	FCGI_NV_PARSER_VALUE_LEN_FULL,      ///< Remaining value length octets
-	FCGI_NV_PARSER_NAME,                ///< Reading the name
-	FCGI_NV_PARSER_VALUE                ///< Reading the value
-};
+	str_map_free (&values);
+	str_map_free (&response);
+}
 
-struct fcgi_nv_parser
+static void
+fcgi_muxer_on_management (struct fcgi_muxer *self,
+	const struct fcgi_parser *parser)
 {
-	struct str_map *output;             ///< Where the pairs will be stored
+	if (parser->type == FCGI_GET_VALUES)
+	{
+		fcgi_muxer_on_get_values (self, parser);
+		return;
+	}
 
-	enum fcgi_nv_parser_state state;    ///< Parsing state
-	struct str input;                   ///< Input buffer
+	uint8_t content[8] = { parser->type };
+	fcgi_muxer_send (self, FCGI_UNKNOWN_TYPE, FCGI_NULL_REQUEST_ID,
+		content, sizeof content);
+}
 
-	uint32_t name_len;                  ///< Length of the name
-	uint32_t value_len;                 ///< Length of the value
+static void
+fcgi_muxer_on_begin_request (struct fcgi_muxer *self,
+	const struct fcgi_parser *parser)
+{
+	struct msg_unpacker unpacker =
+		msg_unpacker_make (parser->content, parser->content_length);
 
-	char *name;                         ///< The current name, 0-terminated
-	char *value;                        ///< The current value, 0-terminated
-};
+	uint16_t role;
+	uint8_t flags;
+	bool success = true;
+	success &= msg_unpacker_u16 (&unpacker, &role);
+	success &= msg_unpacker_u8 (&unpacker, &flags);
+	// Ignoring 5 reserved bytes
 
-static struct fcgi_nv_parser
-fcgi_nv_parser_make (void)
-{
-	return (struct fcgi_nv_parser) { .input = str_make () };
+	// Both mistakes are the web server's fault and can only be ignored
+	if (!success
+	 || fcgi_muxer_get_request (self, parser->request_id))
+		return;
+
+	if (role != FCGI_RESPONDER)
+		fcgi_muxer_send_end_request (self,
+			parser->request_id, 0, FCGI_UNKNOWN_ROLE);
+	else if (self->closing || self->requests_active >= self->max_requests)
+		fcgi_muxer_send_end_request (self,
+			parser->request_id, 0, FCGI_OVERLOADED);
+	else
+		fcgi_muxer_set_request (self, parser->request_id,
+			fcgi_request_new (self, parser->request_id, flags));
 }
 
 static void
-fcgi_nv_parser_free (struct fcgi_nv_parser *self)
+fcgi_muxer_on_abort_request (struct fcgi_muxer *self,
+	struct fcgi_request *request)
 {
-	str_free (&self->input);
-	free (self->name);
-	free (self->value);
+	uint16_t request_id = request->request_id;
+	bool keep_conn = request->flags & FCGI_KEEP_CONN;
+
+	fcgi_request_destroy (request);
+	fcgi_muxer_send_end_request (self, request_id, 0, FCGI_REQUEST_COMPLETE);
+	if (!keep_conn)
+		fcgi_muxer_close (self);
 }
 
 static void
-fcgi_nv_parser_push (struct fcgi_nv_parser *self, const void *data, size_t len)
+fcgi_muxer_on_params (struct fcgi_muxer *self, struct fcgi_request *request,
+	const struct fcgi_parser *parser)
 {
-	// This could be optimized significantly; I'm not even trying
-	str_append_data (&self->input, data, len);
+	if (request->state != FCGI_REQUEST_PARAMS)
+		return;
 
-	while (true)
+	if (parser->content_length)
 	{
-		struct msg_unpacker unpacker =
-			msg_unpacker_make (self->input.str, self->input.len);
+		str_append_data (&request->params,
+			parser->content, parser->content_length);
+		return;
+	}
 
-	switch (self->state)
+	// An empty record terminates the stream, so we can parse it all at once
+	bool ok = fcgi_nv_parse (request->params.str, request->params.len,
+		&request->headers, &request->params_values);
+	str_free (&request->params);
+	request->params = str_make ();
+
+	if (!ok)
 	{
-		uint8_t len;
-		uint32_t len_full;
+		fcgi_request_finish (request, 0);
+		return;
+	}
 
-	case FCGI_NV_PARSER_NAME_LEN:
-		if (!msg_unpacker_u8 (&unpacker, &len))
-			return;
+	// The callback may finish the request, so mark it in advance
+	request->state = FCGI_REQUEST_STDIN;
+	request->started = true;
+	uint16_t request_id = request->request_id;
+	if (!self->request_start_cb (request)
+	 && fcgi_muxer_get_request (self, request_id) == request)
+	{
+		request->started = false;
+		fcgi_request_finish (request, 0);
+	}
+}
 
-		if (len >> 7)
-			self->state = FCGI_NV_PARSER_NAME_LEN_FULL;
-		else
-		{
-			self->name_len = len;
-			str_remove_slice (&self->input, 0, unpacker.offset);
-			self->state = FCGI_NV_PARSER_VALUE_LEN;
-		}
-		break;
-	case FCGI_NV_PARSER_NAME_LEN_FULL:
-		if (!msg_unpacker_u32 (&unpacker, &len_full))
-			return;
+static void
+fcgi_muxer_on_stdin (struct fcgi_muxer *self, struct fcgi_request *request,
+	const struct fcgi_parser *parser)
+{
+	if (request->state != FCGI_REQUEST_STDIN)
+		return;
 
-		self->name_len = len_full & ~(1U << 31);
-		str_remove_slice (&self->input, 0, unpacker.offset);
-		self->state = FCGI_NV_PARSER_VALUE_LEN;
-		break;
-	case FCGI_NV_PARSER_VALUE_LEN:
-		if (!msg_unpacker_u8 (&unpacker, &len))
-			return;
+	// At the end of input, the request may get destroyed by the callback
+	if (!parser->content_length)
+		request->state = FCGI_REQUEST_STDIN_EOF;
+	self->request_push_cb (request, parser->content, parser->content_length);
+}
 
-		if (len >> 7)
-			self->state = FCGI_NV_PARSER_VALUE_LEN_FULL;
-		else
-		{
-			self->value_len = len;
-			str_remove_slice (&self->input, 0, unpacker.offset);
-			self->state = FCGI_NV_PARSER_NAME;
-		}
-		break;
-	case FCGI_NV_PARSER_VALUE_LEN_FULL:
-		if (!msg_unpacker_u32 (&unpacker, &len_full))
-			return;
+static bool
+fcgi_muxer_on_message (const struct fcgi_parser *parser, void *user_data)
+{
+	struct fcgi_muxer *self = user_data;
+	if (parser->version != FCGI_VERSION_1)
+	{
+		print_debug ("FastCGI: unsupported version %d", parser->version);
+		fcgi_muxer_close (self);
+		return false;
+	}
 
-		self->value_len = len_full & ~(1U << 31);
-		str_remove_slice (&self->input, 0, unpacker.offset);
-		self->state = FCGI_NV_PARSER_NAME;
+	if (parser->request_id == FCGI_NULL_REQUEST_ID)
+	{
+		fcgi_muxer_on_management (self, parser);
+		return !self->closing;
+	}
+	if (parser->type == FCGI_BEGIN_REQUEST)
+	{
+		fcgi_muxer_on_begin_request (self, parser);
+		return !self->closing;
+	}
+
+	// Records for inactive requests are to be ignored
+	struct fcgi_request *request =
+		fcgi_muxer_get_request (self, parser->request_id);
+	if (!request)
+		return !self->closing;
+
+	switch (parser->type)
+	{
+	case FCGI_ABORT_REQUEST:
+		fcgi_muxer_on_abort_request (self, request);
 		break;
-	case FCGI_NV_PARSER_NAME:
-		if (self->input.len < self->name_len)
-			return;
-
-		self->name = xmalloc (self->name_len + 1);
-		self->name[self->name_len] = '\0';
-		memcpy (self->name, self->input.str, self->name_len);
-		str_remove_slice (&self->input, 0, self->name_len);
-		self->state = FCGI_NV_PARSER_VALUE;
+	case FCGI_PARAMS:
+		fcgi_muxer_on_params (self, request, parser);
 		break;
-	case FCGI_NV_PARSER_VALUE:
-		if (self->input.len < self->value_len)
-			return;
-
-		self->value = xmalloc (self->value_len + 1);
-		self->value[self->value_len] = '\0';
-		memcpy (self->value, self->input.str, self->value_len);
-		str_remove_slice (&self->input, 0, self->value_len);
-		self->state = FCGI_NV_PARSER_NAME_LEN;
-
-		// The map takes ownership of the value
-		str_map_set (self->output, self->name, self->value);
-		free (self->name);
-
-		self->name  = NULL;
-		self->value = NULL;
+	case FCGI_STDIN:
+		fcgi_muxer_on_stdin (self, request, parser);
 		break;
+	default:
+		print_debug ("FastCGI: ignoring record of type %d", parser->type);
 	}
-	}
+	return !self->closing;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-static void
-fcgi_nv_convert_len (size_t len, struct str *output)
+static struct fcgi_muxer
+fcgi_muxer_make (void)
 {
-	if (len < 0x80)
-		str_pack_u8 (output, len);
-	else
+	struct fcgi_muxer self =
 	{
-		len |= (uint32_t) 1 << 31;
-		str_pack_u32 (output, len);
-	}
+		.parser = fcgi_parser_make (),
+		.requests_alloc = 16,
+		.max_requests = 1024,
+	};
+	self.requests = xcalloc (self.requests_alloc, sizeof *self.requests);
+	return self;
 }
 
+/// Destroy all requests and release resources, but don't close the transport
 static void
-fcgi_nv_convert (struct str_map *map, struct str *output)
+fcgi_muxer_free (struct fcgi_muxer *self)
 {
-	struct str_map_iter iter = str_map_iter_make (map);
-	while (str_map_iter_next (&iter))
-	{
-		const char *name  = iter.link->key;
-		const char *value = iter.link->data;
-		size_t name_len   = iter.link->key_length;
-		size_t value_len  = strlen (value);
+	for (size_t i = 0; i < self->requests_alloc; i++)
+		if (self->requests[i])
+			fcgi_request_destroy (self->requests[i]);
 
-		fcgi_nv_convert_len (name_len,  output);
-		fcgi_nv_convert_len (value_len, output);
-		str_append_data (output, name,  name_len);
-		str_append_data (output, value, value_len);
-	}
+	free (self->requests);
+	fcgi_parser_free (&self->parser);
+}
+
+/// Process input from the transport.  The muxer may get destroyed by
+/// the "close_cb" callback before this function returns.
+static void
+fcgi_muxer_push (struct fcgi_muxer *self, const void *data, size_t len)
+{
+	if (self->closing)
+		return;
+
+	self->parser.on_message = fcgi_muxer_on_message;
+	self->parser.user_data = self;
+
+	self->in_push = true;
+	(void) fcgi_parser_push (&self->parser, data, len);
+	self->in_push = false;
+
+	if (self->closing)
+		self->close_cb (self->user_data);
 }
 
 #endif
@@ -1355,12 +2969,34 @@ struct mpd_response
 typedef void (*mpd_client_task_cb) (const struct mpd_response *response,
 	const struct strv *data, void *user_data);
 
+/// Streamed "key: value" line; the key is NULL if the line is something else
+typedef void (*mpd_client_kv_cb) (char *key, char *value, void *user_data);
+
+/// Streamed record, as raw lines in the same format as regular task data
+typedef void (*mpd_client_record_cb)
+	(const struct strv *record, void *user_data);
+
+/// Binary data following a "binary: N" line, possibly in multiple parts
+typedef void (*mpd_client_binary_cb)
+	(const void *data, size_t len, void *user_data);
+
 struct mpd_client_task
 {
 	LIST_HEADER (struct mpd_client_task)
 
 	mpd_client_task_cb callback;        ///< Callback on completion
 	void *user_data;                    ///< User data
+
+	// Large responses can be processed as they arrive, rather than being
+	// collected for the completion callback, which then gets no data:
+
+	mpd_client_kv_cb on_kv;             ///< Stream individual lines
+	mpd_client_record_cb on_record;     ///< Stream records
+	const char *record_key;             ///< Key starting records or "file"
+	mpd_client_binary_cb on_binary;     ///< Binary data sink, or discard
+
+	bool in_batch;                      ///< Part of a batched command list
+	bool batch_last;                    ///< Last command of the batch
 };
 
 struct mpd_client
@@ -1390,6 +3026,13 @@ struct mpd_client
 	struct mpd_client_task *tasks;      ///< Task queue
 	struct mpd_client_task *tasks_tail; ///< Tail of task queue
 	struct strv data;                   ///< Data from last command
+	struct strv record;                 ///< Record being streamed
+	size_t binary_remaining;            ///< Binary data left, plus newline
+
+	struct strv batch;                  ///< Commands waiting to be batched
+	struct mpd_client_task *batch_tasks;///< Tasks for batched commands
+	struct mpd_client_task *batch_tail; ///< Tail of batched tasks
+	struct poller_idle flush_event;     ///< Send out the batch
 
 	// User configuration:
 
@@ -1423,8 +3066,11 @@ mpd_client_make (struct poller *poller)
 		.read_buffer = str_make (),
 		.write_buffer = str_make (),
 		.data = strv_make (),
+		.record = strv_make (),
+		.batch = strv_make (),
 		.socket_event = poller_fd_make (poller, -1),
 		.timeout_timer = poller_timer_make (poller),
+		.flush_event = poller_idle_make (poller),
 	};
 }
 
@@ -1438,10 +3084,20 @@ mpd_client_free (struct mpd_client *self)
 	str_free (&self->write_buffer);
 
 	strv_free (&self->data);
+	strv_free (&self->record);
+	strv_free (&self->batch);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+static void
+mpd_client_end_record (struct mpd_client *self, struct mpd_client_task *task)
+{
+	if (task->on_record && self->record.len)
+		task->on_record (&self->record, task->user_data);
+	strv_reset (&self->record);
+}
+
 static void
 mpd_client_dispatch (struct mpd_client *self, struct mpd_response *response)
 {
@@ -1449,6 +3105,7 @@ mpd_client_dispatch (struct mpd_client *self, struct mpd_response *response)
 	if (!(task = self->tasks))
 		return;
 
+	mpd_client_end_record (self, task);
 	if (task->callback)
 		task->callback (response, &self->data, task->user_data);
 	strv_reset (&self->data);
@@ -1457,16 +3114,44 @@ mpd_client_dispatch (struct mpd_client *self, struct mpd_response *response)
 	free (task);
 }
 
+/// MPD doesn't execute anything following a failed command in a list
+static void
+mpd_client_dispatch_batch_error
+	(struct mpd_client *self, struct mpd_response *response)
+{
+	struct mpd_response skipped = { .message_text = "Not executed" };
+	bool last = self->tasks->batch_last;
+	mpd_client_dispatch (self, response);
+	while (!last && self->tasks)
+	{
+		last = self->tasks->batch_last;
+		mpd_client_dispatch (self, &skipped);
+	}
+}
+
 /// Reinitialize the interface so that you can reconnect anew
 static void
 mpd_client_reset (struct mpd_client *self)
 {
 	// Get rid of all pending tasks to release resources etc.
 	strv_reset (&self->data);
+	strv_reset (&self->record);
 	struct mpd_response aborted = { .message_text = "Disconnected" };
 	while (self->tasks)
 		mpd_client_dispatch (self, &aborted);
 
+	// Batched commands haven't even been sent out yet
+	poller_idle_reset (&self->flush_event);
+	strv_reset (&self->batch);
+	struct mpd_client_task *task;
+	while ((task = self->batch_tasks))
+	{
+		LIST_UNLINK_WITH_TAIL (self->batch_tasks, self->batch_tail, task);
+		if (task->callback)
+			task->callback (&aborted, &self->data, task->user_data);
+		free (task);
+	}
+
 	if (self->state == MPD_CONNECTING)
 		mpd_client_destroy_connector (self);
 
@@ -1483,6 +3168,7 @@ mpd_client_reset (struct mpd_client *self)
 	str_reset (&self->write_buffer);
 
 	cstr_set (&self->got_hello, NULL);
+	self->binary_remaining = 0;
 	self->idling = false;
 	self->idling_subsystems = 0;
 	self->in_list = false;
@@ -1553,8 +3239,54 @@ mpd_client_parse_hello (struct mpd_client *self, const char *line)
 	return true;
 }
 
+/// All output from MPD commands seems to be in a trivial "key: value" format
+static char *
+mpd_client_parse_kv (char *line, char **value)
+{
+	char *sep;
+	if (!(sep = strstr (line, ": ")))
+		return NULL;
+
+	*sep = 0;
+	*value = sep + 2;
+	return line;
+}
+
+static void
+mpd_client_stream_record (struct mpd_client *self,
+	struct mpd_client_task *task, const char *line)
+{
+	const char *key = task->record_key ? task->record_key : "file";
+	size_t key_len = strlen (key);
+	if (!strncasecmp_ascii (line, key, key_len)
+	 && !strncmp (line + key_len, ": ", 2))
+		mpd_client_end_record (self, task);
+	strv_append (&self->record, line);
+}
+
+static void
+mpd_client_push_data (struct mpd_client *self, char *line)
+{
+	struct mpd_client_task *task = self->tasks;
+	if (!task || (!task->on_record && !task->on_kv))
+	{
+		strv_append (&self->data, line);
+		return;
+	}
+
+	// The record needs to be stored before the line gets split
+	if (task->on_record)
+		mpd_client_stream_record (self, task, line);
+	if (task->on_kv)
+	{
+		char *key, *value = line;
+		key = mpd_client_parse_kv (line, &value);
+		task->on_kv (key, value, task->user_data);
+	}
+}
+
 static bool
-mpd_client_parse_line (struct mpd_client *self, const char *line)
+mpd_client_parse_line (struct mpd_client *self, char *line)
 {
 	if (self->on_io_hook)
 		self->on_io_hook (self->user_data, false, line);
@@ -1562,33 +3294,49 @@ mpd_client_parse_line (struct mpd_client *self, const char *line)
 	if (!self->got_hello)
 		return mpd_client_parse_hello (self, line);
 
+	struct mpd_client_task *task = self->tasks;
 	struct mpd_response response;
 	memset (&response, 0, sizeof response);
 	if (!strcmp (line, "list_OK"))
-		strv_append_owned (&self->data, NULL);
-	else if (mpd_client_parse_response (line, &response))
+	{
+		// Don't let records span multiple commands
+		if (task)
+			mpd_client_end_record (self, task);
+
+		// The final OK takes care of the last command in a batch
+		if (!task || !task->in_batch)
+			strv_append_owned (&self->data, NULL);
+		else if (!task->batch_last)
+		{
+			response.success = true;
+			mpd_client_dispatch (self, &response);
+		}
+	}
+	else if (!mpd_client_parse_response (line, &response))
+	{
+		// This needs to be checked before the line can get split
+		const char binary[] = "binary: ";
+		unsigned long len = 0;
+		bool is_binary = !strncmp (line, binary, sizeof binary - 1);
+		if (is_binary && (!xstrtoul (&len, line + sizeof binary - 1, 10)
+			|| len >= SIZE_MAX))
+			return false;
+
+		// Even empty binary data is followed by a newline
+		mpd_client_push_data (self, line);
+		if (is_binary)
+			self->binary_remaining = len + 1;
+	}
+	else if (!task || !task->in_batch || response.success)
 		mpd_client_dispatch (self, &response);
 	else
-		strv_append (&self->data, line);
+		mpd_client_dispatch_batch_error (self, &response);
 
 	free (response.current_command);
 	free (response.message_text);
 	return true;
 }
 
-/// All output from MPD commands seems to be in a trivial "key: value" format
-static char *
-mpd_client_parse_kv (char *line, char **value)
-{
-	char *sep;
-	if (!(sep = strstr (line, ": ")))
-		return NULL;
-
-	*sep = 0;
-	*value = sep + 2;
-	return line;
-}
-
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 static void
@@ -1600,16 +3348,41 @@ mpd_client_update_poller (struct mpd_client *self)
 		self->write_buffer.len ? (POLLIN | POLLOUT) : POLLIN);
 }
 
+/// Pass binary data through to the current task, without any copying
+static bool
+mpd_client_process_binary (struct mpd_client *self, const char *data,
+	size_t len)
+{
+	// The binary data is followed by a newline, which we leave out
+	size_t payload = len;
+	self->binary_remaining -= len;
+	if (!self->binary_remaining && data[--payload] != '\n')
+		return false;
+
+	struct mpd_client_task *task = self->tasks;
+	if (payload && task && task->on_binary)
+		task->on_binary (data, payload, task->user_data);
+	return true;
+}
+
 static bool
 mpd_client_process_input (struct mpd_client *self)
 {
 	// Split socket input at newlines and process them separately
 	struct str *rb = &self->read_buffer;
-	char *start = rb->str, *end = start + rb->len;
-	for (char *p = start; p < end; p++)
+	char *start = rb->str, *end = start + rb->len, *p;
+	while (start < end)
 	{
-		if (*p != '\n')
+		if (self->binary_remaining)
+		{
+			size_t len = MIN ((size_t) (end - start), self->binary_remaining);
+			if (!mpd_client_process_binary (self, start, len))
+				return false;
+			start += len;
 			continue;
+		}
+		if (!(p = memchr (start, '\n', end - start)))
+			break;
 
 		*p = 0;
 		if (!mpd_client_parse_line (self, start))
@@ -1669,7 +3442,8 @@ mpd_client_quote (const char *s, struct str *output)
 
 /// Beware that delivery of the event isn't deferred and you musn't make
 /// changes to the interface while processing the event!
-static void
+/// The task may be further configured for streaming.
+static struct mpd_client_task *
 mpd_client_add_task
 	(struct mpd_client *self, mpd_client_task_cb cb, void *user_data)
 {
@@ -1678,21 +3452,26 @@ mpd_client_add_task
 	// later flushed if an early ACK or OK arrives).
 	hard_assert (!self->in_list);
 
-	struct mpd_client_task *task = xcalloc (1, sizeof *self);
+	struct mpd_client_task *task = xcalloc (1, sizeof *task);
 	task->callback = cb;
 	task->user_data = user_data;
 	LIST_APPEND_WITH_TAIL (self->tasks, self->tasks_tail, task);
+	return task;
 }
 
 /// Send a command.  Remember to call mpd_client_add_task() to handle responses,
 /// unless the command is being sent in a list.
 static void mpd_client_send_command
 	(struct mpd_client *self, const char *command, ...) ATTRIBUTE_SENTINEL;
+static void mpd_client_flush (struct mpd_client *self);
 
 /// Avoid calling this method directly if you don't want things to explode
 static void
 mpd_client_send_command_raw (struct mpd_client *self, const char *raw)
 {
+	// Keep the order of commands and their responses
+	mpd_client_flush (self);
+
 	// Automatically interrupt idle mode
 	if (self->idling)
 	{
@@ -1712,8 +3491,8 @@ mpd_client_send_command_raw (struct mpd_client *self, const char *raw)
 	mpd_client_update_poller (self);
 }
 
-static void
-mpd_client_send_commandv (struct mpd_client *self, char **fields)
+static char *
+mpd_client_format_command (char **fields)
 {
 	struct str line = str_make ();
 	for (; *fields; fields++)
@@ -1726,68 +3505,304 @@ mpd_client_send_commandv (struct mpd_client *self, char **fields)
 		else
 			str_append (&line, *fields);
 	}
-	mpd_client_send_command_raw (self, line.str);
-	str_free (&line);
+	return str_steal (&line);
+}
+
+static void
+mpd_client_send_commandv (struct mpd_client *self, char **fields)
+{
+	char *line = mpd_client_format_command (fields);
+	mpd_client_send_command_raw (self, line);
+	free (line);
+}
+
+static void
+mpd_client_send_command (struct mpd_client *self, const char *command, ...)
+{
+	struct strv v = strv_make ();
+
+	va_list ap;
+	va_start (ap, command);
+	for (; command; command = va_arg (ap, const char *))
+		strv_append (&v, command);
+	va_end (ap);
+
+	mpd_client_send_commandv (self, v.vector);
+	strv_free (&v);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// "On success for all commands, OK is returned.  If a command fails, no more
+/// commands are executed and the appropriate ACK error is returned"
+static void
+mpd_client_list_begin (struct mpd_client *self)
+{
+	hard_assert (!self->in_list);
+	mpd_client_send_command (self, "command_list_begin", NULL);
+	self->in_list = true;
+}
+
+/// Beware that "list_OK" turns into NULL values in the output vector
+static void
+mpd_client_list_ok_begin (struct mpd_client *self)
+{
+	hard_assert (!self->in_list);
+	mpd_client_send_command (self, "command_list_ok_begin", NULL);
+	self->in_list = true;
+}
+
+/// End a list of commands.  Remember to call mpd_client_add_task()
+/// to handle the summary response.
+static void
+mpd_client_list_end (struct mpd_client *self)
+{
+	hard_assert (self->in_list);
+	mpd_client_send_command (self, "command_list_end", NULL);
+	self->in_list = false;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// Independent commands can be queued up to be sent out together in a single
+// command_list_ok_begin once the poller runs out of other things to do,
+// so that many requests in a row only take a single round trip.
+// Each of them still gets its own response, split at "list_OK".
+
+/// Send out all queued commands right away
+static void
+mpd_client_flush (struct mpd_client *self)
+{
+	poller_idle_reset (&self->flush_event);
+	if (!self->batch.len)
+		return;
+
+	// The command list will be written through mpd_client_send_command_raw()
+	struct strv batch = self->batch;
+	struct mpd_client_task *tasks = self->batch_tasks;
+	struct mpd_client_task *tail = self->batch_tail;
+	self->batch = strv_make ();
+	self->batch_tasks = self->batch_tail = NULL;
+
+	if (batch.len == 1)
+		mpd_client_send_command_raw (self, batch.vector[0]);
+	else
+	{
+		mpd_client_send_command (self, "command_list_ok_begin", NULL);
+		for (size_t i = 0; i < batch.len; i++)
+			mpd_client_send_command_raw (self, batch.vector[i]);
+		mpd_client_send_command (self, "command_list_end", NULL);
+
+		for (struct mpd_client_task *iter = tasks; iter; iter = iter->next)
+			iter->in_batch = true;
+		tail->batch_last = true;
+	}
+	strv_free (&batch);
+
+	if (self->tasks_tail)
+		self->tasks_tail->next = tasks;
+	else
+		self->tasks = tasks;
+	tasks->prev = self->tasks_tail;
+	self->tasks_tail = tail;
 }
 
 static void
-mpd_client_send_command (struct mpd_client *self, const char *command, ...)
+mpd_client_on_flush (void *user_data)
+{
+	mpd_client_flush (user_data);
+}
+
+/// Queue a command to be sent out in a batch with other queued commands.
+/// The callback is invoked with only this command's response.
+static struct mpd_client_task *
+mpd_client_queuev (struct mpd_client *self,
+	mpd_client_task_cb cb, void *user_data, char **fields)
+{
+	hard_assert (!self->in_list);
+	strv_append_owned (&self->batch, mpd_client_format_command (fields));
+
+	struct mpd_client_task *task = xcalloc (1, sizeof *task);
+	task->callback = cb;
+	task->user_data = user_data;
+	LIST_APPEND_WITH_TAIL (self->batch_tasks, self->batch_tail, task);
+
+	self->flush_event.dispatcher = mpd_client_on_flush;
+	self->flush_event.user_data = self;
+	poller_idle_set (&self->flush_event);
+	return task;
+}
+
+static struct mpd_client_task *mpd_client_queue (struct mpd_client *self,
+	mpd_client_task_cb cb, void *user_data, ...) ATTRIBUTE_SENTINEL;
+
+static struct mpd_client_task *
+mpd_client_queue (struct mpd_client *self,
+	mpd_client_task_cb cb, void *user_data, ...)
 {
 	struct strv v = strv_make ();
 
 	va_list ap;
-	va_start (ap, command);
-	for (; command; command = va_arg (ap, const char *))
-		strv_append (&v, command);
+	va_start (ap, user_data);
+	const char *field;
+	while ((field = va_arg (ap, const char *)))
+		strv_append (&v, field);
 	va_end (ap);
 
-	mpd_client_send_commandv (self, v.vector);
+	struct mpd_client_task *task =
+		mpd_client_queuev (self, cb, user_data, v.vector);
 	strv_free (&v);
+	return task;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-/// "On success for all commands, OK is returned.  If a command fails, no more
-/// commands are executed and the appropriate ACK error is returned"
+// Commands such as "albumart" and "readpicture" return binary data in chunks
+// limited in size by the server, each of them requested with an offset.
+// Once the total size is known from the first chunk, we queue up all the rest.
+
+struct mpd_client_fetch
+{
+	struct mpd_client *client;          ///< Parent client
+	char *command;                      ///< Chunked command
+	char *uri;                          ///< Command argument
+
+	unsigned long size;                 ///< Total size
+	unsigned long chunk;                ///< Chunk size
+	bool requested;                     ///< All chunks have been requested
+	size_t pending;                     ///< Unfinished tasks
+	bool failed;                        ///< Failure has been reported
+
+	mpd_client_binary_cb sink;          ///< Binary data sink
+	mpd_client_task_cb callback;        ///< Callback on completion
+	void *user_data;                    ///< User data
+};
+
 static void
-mpd_client_list_begin (struct mpd_client *self)
+mpd_client_fetch_on_kv (char *key, char *value, void *user_data)
 {
-	hard_assert (!self->in_list);
-	mpd_client_send_command (self, "command_list_begin", NULL);
-	self->in_list = true;
+	struct mpd_client_fetch *self = user_data;
+	if (!key)
+		print_debug ("%s: %s", "erroneous MPD output", value);
+	else if (!strcasecmp_ascii (key, "size"))
+		xstrtoul (&self->size, value, 10);
+	else if (!strcasecmp_ascii (key, "binary"))
+		xstrtoul (&self->chunk, value, 10);
 }
 
-/// Beware that "list_OK" turns into NULL values in the output vector
 static void
-mpd_client_list_ok_begin (struct mpd_client *self)
+mpd_client_fetch_on_binary (const void *data, size_t len, void *user_data)
 {
-	hard_assert (!self->in_list);
-	mpd_client_send_command (self, "command_list_ok_begin", NULL);
-	self->in_list = true;
+	struct mpd_client_fetch *self = user_data;
+	if (!self->failed)
+		self->sink (data, len, self->user_data);
 }
 
-/// End a list of commands.  Remember to call mpd_client_add_task()
-/// to handle the summary response.
+static void mpd_client_fetch_request
+	(struct mpd_client_fetch *self, unsigned long offset);
+
 static void
-mpd_client_list_end (struct mpd_client *self)
+mpd_client_fetch_on_done (const struct mpd_response *response,
+	const struct strv *data, void *user_data)
 {
-	hard_assert (self->in_list);
-	mpd_client_send_command (self, "command_list_end", NULL);
-	self->in_list = false;
+	struct mpd_client_fetch *self = user_data;
+	self->pending--;
+	if (self->failed)
+		;
+	else if (!response->success)
+	{
+		self->failed = true;
+		self->callback (response, data, self->user_data);
+	}
+	else if (!self->requested)
+	{
+		self->requested = true;
+		for (unsigned long offset = self->chunk;
+			self->chunk && offset < self->size; offset += self->chunk)
+			mpd_client_fetch_request (self, offset);
+	}
+
+	if (self->pending)
+		return;
+	if (!self->failed)
+		self->callback (response, data, self->user_data);
+
+	free (self->command);
+	free (self->uri);
+	free (self);
+}
+
+static void
+mpd_client_fetch_request (struct mpd_client_fetch *self, unsigned long offset)
+{
+	char *value = xstrdup_printf ("%lu", offset);
+	struct mpd_client_task *task = mpd_client_queue (self->client,
+		mpd_client_fetch_on_done, self, self->command, self->uri, value, NULL);
+	free (value);
+
+	task->on_kv = mpd_client_fetch_on_kv;
+	task->on_binary = mpd_client_fetch_on_binary;
+	self->pending++;
+}
+
+/// Retrieve all binary data from a chunked command, in order, through a sink.
+/// The callback is invoked once, with no data, after everything has arrived
+/// or on the first error.
+static void
+mpd_client_fetch_binary (struct mpd_client *self,
+	const char *command, const char *uri, mpd_client_binary_cb sink,
+	mpd_client_task_cb cb, void *user_data)
+{
+	struct mpd_client_fetch *fetch = xcalloc (1, sizeof *fetch);
+	fetch->client = self;
+	fetch->command = xstrdup (command);
+	fetch->uri = xstrdup (uri);
+	fetch->sink = sink;
+	fetch->callback = cb;
+	fetch->user_data = user_data;
+	mpd_client_fetch_request (fetch, 0);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+// perfhash.awk: mpd_subsystem_lookup 0 fold xmacro MPD_SUBSYSTEM_TABLE MPD_SUBSYSTEM_
+static int
+mpd_subsystem_lookup (const char *s, size_t len)
+{
+	static const struct { const char *key; size_t len; int value; }
+	table[13] =
+	{
+		[1] = { "mixer", 5, MPD_SUBSYSTEM_MIXER },
+		[2] = { "output", 6, MPD_SUBSYSTEM_OUTPUT },
+		[3] = { "playlist", 8, MPD_SUBSYSTEM_PLAYLIST },
+		[4] = { "update", 6, MPD_SUBSYSTEM_UPDATE },
+		[5] = { "sticker", 7, MPD_SUBSYSTEM_STICKER },
+		[6] = { "player", 6, MPD_SUBSYSTEM_PLAYER },
+		[7] = { "database", 8, MPD_SUBSYSTEM_DATABASE },
+		[8] = { "options", 7, MPD_SUBSYSTEM_OPTIONS },
+		[10] = { "message", 7, MPD_SUBSYSTEM_MESSAGE },
+		[11] = { "stored_playlist", 15, MPD_SUBSYSTEM_STORED_PLAYLIST },
+		[12] = { "subscription", 12, MPD_SUBSYSTEM_SUBSCRIPTION },
+	};
+
+	uint32_t hash = 38;
+	for (size_t i = 0; i < len; i++)
+		hash = (hash * 33 + tolower_ascii ((unsigned char) s[i])) & 0xFFFFFF;
+
+	size_t slot = hash % 13;
+	if (!table[slot].key || table[slot].len != len
+	 || strncasecmp_ascii (table[slot].key, s, len))
+		return 0;
+	return table[slot].value;
+}
+// perfhash.awk: end
+
 static bool
 mpd_resolve_subsystem (const char *name, unsigned *output)
 {
-	for (size_t i = 0; i < N_ELEMENTS (mpd_subsystem_names); i++)
-		if (!strcasecmp_ascii (name, mpd_subsystem_names[i]))
-		{
-			*output |= 1 << i;
-			return true;
-		}
-	return false;
+	int subsystem = mpd_subsystem_lookup (name, strlen (name));
+	*output |= subsystem;
+	return subsystem != 0;
 }
 
 static void
@@ -1955,4 +3970,470 @@ mpd_client_connect (struct mpd_client *self, const char *address,
 	return true;
 }
 
+// --- MPD state cache ---------------------------------------------------------
+
+// An optional layer on top of the client that keeps the player status and
+// the queue around, so that it needn't be retrieved all over again on every
+// change.  Call mpd_cache_refresh() whenever MPD reports changes within
+// the player or the playlist subsystem.
+//
+// The queue is synchronized incrementally using "plchangesposid", which only
+// lists positions and IDs that have changed since the last version.
+// Songs that we already know only get moved, and the rest is requested
+// in a single batch.  The application is told about changes by position.
+
+struct mpd_cache_song
+{
+	char *id;                           ///< Song ID within the queue
+	size_t position;                    ///< Position within the queue
+	struct str_map fields;              ///< Song information, by lower case
+};
+
+struct mpd_cache_change
+{
+	size_t position;                    ///< Queue position
+	struct mpd_cache_song *song;        ///< New song at the position
+	bool fresh;                         ///< The song isn't indexed yet
+};
+
+struct mpd_cache
+{
+	struct mpd_client *client;          ///< MPD client
+
+	struct str_map status;              ///< Last player status
+	bool synced;                        ///< The queue matches a version
+	unsigned long version;              ///< Version of the queue
+	ARRAY (struct mpd_cache_song *, queue) ///< Songs by position
+	struct str_map songs;               ///< Songs by ID
+
+	// Synchronization:
+
+	bool updating;                      ///< A refresh is in progress
+	bool refresh;                       ///< Refresh again once finished
+	bool failed;                        ///< The refresh has failed
+	unsigned long new_version;          ///< Version being synchronized to
+	unsigned long new_length;           ///< Queue length at that version
+
+	ARRAY (struct mpd_cache_change, changes) ///< Changes to apply
+	size_t fetch_cursor;                ///< Next change waiting for its song
+	size_t fetching;                    ///< Number of songs being fetched
+	unsigned long cpos;                 ///< Last "cpos" from plchangesposid
+	struct mpd_cache_song *song;        ///< Song being received
+
+	// User configuration:
+
+	void *user_data;                    ///< User data for callbacks
+
+	/// The player status has been updated
+	void (*on_status) (void *user_data);
+
+	/// The queue has got a different length
+	void (*on_queue_resize) (size_t length, void *user_data);
+
+	/// A position in the queue has got a different or an updated song
+	void (*on_queue_change) (size_t position,
+		const struct mpd_cache_song *song, void *user_data);
+};
+
+static struct mpd_cache_song *
+mpd_cache_song_new (void)
+{
+	struct mpd_cache_song *self = xcalloc (1, sizeof *self);
+	self->fields = str_map_make (free);
+	self->fields.key_xfrm = tolower_ascii_strxfrm;
+	return self;
+}
+
+static void
+mpd_cache_song_destroy (struct mpd_cache_song *self)
+{
+	free (self->id);
+	str_map_free (&self->fields);
+	free (self);
+}
+
+static const char *
+mpd_cache_song_get (const struct mpd_cache_song *self, const char *key)
+{
+	return str_map_find (&self->fields, key);
+}
+
+static struct mpd_cache
+mpd_cache_make (struct mpd_client *client)
+{
+	struct mpd_cache self = { .client = client };
+	self.status = str_map_make (free);
+	self.status.key_xfrm = tolower_ascii_strxfrm;
+	self.songs = str_map_make (NULL);
+	ARRAY_INIT (self.queue);
+	ARRAY_INIT (self.changes);
+	return self;
+}
+
+static void
+mpd_cache_discard_changes (struct mpd_cache *self)
+{
+	for (size_t i = 0; i < self->changes_len; i++)
+		if (self->changes[i].fresh)
+			mpd_cache_song_destroy (self->changes[i].song);
+	self->changes_len = 0;
+	self->fetch_cursor = 0;
+
+	if (self->song)
+		mpd_cache_song_destroy (self->song);
+	self->song = NULL;
+}
+
+/// Forget the queue, such as after reconnecting.
+/// No refresh may be in progress.
+static void
+mpd_cache_reset (struct mpd_cache *self)
+{
+	hard_assert (!self->updating);
+	for (size_t i = 0; i < self->queue_len; i++)
+		mpd_cache_song_destroy (self->queue[i]);
+	self->queue_len = 0;
+	str_map_clear (&self->songs);
+	str_map_clear (&self->status);
+	self->synced = false;
+}
+
+/// The client needs to be reset first, so that no refresh is in progress
+static void
+mpd_cache_free (struct mpd_cache *self)
+{
+	mpd_cache_reset (self);
+	free (self->queue);
+	free (self->changes);
+	str_map_free (&self->songs);
+	str_map_free (&self->status);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void mpd_cache_refresh (struct mpd_cache *self);
+
+static void
+mpd_cache_finish (struct mpd_cache *self)
+{
+	self->updating = false;
+	if (self->failed)
+	{
+		// A failure may be a disconnection, so don't try again right away
+		mpd_cache_discard_changes (self);
+		self->synced = false;
+		self->refresh = false;
+	}
+	else if (self->refresh)
+	{
+		self->refresh = false;
+		mpd_cache_refresh (self);
+	}
+}
+
+static void
+mpd_cache_apply (struct mpd_cache *self)
+{
+	// Songs that are about to be displaced might not be needed anymore
+	ARRAY (struct mpd_cache_song *, displaced)
+	ARRAY_INIT_SIZED (displaced, self->changes_len + 1);
+	size_t old_length = self->queue_len;
+	size_t kept = MIN (old_length, self->new_length);
+	for (size_t i = 0; i < self->changes_len; i++)
+		if (self->changes[i].position < kept)
+			displaced[displaced_len++] =
+				self->queue[self->changes[i].position];
+	for (size_t i = self->new_length; i < old_length; i++)
+	{
+		ARRAY_RESERVE (displaced, 1);
+		displaced[displaced_len++] = self->queue[i];
+	}
+	if (self->new_length > old_length)
+		ARRAY_RESERVE (self->queue, self->new_length - old_length);
+	self->queue_len = self->new_length;
+
+	for (size_t i = 0; i < self->changes_len; i++)
+	{
+		struct mpd_cache_change *change = &self->changes[i];
+		struct mpd_cache_song *song = change->song;
+		if (change->position >= self->queue_len)
+		{
+			if (change->fresh)
+				mpd_cache_song_destroy (song);
+			change->song = NULL;
+			continue;
+		}
+
+		if (change->fresh)
+			str_map_set (&self->songs, song->id, song);
+		change->fresh = false;
+
+		song->position = change->position;
+		self->queue[change->position] = song;
+	}
+
+	for (size_t i = 0; i < displaced_len; i++)
+	{
+		struct mpd_cache_song *song = displaced[i];
+		if (song->position < self->queue_len
+		 && self->queue[song->position] == song)
+			continue;
+
+		if (str_map_find (&self->songs, song->id) == song)
+			str_map_set (&self->songs, song->id, NULL);
+		mpd_cache_song_destroy (song);
+	}
+	free (displaced);
+
+	self->version = self->new_version;
+	self->synced = true;
+
+	if (self->on_queue_resize && old_length != self->queue_len)
+		self->on_queue_resize (self->queue_len, self->user_data);
+	for (size_t i = 0; i < self->changes_len; i++)
+	{
+		struct mpd_cache_change *change = &self->changes[i];
+		if (self->on_queue_change && change->song)
+			self->on_queue_change (change->position, change->song,
+				self->user_data);
+	}
+	self->changes_len = 0;
+	self->fetch_cursor = 0;
+}
+
+static void
+mpd_cache_settle (struct mpd_cache *self)
+{
+	// MPD should tell us about every position past the old end of the queue
+	size_t added = self->new_length > self->queue_len
+		? self->new_length - self->queue_len : 0;
+	bool *covered = xcalloc (added + 1, sizeof *covered);
+	for (size_t i = 0; i < self->changes_len; i++)
+	{
+		struct mpd_cache_change *change = &self->changes[i];
+		if (!change->song)
+			self->failed = true;
+		else if (change->position >= self->queue_len
+			&& change->position < self->new_length)
+			covered[change->position - self->queue_len] = true;
+	}
+	for (size_t i = 0; i < added; i++)
+		if (!covered[i])
+			self->failed = true;
+	free (covered);
+
+	if (!self->failed)
+		mpd_cache_apply (self);
+	mpd_cache_finish (self);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void
+mpd_cache_end_song (struct mpd_cache *self)
+{
+	struct mpd_cache_song *song = self->song;
+	if (!song)
+		return;
+
+	self->song = NULL;
+	if (!song->id)
+	{
+		print_debug ("%s: %s", "MPD song without an ID",
+			mpd_cache_song_get (song, "file"));
+		mpd_cache_song_destroy (song);
+		self->failed = true;
+		return;
+	}
+	if (!self->fetching)
+	{
+		ARRAY_RESERVE (self->changes, 1);
+		self->changes[self->changes_len++] = (struct mpd_cache_change)
+			{ .position = song->position, .song = song, .fresh = true };
+		return;
+	}
+
+	// Requested songs arrive in the same order as their positions were listed
+	while (self->fetch_cursor < self->changes_len
+		&& self->changes[self->fetch_cursor].song)
+		self->fetch_cursor++;
+	if (self->fetch_cursor == self->changes_len)
+	{
+		mpd_cache_song_destroy (song);
+		self->failed = true;
+		return;
+	}
+
+	struct mpd_cache_change *change = &self->changes[self->fetch_cursor];
+	change->song = song;
+	change->fresh = true;
+}
+
+static void
+mpd_cache_on_song_kv (char *key, char *value, void *user_data)
+{
+	struct mpd_cache *self = user_data;
+	if (!key)
+		return;
+
+	if (!strcasecmp_ascii (key, "file"))
+	{
+		mpd_cache_end_song (self);
+		self->song = mpd_cache_song_new ();
+	}
+	if (!self->song)
+		return;
+
+	if (!strcasecmp_ascii (key, "Id"))
+		cstr_set (&self->song->id, xstrdup (value));
+	else if (!strcasecmp_ascii (key, "Pos"))
+	{
+		unsigned long position = 0;
+		if (!xstrtoul (&position, value, 10))
+			self->failed = true;
+		self->song->position = position;
+	}
+	str_map_set (&self->song->fields, key, xstrdup (value));
+}
+
+static void
+mpd_cache_on_songs (const struct mpd_response *response,
+	const struct strv *data, void *user_data)
+{
+	(void) data;
+
+	struct mpd_cache *self = user_data;
+	mpd_cache_end_song (self);
+	if (!response->success)
+		self->failed = true;
+	mpd_cache_settle (self);
+}
+
+static void
+mpd_cache_on_fetched (const struct mpd_response *response,
+	const struct strv *data, void *user_data)
+{
+	(void) data;
+
+	struct mpd_cache *self = user_data;
+	mpd_cache_end_song (self);
+	if (!response->success)
+		self->failed = true;
+	if (!--self->fetching)
+		mpd_cache_settle (self);
+}
+
+static void
+mpd_cache_on_posid_kv (char *key, char *value, void *user_data)
+{
+	struct mpd_cache *self = user_data;
+	if (!key)
+		return;
+	if (!strcasecmp_ascii (key, "cpos"))
+	{
+		if (!xstrtoul (&self->cpos, value, 10))
+			self->failed = true;
+		return;
+	}
+	if (strcasecmp_ascii (key, "Id"))
+		return;
+
+	// Songs at their original position have been modified
+	struct mpd_cache_song *song = str_map_find (&self->songs, value);
+	ARRAY_RESERVE (self->changes, 1);
+	struct mpd_cache_change *change = &self->changes[self->changes_len++];
+	*change = (struct mpd_cache_change) { .position = self->cpos };
+	if (song && song->position != self->cpos)
+	{
+		change->song = song;
+		return;
+	}
+
+	struct mpd_client_task *task = mpd_client_queue (self->client,
+		mpd_cache_on_fetched, self, "playlistid", value, NULL);
+	task->on_kv = mpd_cache_on_song_kv;
+	self->fetching++;
+}
+
+static void
+mpd_cache_on_posid (const struct mpd_response *response,
+	const struct strv *data, void *user_data)
+{
+	(void) data;
+
+	struct mpd_cache *self = user_data;
+	if (!response->success)
+		self->failed = true;
+	if (!self->fetching)
+		mpd_cache_settle (self);
+}
+
+static void
+mpd_cache_on_status_kv (char *key, char *value, void *user_data)
+{
+	struct mpd_cache *self = user_data;
+	if (key)
+		str_map_set (&self->status, key, xstrdup (value));
+}
+
+static void
+mpd_cache_on_status (const struct mpd_response *response,
+	const struct strv *data, void *user_data)
+{
+	(void) data;
+
+	struct mpd_cache *self = user_data;
+	const char *version = str_map_find (&self->status, "playlist");
+	const char *length = str_map_find (&self->status, "playlistlength");
+	if (!response->success || !version || !length
+	 || !xstrtoul (&self->new_version, version, 10)
+	 || !xstrtoul (&self->new_length, length, 10))
+	{
+		self->failed = true;
+		mpd_cache_finish (self);
+		return;
+	}
+
+	if (self->on_status)
+		self->on_status (self->user_data);
+	if (self->synced && self->version == self->new_version)
+	{
+		mpd_cache_finish (self);
+		return;
+	}
+
+	struct mpd_client_task *task;
+	if (!self->synced)
+	{
+		task = mpd_client_queue (self->client,
+			mpd_cache_on_songs, self, "playlistinfo", NULL);
+		task->on_kv = mpd_cache_on_song_kv;
+		return;
+	}
+
+	char *since = xstrdup_printf ("%lu", self->version);
+	task = mpd_client_queue (self->client,
+		mpd_cache_on_posid, self, "plchangesposid", since, NULL);
+	task->on_kv = mpd_cache_on_posid_kv;
+	free (since);
+}
+
+/// Update the status and the queue; multiple calls are coalesced
+static void
+mpd_cache_refresh (struct mpd_cache *self)
+{
+	if (self->updating)
+	{
+		self->refresh = true;
+		return;
+	}
+
+	self->updating = true;
+	self->failed = false;
+	str_map_clear (&self->status);
+	struct mpd_client_task *task = mpd_client_queue (self->client,
+		mpd_cache_on_status, self, "status", NULL);
+	task->on_kv = mpd_cache_on_status_kv;
+}
+
 #endif
@@ -18,12 +18,16 @@
 
 // This files assumes you've already included liberty.c.
 
+#include <locale.h>
+#include <sys/mman.h>
+
 #ifdef LIBERTY_XDG_WANT_X11
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #endif
 
 #ifdef LIBERTY_XDG_WANT_ICONS
+#include <dirent.h>
 #include <png.h>
 #endif
 
@@ -41,6 +45,7 @@ struct xdg_xsettings_setting
 	}
 	type;                               ///< What's stored in the union
 	uint32_t serial;                    ///< Serial of the last change
+	bool seen;                          ///< Present in the last update
 	union
 	{
 		int32_t integer;
@@ -62,6 +67,12 @@ xdg_xsettings_setting_destroy (struct xdg_xsettings_setting *self)
 struct xdg_xsettings
 {
 	struct str_map settings;            ///< Name -> xdg_xsettings_setting
+	uint32_t serial;                    ///< Serial of the last update
+	bool have_serial;                   ///< "serial" is valid
+
+	Window owner;                       ///< Settings manager window, or None
+	Atom selection_atom;                ///< _XSETTINGS_Sn, once interned
+	Atom settings_atom;                 ///< _XSETTINGS_SETTINGS, ditto
 };
 
 static void
@@ -80,128 +91,234 @@ xdg_xsettings_make (void)
 	};
 }
 
-static void
-xdg_xsettings_update (struct xdg_xsettings *self, Display *dpy)
+/// Parse a setting's value at the offset, or merely skip it if "setting"
+/// is NULL.  Returns false if the data is truncated or otherwise invalid.
+static bool
+xdg_xsettings_parse_value (struct xdg_xsettings_setting *setting,
+	enum xdg_xsettings_type type, const struct peeker *peeker,
+	const unsigned char *buffer, size_t len, size_t *offset)
 {
-	// TODO: We're supposed to lock the server.
-	// TODO: We're supposed to trap X errors.
-	char *selection = xstrdup_printf ("_XSETTINGS_S%d", DefaultScreen (dpy));
-	Atom selection_atom = XInternAtom (dpy, selection, True);
-	free (selection);
-	if (!selection_atom)
-		return;
-
-	Window owner = XGetSelectionOwner (dpy, selection_atom);
-	if (!owner)
-		return;
+	switch (type)
+	{
+	case XDG_XSETTINGS_INTEGER:
+		if (len < *offset + 4)
+			return false;
+		if (setting)
+			setting->integer = (int32_t) peeker->u32 (buffer + *offset);
+		*offset += 4;
+		return true;
+	case XDG_XSETTINGS_STRING:
+	{
+		if (len < *offset + 4)
+			return false;
 
-	Atom xsettings_atom = XInternAtom (dpy, "_XSETTINGS_SETTINGS", True);
-	if (!xsettings_atom)
-		return;
+		uint32_t value_len = peeker->u32 (buffer + *offset);
+		*offset += 4;
+		if (len < *offset + value_len)
+			return false;
 
-	Atom actual_type = None;
-	int actual_format = 0;
-	unsigned long nitems = 0, bytes_after = 0;
-	unsigned char *buffer = NULL;
-	int status = XGetWindowProperty (dpy,
-		owner,
-		xsettings_atom,
-		0L,
-		LONG_MAX,
-		False,
-		xsettings_atom,
-		&actual_type,
-		&actual_format,
-		&nitems,
-		&bytes_after,
-		&buffer);
-	if (status != Success || !buffer)
-		return;
-
-	if (actual_type != xsettings_atom
-	 || actual_format != 8
-	 || nitems < 12)
-		goto fail;
+		if (setting)
+		{
+			setting->string = str_make ();
+			str_append_data (&setting->string, buffer + *offset, value_len);
+		}
+		*offset += ((value_len + 3) & ~3);
+		return true;
+	}
+	case XDG_XSETTINGS_COLOR:
+		if (len < *offset + 8)
+			return false;
+		if (setting)
+		{
+			setting->color.red   = peeker->u16 (buffer + *offset);
+			setting->color.green = peeker->u16 (buffer + *offset + 2);
+			setting->color.blue  = peeker->u16 (buffer + *offset + 4);
+			setting->color.alpha = peeker->u16 (buffer + *offset + 6);
+		}
+		*offset += 8;
+		return true;
+	default:
+		return false;
+	}
+}
 
+/// Parse the contents of the _XSETTINGS_SETTINGS property.  Only settings
+/// whose serials have changed are replaced.  Names of settings that have
+/// been added, changed, or removed are appended to "changed", if non-NULL.
+static void
+xdg_xsettings_parse (struct xdg_xsettings *self,
+	const unsigned char *buffer, size_t len, struct strv *changed)
+{
 	const struct peeker *peeker = NULL;
+	if (len < 12)
+		return;
 	if (buffer[0] == LSBFirst)
 		peeker = &peeker_le;
 	else if (buffer[0] == MSBFirst)
 		peeker = &peeker_be;
 	else
-		goto fail;
+		return;
+
+	// The manager increments this serial with every change it makes
+	uint32_t serial = peeker->u32 (buffer + 4);
+	if (self->have_serial && serial == self->serial)
+		return;
+
+	struct str_map_iter iter = str_map_iter_make (&self->settings);
+	struct xdg_xsettings_setting *setting = NULL;
+	while ((setting = str_map_iter_next (&iter)))
+		setting->seen = false;
 
-	// We're ignoring the serial for now.
 	uint32_t n_settings = peeker->u32 (buffer + 8);
 	size_t offset = 12;
 	struct str name = str_make ();
-	struct xdg_xsettings_setting *setting = xcalloc (1, sizeof *setting);
 	while (n_settings--)
 	{
-		if (nitems < offset + 4)
-			goto fail_item;
+		if (len < offset + 4)
+			goto fail;
 
-		setting->type = buffer[offset];
+		enum xdg_xsettings_type type = buffer[offset];
 		uint16_t name_len = peeker->u16 (buffer + offset + 2);
 		offset += 4;
-		if (nitems < offset + name_len)
-			goto fail_item;
+		if (len < offset + name_len)
+			goto fail;
 
+		str_reset (&name);
 		str_append_data (&name, buffer + offset, name_len);
 		offset += ((name_len + 3) & ~3);
-		if (nitems < offset + 4)
-			goto fail_item;
+		if (len < offset + 4)
+			goto fail;
 
-		setting->serial = peeker->u32 (buffer + offset);
+		uint32_t setting_serial = peeker->u32 (buffer + offset);
 		offset += 4;
-		switch (setting->type)
-		{
-		case XDG_XSETTINGS_INTEGER:
-			if (nitems < offset + 4)
-				goto fail_item;
 
-			setting->integer = (int32_t) peeker->u32 (buffer + offset);
-			offset += 4;
-			break;
-		case XDG_XSETTINGS_STRING:
+		struct xdg_xsettings_setting *old =
+			str_map_find (&self->settings, name.str);
+		if (old && old->type == type && old->serial == setting_serial)
 		{
-			if (nitems < offset + 4)
-				goto fail_item;
-
-			uint32_t value_len = peeker->u32 (buffer + offset);
-			offset += 4;
-			if (nitems < offset + value_len)
-				goto fail_item;
-
-			setting->string = str_make ();
-			str_append_data (&setting->string, buffer + offset, value_len);
-			offset += ((value_len + 3) & ~3);
-			break;
+			old->seen = true;
+			if (!xdg_xsettings_parse_value
+				(NULL, type, peeker, buffer, len, &offset))
+				goto fail;
+			continue;
 		}
-		case XDG_XSETTINGS_COLOR:
-			if (nitems < offset + 8)
-				goto fail_item;
-
-			setting->color.red   = peeker->u16 (buffer + offset);
-			setting->color.green = peeker->u16 (buffer + offset + 2);
-			setting->color.blue  = peeker->u16 (buffer + offset + 4);
-			setting->color.alpha = peeker->u16 (buffer + offset + 6);
-			offset += 8;
-			break;
-		default:
-			goto fail_item;
+
+		setting = xcalloc (1, sizeof *setting);
+		setting->type = type;
+		setting->serial = setting_serial;
+		setting->seen = true;
+		if (!xdg_xsettings_parse_value
+			(setting, type, peeker, buffer, len, &offset))
+		{
+			free (setting);
+			goto fail;
 		}
 
-		// TODO(p): Change detection, by comparing existence and serials.
 		str_map_set (&self->settings, name.str, setting);
-		setting = xcalloc (1, sizeof *setting);
-		str_reset (&name);
+		if (changed)
+			strv_append (changed, name.str);
 	}
-fail_item:
-	xdg_xsettings_setting_destroy (setting);
-	str_free (&name);
+
+	// Only forget about settings when we've seen the whole list
+	struct str_map_unset_iter unset = str_map_unset_iter_make (&self->settings);
+	while ((setting = str_map_unset_iter_next (&unset)))
+		if (!setting->seen)
+		{
+			if (changed)
+				strv_append (changed, unset.link->key);
+			str_map_set (&self->settings, unset.link->key, NULL);
+		}
+	str_map_unset_iter_free (&unset);
+
+	self->serial = serial;
+	self->have_serial = true;
 fail:
-	XFree (buffer);
+	str_free (&name);
+}
+
+/// Like xdg_xsettings_parse(), but also handle changes of the manager,
+/// whose window is "owner".  The buffer may be empty.
+static void
+xdg_xsettings_load (struct xdg_xsettings *self, Window owner,
+	const unsigned char *buffer, size_t len, struct strv *changed)
+{
+	// Another manager has its own serials, and possibly different settings
+	struct str_map previous = {};
+	if (owner != self->owner)
+	{
+		previous = self->settings;
+		self->settings =
+			str_map_make ((str_map_free_fn) xdg_xsettings_setting_destroy);
+		self->have_serial = false;
+		self->owner = owner;
+	}
+
+	xdg_xsettings_parse (self, buffer, len, changed);
+	if (!previous.map)
+		return;
+
+	// All settings have been added anew, report those that are gone as well
+	struct str_map_iter iter = str_map_iter_make (&previous);
+	while (str_map_iter_next (&iter))
+		if (changed && !str_map_find (&self->settings, iter.link->key))
+			strv_append (changed, iter.link->key);
+	str_map_free (&previous);
+}
+
+/// Refresh settings from the current XSETTINGS manager, if there is one.
+/// Note that "owner" should be watched for PropertyNotify events.
+static void
+xdg_xsettings_update (struct xdg_xsettings *self, Display *dpy,
+	struct strv *changed)
+{
+	// TODO: We're supposed to trap X errors.
+	if (!self->selection_atom || !self->settings_atom)
+	{
+		char *selection =
+			xstrdup_printf ("_XSETTINGS_S%d", DefaultScreen (dpy));
+		char *names[] = { selection, "_XSETTINGS_SETTINGS" };
+		Atom atoms[N_ELEMENTS (names)] = {};
+		(void) XInternAtoms (dpy, names, N_ELEMENTS (names), True, atoms);
+		free (selection);
+
+		// These may only appear once a settings manager starts
+		if (!atoms[0] || !atoms[1])
+			return;
+
+		self->selection_atom = atoms[0];
+		self->settings_atom = atoms[1];
+	}
+
+	// The server is grabbed so that the owner can't change under our hands
+	Atom actual_type = None;
+	int actual_format = 0, status = BadWindow;
+	unsigned long nitems = 0, bytes_after = 0;
+	unsigned char *buffer = NULL;
+	XGrabServer (dpy);
+	Window owner = XGetSelectionOwner (dpy, self->selection_atom);
+	if (owner)
+		status = XGetWindowProperty (dpy,
+			owner,
+			self->settings_atom,
+			0L,
+			LONG_MAX,
+			False,
+			self->settings_atom,
+			&actual_type,
+			&actual_format,
+			&nitems,
+			&bytes_after,
+			&buffer);
+	XUngrabServer (dpy);
+	XFlush (dpy);
+
+	if (status != Success || actual_type != self->settings_atom
+	 || actual_format != 8)
+		nitems = 0;
+
+	xdg_xsettings_load (self, owner, buffer, nitems, changed);
+	if (buffer)
+		XFree (buffer);
 }
 
 #endif // LIBERTY_XDG_WANT_X11
@@ -210,66 +327,143 @@ fail:
 
 // Useful for parsing desktop-entry-spec, icon-theme-spec, trash-spec,
 // mime-apps-spec.  This code is not designed for making changes to the files.
+//
+// Usually only a few keys from a single group are of any interest, so only
+// the positions of groups are found in advance.  The first few lookups within
+// a group simply scan it, then all of its entries get indexed.  Values are
+// only copied out when they're looked up.
+
+/// How many lookups within a group to serve without indexing its entries
+#define DESKTOP_FILE_SCAN_LIMIT 8
+
+/// Smaller files are cheaper to read than to map into memory
+#define DESKTOP_FILE_MAP_THRESHOLD (1 << 16)
 
 struct desktop_file
 {
-	struct str_map groups;              ///< Group name → Key → Value
+	struct str_map groups;              ///< Group name → desktop_file_group
+	char *data;                         ///< Contents of the file
+	size_t len;                         ///< Length of the contents
+	bool mapped;                        ///< The contents are memory-mapped
+};
+
+struct desktop_file_range
+{
+	const char *start;                  ///< First line of a group's entries
+	const char *end;                    ///< End of the last line
+};
+
+struct desktop_file_entry
+{
+	const char *data;                   ///< Value within the contents
+	size_t len;                         ///< Length of the value
+	char *value;                        ///< Copied value, or NULL
 };
 
+struct desktop_file_group
+{
+	ARRAY (struct desktop_file_range, ranges)
+	unsigned lookups;                   ///< Lookups made so far
+	bool indexed;                       ///< All entries have been indexed
+	struct str_map entries;             ///< Key → desktop_file_entry
+};
+
+static void
+desktop_file_free_entry (void *value)
+{
+	struct desktop_file_entry *entry = value;
+	free (entry->value);
+	free (entry);
+}
+
 static void
 desktop_file_free_group (void *value)
 {
-	str_map_free (value);
-	free (value);
+	struct desktop_file_group *group = value;
+	free (group->ranges);
+	str_map_free (&group->entries);
+	free (group);
 }
 
 static void
 desktop_file_free (struct desktop_file *self)
 {
 	str_map_free (&self->groups);
+	if (self->mapped)
+		munmap (self->data, self->len);
+	else
+		free (self->data);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-static void
-desktop_file_parse_line (struct desktop_file *self,
-	char **group_name, const char *line, const char *end)
+static struct desktop_file_group *
+desktop_file_parse_header (struct desktop_file *self,
+	const char *line, const char *end)
 {
-	struct str_map *group = NULL;
-	if (*group_name)
-		group = str_map_find (&self->groups, *group_name);
-
-	if (*line == '[')
+	bool ok = *--end == ']';
+	for (const char *p = ++line; ok && p != end; p++)
+		ok = (unsigned char) *p >= 32 && (unsigned char) *p <= 127
+			&& *p != '[' && *p != ']';
+	if (!ok)
 	{
-		bool ok = *--end == ']';
-		for (const char *p = ++line; ok && p != end; p++)
-			ok = (unsigned char) *p >= 32 && (unsigned char) *p <= 127
-				&& *p != '[' && *p != ']';
-		if (!ok)
-		{
-			cstr_set (group_name, NULL);
-			print_debug ("invalid desktop file group header");
-			return;
-		}
-
-		cstr_set (group_name, xstrndup (line, end - line));
-		if (str_map_find (&self->groups, *group_name))
-		{
-			print_debug ("duplicate desktop file group: %s", *group_name);
-			return;
-		}
+		print_debug ("invalid desktop file group header");
+		return NULL;
+	}
 
+	char *name = xstrndup (line, end - line);
+	struct desktop_file_group *group = str_map_find (&self->groups, name);
+	if (group)
+		print_debug ("duplicate desktop file group: %s", name);
+	else
+	{
 		group = xcalloc (1, sizeof *group);
-		*group = str_map_make (free);
-		str_map_set (&self->groups, *group_name, group);
-		return;
+		ARRAY_INIT_SIZED (group->ranges, 1);
+		group->entries = str_map_make (desktop_file_free_entry);
+		str_map_set (&self->groups, name, group);
 	}
-	if (!group)
+	free (name);
+
+	// Entries of duplicate groups get merged, in order
+	ARRAY_RESERVE (group->ranges, 1);
+	group->ranges[group->ranges_len++] = (struct desktop_file_range) {};
+	return group;
+}
+
+static void
+desktop_file_index (struct desktop_file *self)
+{
+	struct desktop_file_group *group = NULL;
+	const char *p = self->data, *data_end = p + self->len;
+	while (p != data_end)
 	{
-		print_debug ("unexpected desktop file entry outside of a group");
-		return;
+		const char *line = p, *line_end = memchr (p, '\n', data_end - p);
+		if (!line_end)
+			line_end = data_end;
+		if ((p = line_end) != data_end)
+			p++;
+
+		if (line == line_end || *line == '#')
+			continue;
+		if (*line == '[')
+			group = desktop_file_parse_header (self, line, line_end);
+		else if (!group)
+			print_debug ("unexpected desktop file entry outside of a group");
+		else
+		{
+			struct desktop_file_range *range =
+				&group->ranges[group->ranges_len - 1];
+			if (!range->start)
+				range->start = line;
+			range->end = line_end;
+		}
 	}
+}
 
+static bool
+desktop_file_parse_entry (const char *line, const char *end,
+	const char **key_end_out, const char **value_out)
+{
 	const char *key_end = line;
 	while (key_end != end && (isalnum_ascii (*key_end) || *key_end == '-'))
 		key_end++;
@@ -289,51 +483,221 @@ desktop_file_parse_line (struct desktop_file *self,
 	if (value == end || *value++ != '=')
 	{
 		print_debug ("invalid desktop file entry");
-		return;
+		return false;
 	}
 	while (value != end && *value == ' ')
 		value++;
 
+	*key_end_out = key_end;
+	*value_out = value;
+	return true;
+}
+
+static void
+desktop_file_index_entry (struct desktop_file_group *group,
+	const char *line, const char *end)
+{
+	const char *key_end = NULL, *value = NULL;
+	if (!desktop_file_parse_entry (line, end, &key_end, &value))
+		return;
+
 	char *key = xstrndup (line, key_end - line);
-	if (str_map_find (group, key))
+	struct desktop_file_entry *found = str_map_find (&group->entries, key);
+	if (found && found->data != value)
 		print_debug ("duplicate desktop file entry for: %s", key);
-	else
-		str_map_set (group, key, xstrndup (value, end - value));
+	else if (!found)
+	{
+		struct desktop_file_entry *entry = xcalloc (1, sizeof *entry);
+		entry->data = value;
+		entry->len = end - value;
+		str_map_set (&group->entries, key, entry);
+	}
 	free (key);
 }
 
+/// Go through all entries of a group, or only those that might match a key
+static void
+desktop_file_scan_group (struct desktop_file_group *group, const char *key)
+{
+	size_t key_len = key ? strlen (key) : 0;
+	for (size_t i = 0; i < group->ranges_len; i++)
+	{
+		const char *p = group->ranges[i].start, *end = group->ranges[i].end;
+		while (p && p < end)
+		{
+			const char *line = p, *line_end = memchr (p, '\n', end - p);
+			if (!line_end)
+				line_end = end;
+			p = line_end == end ? end : line_end + 1;
+
+			if (line == line_end || *line == '#')
+				continue;
+			if (!key)
+				desktop_file_index_entry (group, line, line_end);
+			else if ((size_t) (line_end - line) > key_len
+				&& !memcmp (line, key, key_len)
+				&& (line[key_len] == ' ' || line[key_len] == '='))
+			{
+				// The first matching entry is the valid one
+				desktop_file_index_entry (group, line, line_end);
+				if (str_map_find (&group->entries, key))
+					return;
+			}
+		}
+	}
+}
+
+/// Parse desktop file contents, which get copied
 static struct desktop_file
 desktop_file_make (const char *data, size_t len)
 {
 	struct desktop_file self = (struct desktop_file)
-		{ .groups = str_map_make (desktop_file_free_group) };
+	{
+		.groups = str_map_make (desktop_file_free_group),
+		.data = xmalloc (len + 1),
+		.len = len,
+	};
+	if (len)
+		memcpy (self.data, data, len);
+	desktop_file_index (&self);
+	return self;
+}
 
-	char *group_name = NULL;
-	const char *p = data, *data_end = p + len;
-	while (p != data_end)
+/// Read up to "len" bytes of a file that is probably that long
+static bool
+desktop_file_read (int fd, size_t len, struct desktop_file *out)
+{
+	*out = (struct desktop_file)
 	{
-		const char *line = p, *line_end = line;
-		while (line_end != data_end && *line_end != '\n')
-			line_end++;
-		if ((p = line_end) != data_end && *p == '\n')
-			p++;
+		.groups = str_map_make (desktop_file_free_group),
+		.data = xmalloc (len + 1),
+	};
 
-		if (line != line_end && *line != '#')
-			desktop_file_parse_line (&self, &group_name, line, line_end);
+	ssize_t n = 0;
+	while (out->len < len
+		&& ((n = read (fd, out->data + out->len, len - out->len)) > 0
+			|| (n < 0 && errno == EINTR)))
+		out->len += MAX (n, 0);
+	if (n >= 0)
+	{
+		desktop_file_index (out);
+		return true;
 	}
-	free (group_name);
-	return self;
+
+	desktop_file_free (out);
+	return false;
+}
+
+/// Parse a desktop file, mapping it into memory if it's large
+static bool
+desktop_file_open (const char *path, struct desktop_file *out,
+	struct error **e)
+{
+	int fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return error_set (e, "%s: %s", path, strerror (errno));
+
+	struct stat st = {};
+	void *data = NULL;
+	bool ok = false;
+	if (fstat (fd, &st))
+		error_set (e, "%s: %s", path, strerror (errno));
+	else if (st.st_size < DESKTOP_FILE_MAP_THRESHOLD)
+	{
+		if (!(ok = desktop_file_read (fd, st.st_size, out)))
+			error_set (e, "%s: %s", path, strerror (errno));
+	}
+	else if ((data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+		== MAP_FAILED)
+		error_set (e, "%s: %s", path, strerror (errno));
+	else
+	{
+		*out = (struct desktop_file)
+		{
+			.groups = str_map_make (desktop_file_free_group),
+			.data = data,
+			.len = st.st_size,
+			.mapped = true,
+		};
+		desktop_file_index (out);
+		ok = true;
+	}
+	xclose (fd);
+	return ok;
 }
 
 static const char *
 desktop_file_get (struct desktop_file *self, const char *group, const char *key)
 {
-	// TODO(p): Ideally, also implement localised keys.
-	struct str_map *group_map = str_map_find (&self->groups, group);
-	if (!group_map)
+	struct desktop_file_group *group_data =
+		str_map_find (&self->groups, group);
+	if (!group_data)
 		return NULL;
 
-	return str_map_find (group_map, key);
+	struct desktop_file_entry *entry =
+		str_map_find (&group_data->entries, key);
+	if (!entry && !group_data->indexed)
+	{
+		if (group_data->lookups++ < DESKTOP_FILE_SCAN_LIMIT)
+			desktop_file_scan_group (group_data, key);
+		else
+		{
+			desktop_file_scan_group (group_data, NULL);
+			group_data->indexed = true;
+		}
+		entry = str_map_find (&group_data->entries, key);
+	}
+	if (!entry)
+		return NULL;
+	if (!entry->value)
+		entry->value = xstrndup (entry->data, entry->len);
+	return entry->value;
+}
+
+static const char *
+desktop_file_get_localized_variant (struct desktop_file *self,
+	const char *group, const char *key, const char *lang, size_t lang_len,
+	const char *country, size_t country_len, const char *modifier)
+{
+	char *localized = xstrdup_printf ("%s[%.*s%.*s%s]", key,
+		(int) lang_len, lang, (int) country_len, country, modifier);
+	const char *value = desktop_file_get (self, group, localized);
+	free (localized);
+	return value;
+}
+
+/// Look up a value for the given LC_MESSAGES locale, or the current one
+/// when NULL, falling back to less specific variants as appropriate.
+static const char *
+desktop_file_get_localized (struct desktop_file *self,
+	const char *group, const char *key, const char *locale)
+{
+	if (!locale && !(locale = setlocale (LC_MESSAGES, NULL)))
+		locale = "C";
+	if (!strcmp (locale, "C") || !strcmp (locale, "POSIX"))
+		return desktop_file_get (self, group, key);
+
+	// lang_COUNTRY.ENCODING@MODIFIER, the encoding is to be ignored
+	size_t lang_len = strcspn (locale, "_.@");
+	const char *country = locale + lang_len, *modifier = strchr (locale, '@');
+	size_t country_len = *country == '_' ? strcspn (country, ".@") : 0;
+	if (!modifier)
+		modifier = "";
+
+	const char *value = NULL;
+	if (country_len && *modifier)
+		value = desktop_file_get_localized_variant (self, group, key,
+			locale, lang_len, country, country_len, modifier);
+	if (!value && country_len)
+		value = desktop_file_get_localized_variant (self, group, key,
+			locale, lang_len, country, country_len, "");
+	if (!value && *modifier)
+		value = desktop_file_get_localized_variant (self, group, key,
+			locale, lang_len, "", 0, modifier);
+	if (!value && lang_len)
+		value = desktop_file_get_localized_variant (self, group, key,
+			locale, lang_len, "", 0, "");
+	return value ? value : desktop_file_get (self, group, key);
 }
 
 static struct strv
@@ -378,10 +742,8 @@ desktop_file_unescape (const char *value, bool is_list)
 }
 
 static char *
-desktop_file_get_string (struct desktop_file *self,
-	const char *group, const char *key)
+desktop_file_unescape_string (const char *value)
 {
-	const char *value = desktop_file_get (self, group, key);
 	if (!value)
 		return NULL;
 
@@ -391,6 +753,23 @@ desktop_file_get_string (struct desktop_file *self,
 	return unescaped;
 }
 
+static char *
+desktop_file_get_string (struct desktop_file *self,
+	const char *group, const char *key)
+{
+	return desktop_file_unescape_string
+		(desktop_file_get (self, group, key));
+}
+
+/// Retrieve a "localestring", see desktop_file_get_localized()
+static char *
+desktop_file_get_localestring (struct desktop_file *self,
+	const char *group, const char *key, const char *locale)
+{
+	return desktop_file_unescape_string
+		(desktop_file_get_localized (self, group, key, locale));
+}
+
 static struct strv
 desktop_file_get_stringv (struct desktop_file *self,
 	const char *group, const char *key)
@@ -551,76 +930,525 @@ fail:
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-struct icon_theme_find_context
+// Decoded icons can be kept in memory, so that applications setting the same
+// icon on multiple windows don't need to decode the same files repeatedly.
+// The cache is disabled until a limit is set.
+
+struct icon_theme_cache_entry
 {
-	struct strv base;                   ///< Base directories
-	struct str_map visited;             ///< Cycle prevention
+	LIST_HEADER (struct icon_theme_cache_entry)
 
-	ARRAY (struct icon_theme_icon *, icons)
+	char *path;                         ///< Path to the file
+	time_t mtime;                       ///< Modification time of the file
+	off_t size;                         ///< Size of the file
+	struct icon_theme_icon *icon;       ///< Decoded icon
 };
 
+struct icon_theme_cache
+{
+	struct str_map entries;             ///< Path → icon_theme_cache_entry
+	struct icon_theme_cache_entry *head;  ///< Least recently used entry
+	struct icon_theme_cache_entry *tail;  ///< Most recently used entry
+	size_t bytes;                       ///< Total size of cached icons
+	size_t limit;                       ///< Maximum size of cached icons
+};
+
+static struct icon_theme_cache g_icon_theme_cache;
+
+/// Protects the cache and theme indexes, icons may be looked up from any thread
+static pthread_mutex_t g_icon_theme_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+icon_theme_icon_size (const struct icon_theme_icon *icon)
+{
+	return sizeof *icon
+		+ (size_t) icon->width * icon->height * sizeof *icon->argb;
+}
+
+static struct icon_theme_icon *
+icon_theme_icon_copy (const struct icon_theme_icon *icon)
+{
+	size_t size = icon_theme_icon_size (icon);
+	return memcpy (xmalloc (size), icon, size);
+}
+
 static void
-icon_theme_find__fallback (struct icon_theme_find_context *ctx,
-	const char *name)
+icon_theme_cache_evict (struct icon_theme_cache_entry *entry)
 {
-	for (size_t i = 0; i < ctx->base.len; i++)
+	struct icon_theme_cache *self = &g_icon_theme_cache;
+	LIST_UNLINK_WITH_TAIL (self->head, self->tail, entry);
+	str_map_set (&self->entries, entry->path, NULL);
+	self->bytes -= icon_theme_icon_size (entry->icon);
+
+	free (entry->path);
+	free (entry->icon);
+	free (entry);
+}
+
+/// Set the maximum total size of decoded icons to keep, zero disables caching
+static void
+icon_theme_cache_set_limit (size_t limit)
+{
+	struct icon_theme_cache *self = &g_icon_theme_cache;
+	hard_assert (!pthread_mutex_lock (&g_icon_theme_lock));
+	if (!self->entries.map)
+		self->entries = str_map_make (NULL);
+
+	self->limit = limit;
+	while (self->head && self->bytes > self->limit)
+		icon_theme_cache_evict (self->head);
+	hard_assert (!pthread_mutex_unlock (&g_icon_theme_lock));
+}
+
+static struct icon_theme_icon *
+icon_theme_cache_get (const char *path)
+{
+	struct icon_theme_cache *self = &g_icon_theme_cache;
+	struct icon_theme_cache_entry *entry;
+	if (!self->limit || !(entry = str_map_find (&self->entries, path)))
+		return NULL;
+
+	struct stat st = {};
+	if (stat (path, &st) || st.st_mtime != entry->mtime
+	 || st.st_size != entry->size)
 	{
-		char *path = xstrdup_printf ("%s/%s.png", ctx->base.vector[i], name);
-		struct icon_theme_icon *icon = icon_theme_open (path);
-		free (path);
-		if (icon)
-		{
-			ARRAY_RESERVE (ctx->icons, 1);
-			ctx->icons[ctx->icons_len++] = icon;
+		icon_theme_cache_evict (entry);
+		return NULL;
+	}
+
+	LIST_UNLINK_WITH_TAIL (self->head, self->tail, entry);
+	LIST_APPEND_WITH_TAIL (self->head, self->tail, entry);
+	return icon_theme_icon_copy (entry->icon);
+}
+
+static void
+icon_theme_cache_put (const char *path, const struct stat *st,
+	const struct icon_theme_icon *icon)
+{
+	struct icon_theme_cache *self = &g_icon_theme_cache;
+	size_t size = icon_theme_icon_size (icon);
+	if (size > self->limit)
+		return;
+
+	struct icon_theme_cache_entry *entry =
+		str_map_find (&self->entries, path);
+	if (entry)
+		icon_theme_cache_evict (entry);
+	while (self->head && self->bytes + size > self->limit)
+		icon_theme_cache_evict (self->head);
+
+	entry = xcalloc (1, sizeof *entry);
+	entry->path = xstrdup (path);
+	entry->mtime = st->st_mtime;
+	entry->size = st->st_size;
+	entry->icon = icon_theme_icon_copy (icon);
+	str_map_set (&self->entries, path, entry);
+	LIST_APPEND_WITH_TAIL (self->head, self->tail, entry);
+	self->bytes += size;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// Decoding is by far the most expensive part of loading icons, and libpng
+// has no shared state, so the sizes of an icon are decoded in parallel.
+// Threads are only started as batches need them, and kept around for further
+// lookups until icon_theme_decode_pool_stop() is called.
+
+/// The maximum number of additional threads to decode icons with
+#define ICON_THEME_DECODE_THREADS_MAX 7
+
+struct icon_theme_decode_job
+{
+	struct strv paths;                  ///< Candidate paths, by preference
+	struct icon_theme_icon *icon;       ///< The first one to be decoded
+	bool cached;                        ///< The icon has come from the cache
+	struct stat st;                     ///< Status of the decoded file
+	size_t decoded;                     ///< Index of the first or decoded path
+};
+
+struct icon_theme_decode
+{
+	ARRAY (struct icon_theme_decode_job, jobs)
+	size_t next;                        ///< Next job to be taken
+};
+
+struct icon_theme_decode_pool
+{
+	pthread_mutex_t mutex;              ///< Protects everything below
+	pthread_cond_t wake;                ///< A batch of jobs is available
+	pthread_cond_t idle;                ///< Workers have left the batch
+
+	pthread_t threads[ICON_THEME_DECODE_THREADS_MAX];  ///< Worker threads
+	size_t threads_len;                 ///< Number of running threads
+	size_t threads_limit;               ///< Maximum number of threads
+	bool limited;                       ///< threads_limit has been determined
+	bool quitting;                      ///< Workers are to exit
+
+	struct icon_theme_decode *batch;    ///< Jobs being decoded, or NULL
+	size_t working;                     ///< Threads working on the batch
+};
+
+static struct icon_theme_decode_pool g_icon_theme_decode_pool =
+{
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+static struct icon_theme_decode
+icon_theme_decode_make (void)
+{
+	struct icon_theme_decode self = {};
+	ARRAY_INIT (self.jobs);
+	return self;
+}
+
+static void
+icon_theme_decode_free (struct icon_theme_decode *self)
+{
+	for (size_t i = 0; i < self->jobs_len; i++)
+	{
+		strv_free (&self->jobs[i].paths);
+		free (self->jobs[i].icon);
+	}
+	free (self->jobs);
+}
+
+static struct icon_theme_decode_job *
+icon_theme_decode_add (struct icon_theme_decode *self)
+{
+	ARRAY_RESERVE (self->jobs, 1);
+	struct icon_theme_decode_job *job = &self->jobs[self->jobs_len++];
+	*job = (struct icon_theme_decode_job) { .paths = strv_make () };
+	return job;
+}
+
+static void
+icon_theme_decode_work (struct icon_theme_decode *self)
+{
+	struct icon_theme_decode_pool *pool = &g_icon_theme_decode_pool;
+	while (true)
+	{
+		hard_assert (!pthread_mutex_lock (&pool->mutex));
+		size_t i = self->next++;
+		hard_assert (!pthread_mutex_unlock (&pool->mutex));
+		if (i >= self->jobs_len)
 			return;
+
+		struct icon_theme_decode_job *job = &self->jobs[i];
+		for (size_t k = job->decoded; !job->icon && k < job->paths.len; k++)
+			if (!stat (job->paths.vector[k], &job->st)
+			 && (job->icon = icon_theme_open (job->paths.vector[k])))
+				job->decoded = k;
+	}
+}
+
+static void *
+icon_theme_decode_worker (void *user_data)
+{
+	struct icon_theme_decode_pool *pool = user_data;
+	hard_assert (!pthread_mutex_lock (&pool->mutex));
+	while (!pool->quitting)
+	{
+		struct icon_theme_decode *batch = pool->batch;
+		if (!batch || batch->next >= batch->jobs_len)
+		{
+			hard_assert (!pthread_cond_wait (&pool->wake, &pool->mutex));
+			continue;
 		}
+
+		pool->working++;
+		hard_assert (!pthread_mutex_unlock (&pool->mutex));
+		icon_theme_decode_work (batch);
+		hard_assert (!pthread_mutex_lock (&pool->mutex));
+		if (!--pool->working)
+			hard_assert (!pthread_cond_signal (&pool->idle));
 	}
+	hard_assert (!pthread_mutex_unlock (&pool->mutex));
+	return NULL;
 }
 
-static struct desktop_file
-icon_theme_find__index (struct icon_theme_find_context *ctx, const char *theme)
+/// Start threads up to the given count, with the pool locked.  The calling
+/// thread participates in decoding as well, so failures are harmless.
+static void
+icon_theme_decode_pool_grow (struct icon_theme_decode_pool *self, size_t n)
 {
-	struct str data = str_make ();
-	for (size_t i = 0; i < ctx->base.len; i++)
+	if (!self->limited)
 	{
-		struct error *e = NULL;
-		char *path = xstrdup_printf ("%s/%s/index.theme",
-			ctx->base.vector[i], theme);
-		read_file (path, &data, &e);
-		free (path);
-		if (!e)
+		long cpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+		cpus = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+		self->threads_limit = MIN ((size_t) MAX (cpus, 1) - 1,
+			ICON_THEME_DECODE_THREADS_MAX);
+		self->limited = true;
+	}
+	if ((n = MIN (n, self->threads_limit)) <= self->threads_len)
+		return;
+
+	// Block all signals so that the new threads don't receive any (inherited)
+	sigset_t all_blocked, old_blocked;
+	hard_assert (!sigfillset (&all_blocked));
+	hard_assert (!pthread_sigmask (SIG_SETMASK, &all_blocked, &old_blocked));
+
+	for (; self->threads_len < n; self->threads_len++)
+		if (pthread_create (&self->threads[self->threads_len], NULL,
+			icon_theme_decode_worker, self))
 			break;
 
-		if (errno != ENOENT)
-			print_debug ("%s", e->message);
-		error_free (e);
+	hard_assert (!pthread_sigmask (SIG_SETMASK, &old_blocked, NULL));
+}
+
+/// Stop and join all decoding threads, e.g., once icons are no longer needed.
+/// Further lookups will start them again as needed.
+static void
+icon_theme_decode_pool_stop (void)
+{
+	struct icon_theme_decode_pool *self = &g_icon_theme_decode_pool;
+	hard_assert (!pthread_mutex_lock (&g_icon_theme_lock));
+	hard_assert (!pthread_mutex_lock (&self->mutex));
+	self->quitting = true;
+	hard_assert (!pthread_cond_broadcast (&self->wake));
+	hard_assert (!pthread_mutex_unlock (&self->mutex));
+
+	for (size_t i = 0; i < self->threads_len; i++)
+		hard_assert (!pthread_join (self->threads[i], NULL));
+
+	self->threads_len = 0;
+	self->quitting = false;
+	hard_assert (!pthread_mutex_unlock (&g_icon_theme_lock));
+}
+
+/// Run all jobs, using the cache and additional threads where possible
+static void
+icon_theme_decode_run (struct icon_theme_decode *self)
+{
+	// Only the first existing file may be taken from the cache,
+	// and decoding starts from there if it's not present
+	size_t pending = 0;
+	for (size_t i = 0; i < self->jobs_len; i++)
+	{
+		struct icon_theme_decode_job *job = &self->jobs[i];
+		for (; job->decoded < job->paths.len; job->decoded++)
+		{
+			const char *path = job->paths.vector[job->decoded];
+			if ((job->cached = !!(job->icon = icon_theme_cache_get (path)))
+			 || !stat (path, &job->st))
+				break;
+		}
+		if (!job->icon && job->decoded < job->paths.len)
+			pending++;
 	}
 
-	struct desktop_file index = desktop_file_make (data.str, data.len);
-	str_free (&data);
-	return index;
+	// Lookups are serialized by g_icon_theme_lock, so the pool is free
+	struct icon_theme_decode_pool *pool = &g_icon_theme_decode_pool;
+	hard_assert (!pthread_mutex_lock (&pool->mutex));
+	if (pending > 1)
+		icon_theme_decode_pool_grow (pool, pending - 1);
+
+	hard_assert (!pool->batch);
+	pool->batch = self;
+	hard_assert (!pthread_cond_broadcast (&pool->wake));
+	hard_assert (!pthread_mutex_unlock (&pool->mutex));
+
+	icon_theme_decode_work (self);
+
+	// Workers may still be decoding the last jobs they have taken
+	hard_assert (!pthread_mutex_lock (&pool->mutex));
+	pool->batch = NULL;
+	while (pool->working)
+		hard_assert (!pthread_cond_wait (&pool->idle, &pool->mutex));
+	hard_assert (!pthread_mutex_unlock (&pool->mutex));
+
+	for (size_t i = 0; i < self->jobs_len; i++)
+	{
+		struct icon_theme_decode_job *job = &self->jobs[i];
+		if (job->icon && !job->cached && g_icon_theme_cache.limit)
+			icon_theme_cache_put
+				(job->paths.vector[job->decoded], &job->st, job->icon);
+	}
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// Rather than probing for files in all directories on every lookup,
+// each theme gets listed once, and the result is kept until it changes.
+
+/// How often to check cached theme indexes for changes, in seconds
+#define ICON_THEME_INDEX_CHECK_INTERVAL 5
+
+struct icon_theme_index_path
+{
+	size_t directory;                   ///< Index of the theme subdirectory
+	long size;                          ///< Nominal size of icons within
+	char *path;                         ///< Full path to the icon
+};
+
+struct icon_theme_index_icon
+{
+	ARRAY (struct icon_theme_index_path, paths)
+};
+
+struct icon_theme_index_stamp
+{
+	char *path;                         ///< Watched file or directory
+	time_t mtime;                       ///< Modification time, or -1
+};
+
+struct icon_theme_index
+{
+	char *base;                         ///< Base directories used for it
+	struct strv parents;                ///< Inherited themes
+	struct str_map icons;               ///< Icon name → icon_theme_index_icon
+
+	ARRAY (struct icon_theme_index_stamp, stamps)
+	time_t checked;                     ///< When stamps were last verified
+};
+
+/// Theme name → icon_theme_index
+static struct str_map g_icon_theme_indexes;
+
+static void
+icon_theme_index_icon_destroy (void *value)
+{
+	struct icon_theme_index_icon *self = value;
+	for (size_t i = 0; i < self->paths_len; i++)
+		free (self->paths[i].path);
+	free (self->paths);
+	free (self);
 }
 
 static void
-icon_theme_find__named (struct icon_theme_find_context *ctx,
-	const char *theme, const char *name)
+icon_theme_index_destroy (void *value)
 {
-	// Either a cycle, or a common ancestor of inherited themes, which is valid.
-	if (str_map_find (&ctx->visited, theme))
+	struct icon_theme_index *self = value;
+	free (self->base);
+	strv_free (&self->parents);
+	str_map_free (&self->icons);
+	for (size_t i = 0; i < self->stamps_len; i++)
+		free (self->stamps[i].path);
+	free (self->stamps);
+	free (self);
+}
+
+/// Drop all cached theme indexes, e.g., when the icon theme setting changes
+static void
+icon_theme_index_flush (void)
+{
+	hard_assert (!pthread_mutex_lock (&g_icon_theme_lock));
+	if (g_icon_theme_indexes.map)
+		str_map_clear (&g_icon_theme_indexes);
+	hard_assert (!pthread_mutex_unlock (&g_icon_theme_lock));
+}
+
+static time_t
+icon_theme_index_mtime (const char *path)
+{
+	struct stat st = {};
+	return stat (path, &st) ? -1 : st.st_mtime;
+}
+
+static time_t
+icon_theme_index_stamp (struct icon_theme_index *self, char *path)
+{
+	time_t mtime = icon_theme_index_mtime (path);
+	ARRAY_RESERVE (self->stamps, 1);
+	self->stamps[self->stamps_len++] =
+		(struct icon_theme_index_stamp) { .path = path, .mtime = mtime };
+	return mtime;
+}
+
+static void
+icon_theme_index_add (struct icon_theme_index *self, const char *dir,
+	size_t directory, long size)
+{
+	DIR *dp = opendir (dir);
+	if (!dp)
+	{
+		if (errno != ENOENT)
+			print_debug ("%s: %s", dir, strerror (errno));
 		return;
+	}
 
-	str_map_set (&ctx->visited, theme, (void *) (intptr_t) 1);
-	struct desktop_file index = icon_theme_find__index (ctx, theme);
+	struct dirent *entry;
+	while ((entry = readdir (dp)))
+	{
+		size_t len = strlen (entry->d_name);
+		if (len <= 4 || strcmp (entry->d_name + len - 4, ".png"))
+			continue;
 
-	char *directories =
-		desktop_file_get_string (&index, "Icon Theme", "Directories");
-	if (!directories)
-		goto out;
+		char *name = xstrndup (entry->d_name, len - 4);
+		struct icon_theme_index_icon *icon = str_map_find (&self->icons, name);
+		if (!icon)
+		{
+			icon = xcalloc (1, sizeof *icon);
+			ARRAY_INIT_SIZED (icon->paths, 1);
+			str_map_set (&self->icons, name, icon);
+		}
+		free (name);
+
+		ARRAY_RESERVE (icon->paths, 1);
+		icon->paths[icon->paths_len++] = (struct icon_theme_index_path)
+		{
+			.directory = directory,
+			.size = size,
+			.path = xstrdup_printf ("%s/%s", dir, entry->d_name),
+		};
+	}
+	closedir (dp);
+}
+
+static struct icon_theme_index *
+icon_theme_index_build (const struct strv *base, const char *base_key,
+	const char *theme)
+{
+	struct icon_theme_index *self = xcalloc (1, sizeof *self);
+	self->base = xstrdup (base_key);
+	self->parents = strv_make ();
+	self->icons = str_map_make (icon_theme_index_icon_destroy);
+	ARRAY_INIT (self->stamps);
+
+	// Also watch for themes appearing in directories where they're missing
+	struct str data = str_make ();
+	bool have_index = false;
+	for (size_t i = 0; i < base->len; i++)
+	{
+		if (icon_theme_index_stamp (self,
+			xstrdup_printf ("%s/%s", base->vector[i], theme)) == -1
+		 || have_index)
+			continue;
+
+		char *path = xstrdup_printf ("%s/%s/index.theme",
+			base->vector[i], theme);
+		if (icon_theme_index_stamp (self, path) == -1)
+			continue;
+
+		struct error *e = NULL;
+		if ((have_index = read_file (path, &data, &e)))
+			continue;
+
+		print_debug ("%s", e->message);
+		error_free (e);
+		str_reset (&data);
+	}
+
+	struct desktop_file index = desktop_file_make (data.str, data.len);
+	str_free (&data);
+
+	char *inherits =
+		desktop_file_get_string (&index, "Icon Theme", "Inherits");
+	if (inherits)
+		cstr_split (inherits, ",", true, &self->parents);
+	free (inherits);
 
 	// NOTE: The sizes are not deduplicated, and priorities are uncertain.
 	struct strv dirs = strv_make ();
-	cstr_split (directories, ",", true, &dirs);
+	char *directories =
+		desktop_file_get_string (&index, "Icon Theme", "Directories");
+	if (directories)
+		cstr_split (directories, ",", true, &dirs);
 	free (directories);
+
 	for (size_t d = 0; d < dirs.len; d++)
 	{
 		// The hicolor icon theme stuffs everything in Directories.
@@ -628,42 +1456,133 @@ icon_theme_find__named (struct icon_theme_find_context *ctx,
 		 && desktop_file_get_integer (&index, dirs.vector[d], "Scale") != 1)
 			continue;
 
-		for (size_t i = 0; i < ctx->base.len; i++)
+		long size = desktop_file_get_integer (&index, dirs.vector[d], "Size");
+		for (size_t i = 0; i < base->len; i++)
 		{
-			char *path = xstrdup_printf ("%s/%s/%s/%s.png",
-				ctx->base.vector[i], theme, dirs.vector[d], name);
-			struct icon_theme_icon *icon = icon_theme_open (path);
-			free (path);
-			if (icon)
-			{
-				ARRAY_RESERVE (ctx->icons, 1);
-				ctx->icons[ctx->icons_len++] = icon;
-				break;
-			}
+			char *path = xstrdup_printf ("%s/%s/%s",
+				base->vector[i], theme, dirs.vector[d]);
+			if (icon_theme_index_stamp (self, path) != -1)
+				icon_theme_index_add (self, path, d, size);
 		}
 	}
 	strv_free (&dirs);
-	if (ctx->icons_len)
-		goto out;
+	desktop_file_free (&index);
 
-	char *inherits =
-		desktop_file_get_string (&index, "Icon Theme", "Inherits");
-	if (inherits)
+	self->checked = time (NULL);
+	return self;
+}
+
+static bool
+icon_theme_index_is_current (struct icon_theme_index *self,
+	const char *base_key)
+{
+	if (strcmp (self->base, base_key))
+		return false;
+
+	time_t now = time (NULL);
+	if (now >= self->checked
+	 && now - self->checked < ICON_THEME_INDEX_CHECK_INTERVAL)
+		return true;
+
+	for (size_t i = 0; i < self->stamps_len; i++)
+		if (icon_theme_index_mtime (self->stamps[i].path)
+			!= self->stamps[i].mtime)
+			return false;
+
+	self->checked = now;
+	return true;
+}
+
+static struct icon_theme_index *
+icon_theme_index_get (const struct strv *base, const char *base_key,
+	const char *theme)
+{
+	if (!g_icon_theme_indexes.map)
+		g_icon_theme_indexes = str_map_make (icon_theme_index_destroy);
+
+	struct icon_theme_index *index =
+		str_map_find (&g_icon_theme_indexes, theme);
+	if (!index || !icon_theme_index_is_current (index, base_key))
+		str_map_set (&g_icon_theme_indexes, theme,
+			(index = icon_theme_index_build (base, base_key, theme)));
+	return index;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+struct icon_theme_find_context
+{
+	struct strv base;                   ///< Base directories
+	char *base_key;                     ///< Base directories, joined
+	struct str_map visited;             ///< Cycle prevention
+
+	ARRAY (struct icon_theme_icon *, icons)
+};
+
+static void
+icon_theme_find__decode (struct icon_theme_find_context *ctx,
+	struct icon_theme_decode *decode)
+{
+	icon_theme_decode_run (decode);
+	for (size_t i = 0; i < decode->jobs_len; i++)
 	{
-		struct strv parents = strv_make ();
-		cstr_split (inherits, ",", true, &parents);
-		free (inherits);
-		for (size_t i = 0; i < parents.len; i++)
-		{
-			icon_theme_find__named (ctx, parents.vector[i], name);
-			if (ctx->icons_len)
-				break;
-		}
-		strv_free (&parents);
+		if (!decode->jobs[i].icon)
+			continue;
+
+		ARRAY_RESERVE (ctx->icons, 1);
+		ctx->icons[ctx->icons_len++] = decode->jobs[i].icon;
+		decode->jobs[i].icon = NULL;
 	}
+	icon_theme_decode_free (decode);
+}
 
-out:
-	desktop_file_free (&index);
+static void
+icon_theme_find__fallback (struct icon_theme_find_context *ctx,
+	const char *name)
+{
+	struct icon_theme_decode decode = icon_theme_decode_make ();
+	struct icon_theme_decode_job *job = icon_theme_decode_add (&decode);
+	for (size_t i = 0; i < ctx->base.len; i++)
+		strv_append_owned (&job->paths,
+			xstrdup_printf ("%s/%s.png", ctx->base.vector[i], name));
+	icon_theme_find__decode (ctx, &decode);
+}
+
+static void
+icon_theme_find__named (struct icon_theme_find_context *ctx,
+	const char *theme, const char *name)
+{
+	// Either a cycle, or a common ancestor of inherited themes, which is valid.
+	if (str_map_find (&ctx->visited, theme))
+		return;
+
+	str_map_set (&ctx->visited, theme, (void *) (intptr_t) 1);
+	struct icon_theme_index *index =
+		icon_theme_index_get (&ctx->base, ctx->base_key, theme);
+
+	// Paths are ordered by theme subdirectory, then by base directory,
+	// and within each subdirectory, we want the first one that opens.
+	struct icon_theme_decode decode = icon_theme_decode_make ();
+	struct icon_theme_decode_job *job = NULL;
+	struct icon_theme_index_icon *entry = str_map_find (&index->icons, name);
+	for (size_t i = 0; entry && i < entry->paths_len; i++)
+	{
+		const struct icon_theme_index_path *path = &entry->paths[i];
+		if (!i || path->directory != entry->paths[i - 1].directory)
+			job = icon_theme_decode_add (&decode);
+		strv_append (&job->paths, path->path);
+	}
+	icon_theme_find__decode (ctx, &decode);
+	if (ctx->icons_len)
+		return;
+
+	// Recursion cannot rebuild this theme's index, thanks to cycle prevention.
+	for (size_t i = 0; i < index->parents.len; i++)
+	{
+		icon_theme_find__named (ctx, index->parents.vector[i], name);
+		if (ctx->icons_len)
+			break;
+	}
 }
 
 /// Return all base directories appropriate for icon search.
@@ -705,17 +1624,21 @@ icon_theme_find (const char *theme, const char *name, size_t *len)
 {
 	struct icon_theme_find_context ctx = {};
 	ctx.base = icon_theme_get_base_directories ();
+	ctx.base_key = strv_join (&ctx.base, "\n");
 	ctx.visited = str_map_make (NULL);
 	ARRAY_INIT (ctx.icons);
 
+	hard_assert (!pthread_mutex_lock (&g_icon_theme_lock));
 	if (theme)
 		icon_theme_find__named (&ctx, theme, name);
 	if (!ctx.icons_len)
 		icon_theme_find__named (&ctx, "hicolor", name);
 	if (!ctx.icons_len)
 		icon_theme_find__fallback (&ctx, name);
+	hard_assert (!pthread_mutex_unlock (&g_icon_theme_lock));
 
 	strv_free (&ctx.base);
+	free (ctx.base_key);
 	str_map_free (&ctx.visited);
 
 	ARRAY_RESERVE (ctx.icons, 1);
@@ -623,7 +623,9 @@ struct ui
 	struct widget *(*label)
 		(chtype attrs, unsigned extended, const char *label);
 
-	void (*render) (void);
+	/// Render g_xui.widgets, possibly reusing what's been rendered
+	/// for the previous frame's widgets
+	void (*render) (struct widget *previous);
 	void (*flip) (void);
 	void (*winch) (void);
 	void (*destroy) (void);
@@ -691,6 +693,7 @@ struct xui
 	Window x11_window;                  ///< Application window
 	Pixmap x11_pixmap;                  ///< Off-screen bitmap
 	Region x11_clip;                    ///< Invalidated region
+	Region x11_damage;                  ///< Region of x11_pixmap to re-render
 	Picture x11_pixmap_picture;         ///< XRender wrap for x11_pixmap
 	XftDraw *xft_draw;                  ///< Xft rendering context
 	struct x11_font *xft_fonts;         ///< Font collection
@@ -799,8 +802,10 @@ tui_render_widgets (struct widget *head)
 }
 
 static void
-tui_render (void)
+tui_render (struct widget *previous)
 {
+	(void) previous;
+
 	erase ();
 	tui_render_widgets (g_xui.widgets);
 }
@@ -1315,18 +1320,34 @@ x11_make_label (chtype attrs, unsigned extended, const char *label)
 	return w;
 }
 
+/// Limit Xft rendering to the damaged part of a rectangle, or of the window
+static void
+x11_set_clip (const XRectangle *clip)
+{
+	Region region = XCreateRegion ();
+	if (clip)
+		XUnionRectWithRegion ((XRectangle *) clip, region, region);
+	else
+		XUnionRegion (g_xui.x11_damage, region, region);
+	XIntersectRegion (region, g_xui.x11_damage, region);
+	XftDrawSetClip (g_xui.xft_draw, region);
+	XDestroyRegion (region);
+}
+
 static void
 x11_render_widget (struct widget *w, const XRectangle *clip)
 {
 	if (w->width < 0 || w->height < 0)
 		return;
 
+	// Containers clip their children, so this skips whole subtrees.
+	if (XRectInRegion (g_xui.x11_damage, w->x, w->y, w->width, w->height)
+		== RectangleOut)
+		return;
+
 	// Children may set their own clips, so reset before each sibling.
 	// We need to go through Xft, or XftTextRenderUtf8() might skip glyphs.
-	if (clip)
-		XftDrawSetClipRectangles (g_xui.xft_draw, 0, 0, clip, 1);
-	else
-		XftDrawSetClip (g_xui.xft_draw, None);
+	x11_set_clip (clip);
 
 	if (w->on_render)
 		w->on_render (w);
@@ -1353,28 +1374,96 @@ x11_render_widget (struct widget *w, const XRectangle *clip)
 }
 
 static void
-x11_render (void)
+x11_damage_widget (const struct widget *w)
+{
+	if (w->width <= 0 || w->height <= 0)
+		return;
+
+	XRectangle r = { w->x, w->y, w->width, w->height };
+	XUnionRectWithRegion (&r, g_xui.x11_damage, g_xui.x11_damage);
+}
+
+/// Whether a widget from the previous frame would render the same way,
+/// not considering its children.  We can only tell for our own widgets,
+/// custom renderers may depend on anything.
+static bool
+x11_widget_equal (const struct widget *a, const struct widget *b)
+{
+	if (a->x != b->x || a->y != b->y
+	 || a->width != b->width || a->height != b->height
+	 || a->on_render != b->on_render
+	 || a->attrs != b->attrs || a->extended_attrs != b->extended_attrs)
+		return false;
+	if (!a->on_render)
+		return true;
+	if (a->on_render != x11_render_label && a->on_render != x11_render_padding)
+		return false;
+	return !strcmp (a->text, b->text);
+}
+
+/// Widgets are identified by their position within the tree.  Damage all
+/// areas where the two frames differ, so that only they need re-rendering.
+static void
+x11_diff_widgets (const struct widget *old, const struct widget *new)
 {
+	for (; old && new; old = old->next, new = new->next)
+	{
+		if (!x11_widget_equal (old, new))
+		{
+			x11_damage_widget (old);
+			x11_damage_widget (new);
+		}
+		else
+			x11_diff_widgets (old->children, new->children);
+	}
+	for (; old; old = old->next)
+		x11_damage_widget (old);
+	for (; new; new = new->next)
+		x11_damage_widget (new);
+}
+
+static void
+x11_render (struct widget *previous)
+{
+	x11_diff_widgets (previous, g_xui.widgets);
+	if (XEmptyRegion (g_xui.x11_damage))
+		return;
+
+	// Our own XRender calls also need to respect the damaged region.
+	XRenderSetPictureClipRegion (g_xui.dpy, g_xui.x11_pixmap_picture,
+		g_xui.x11_damage);
+
+	XRectangle r = {};
+	XClipBox (g_xui.x11_damage, &r);
 	XRenderFillRectangle (g_xui.dpy, PictOpSrc, g_xui.x11_pixmap_picture,
-		&x11_default_bg, 0, 0, g_xui.width, g_xui.height);
+		&x11_default_bg, r.x, r.y, r.width, r.height);
 
 	LIST_FOR_EACH (struct widget, w, g_xui.widgets)
 		x11_render_widget (w, NULL);
 
-	XRectangle r = { 0, 0, g_xui.width, g_xui.height };
-	XUnionRectWithRegion (&r, g_xui.x11_clip, g_xui.x11_clip);
+	XRenderPictureAttributes attributes = { .clip_mask = None };
+	XRenderChangePicture (g_xui.dpy, g_xui.x11_pixmap_picture,
+		CPClipMask, &attributes);
+
+	XUnionRegion (g_xui.x11_clip, g_xui.x11_damage, g_xui.x11_clip);
+	XSubtractRegion (g_xui.x11_damage, g_xui.x11_damage, g_xui.x11_damage);
 	poller_idle_set (&g_xui.xpending_event);
 }
 
 static void
 x11_flip (void)
 {
-	// This exercise in futility doesn't seem to affect CPU usage much.
+	if (XEmptyRegion (g_xui.x11_clip))
+		return;
+
+	// Only copy the invalidated region, rather than its whole bounding box.
+	GC gc = DefaultGC (g_xui.dpy, DefaultScreen (g_xui.dpy));
 	XRectangle r = {};
 	XClipBox (g_xui.x11_clip, &r);
-	XCopyArea (g_xui.dpy, g_xui.x11_pixmap, g_xui.x11_window,
-		DefaultGC (g_xui.dpy, DefaultScreen (g_xui.dpy)),
+	XSetRegion (g_xui.dpy, gc, g_xui.x11_clip);
+	XCopyArea (g_xui.dpy, g_xui.x11_pixmap, g_xui.x11_window, gc,
 		r.x, r.y, r.width, r.height, r.x, r.y);
+	XSetClipMask (g_xui.dpy, gc, None);
 
 	XSubtractRegion (g_xui.x11_clip, g_xui.x11_clip, g_xui.x11_clip);
 	poller_idle_set (&g_xui.xpending_event);
@@ -1386,6 +1475,7 @@ x11_destroy (void)
 	XDestroyIC (g_xui.x11_ic);
 	XCloseIM (g_xui.x11_im);
 	XDestroyRegion (g_xui.x11_clip);
+	XDestroyRegion (g_xui.x11_damage);
 	XDestroyWindow (g_xui.dpy, g_xui.x11_window);
 	XRenderFreePicture (g_xui.dpy, g_xui.x11_pixmap_picture);
 	XFreePixmap (g_xui.dpy, g_xui.x11_pixmap);
@@ -1569,6 +1659,10 @@ x11_init_pixmap (void)
 	XRenderPictFormat *format = XRenderFindVisualFormat (g_xui.dpy, visual);
 	g_xui.x11_pixmap_picture
 		= XRenderCreatePicture (g_xui.dpy, g_xui.x11_pixmap, format, 0, NULL);
+
+	// The new pixmap's contents are undefined.
+	XRectangle r = { 0, 0, g_xui.width, g_xui.height };
+	XUnionRectWithRegion (&r, g_xui.x11_damage, g_xui.x11_damage);
 }
 
 static char *
@@ -1919,7 +2013,7 @@ x11_init (struct poller *poller, struct attrs *app_attrs, size_t app_attrs_len)
 	//   from XSETTINGS.  Sadly, Gtk/FontName is in the Pango format,
 	//   which is rather difficult to parse.
 	g_xui.x11_xsettings = xdg_xsettings_make ();
-	xdg_xsettings_update (&g_xui.x11_xsettings, g_xui.dpy);
+	xdg_xsettings_update (&g_xui.x11_xsettings, g_xui.dpy, NULL);
 
 	if (!(g_xui.xft_fonts = x11_font_open (0)))
 		exit_fatal ("cannot open a font");
@@ -1962,6 +2056,7 @@ x11_init (struct poller *poller, struct attrs *app_attrs, size_t app_attrs_len)
 		g_xui.width, g_xui.height, 0, CopyFromParent, InputOutput, visual,
 		CWEventMask | CWBackPixel | CWBitGravity, &attrs);
 	g_xui.x11_clip = XCreateRegion ();
+	g_xui.x11_damage = XCreateRegion ();
 
 	XTextProperty prop = {};
 	char *name = PROGRAM_NAME;
@@ -2164,9 +2259,8 @@ xui_on_refresh (void *user_data)
 	(void) user_data;
 	poller_idle_reset (&g_xui.refresh_event);
 
-	LIST_FOR_EACH (struct widget, w, g_xui.widgets)
-		widget_destroy (w);
-
+	// The previous frame is kept around, so that it can be compared against.
+	struct widget *previous = g_xui.widgets;
 	g_xui.widgets = NULL;
 	app_layout ();
 
@@ -2175,7 +2269,10 @@ xui_on_refresh (void *user_data)
 		if (w->on_allocated)
 			w->on_allocated (w);
 
-	g_xui.ui->render ();
+	g_xui.ui->render (previous);
+	LIST_FOR_EACH (struct widget, w, previous)
+		widget_destroy (w);
+
 	poller_idle_set (&g_xui.flip_event);
 }
 
@@ -299,13 +299,14 @@ xstrdup (const char *s)
 static char *
 xstrndup (const char *s, size_t n)
 {
-	size_t size = strlen (s);
-	if (n > size)
-		n = size;
-
-	char *copy = xmalloc (n + 1);
-	memcpy (copy, s, n);
-	copy[n] = '\0';
+	// Like strnlen(), the input needn't be NUL-terminated within N bytes
+	size_t size = 0;
+	while (size < n && s[size])
+		size++;
+
+	char *copy = xmalloc (size + 1);
+	memcpy (copy, s, size);
+	copy[size] = '\0';
 	return copy;
 }
 
@@ -979,6 +980,18 @@ str_map_shrink (struct str_map *self)
 		str_map_resize (self, new_alloc);
 }
 
+/// Make room for at least @a n entries, so that the table doesn't need
+/// to be resized while they are being inserted
+static void
+str_map_reserve (struct str_map *self, size_t n)
+{
+	size_t new_alloc = self->alloc;
+	while (new_alloc < n)
+		new_alloc <<= 1;
+	if (new_alloc != self->alloc)
+		str_map_resize (self, new_alloc);
+}
+
 static void
 str_map_set_real (struct str_map *self, const char *key, void *value)
 {
@@ -3100,17 +3113,47 @@ iconv_xstrdup (iconv_t conv, char *in, size_t in_len, size_t *out_len)
 	return buf;
 }
 
+// perfhash.awk: boolean_word_lookup -1 fold
+//   yes    true
+//   no     false
+//   on     true
+//   off    false
+//   true   true
+//   false  false
+static int
+boolean_word_lookup (const char *s, size_t len)
+{
+	static const struct { const char *key; size_t len; int value; }
+	table[7] =
+	{
+		[0] = { "on", 2, true },
+		[2] = { "false", 5, false },
+		[3] = { "no", 2, false },
+		[4] = { "true", 4, true },
+		[5] = { "yes", 3, true },
+		[6] = { "off", 3, false },
+	};
+
+	uint32_t hash = 7;
+	for (size_t i = 0; i < len; i++)
+		hash = (hash * 33 + tolower_ascii ((unsigned char) s[i])) & 0xFFFFFF;
+
+	size_t slot = hash % 7;
+	if (!table[slot].key || table[slot].len != len
+	 || strncasecmp_ascii (table[slot].key, s, len))
+		return -1;
+	return table[slot].value;
+}
+// perfhash.awk: end
+
 static bool
 set_boolean_if_valid (bool *out, const char *s)
 {
-	if      (!strcasecmp (s, "yes"))    *out = true;
-	else if (!strcasecmp (s, "no"))     *out = false;
-	else if (!strcasecmp (s, "on"))     *out = true;
-	else if (!strcasecmp (s, "off"))    *out = false;
-	else if (!strcasecmp (s, "true"))   *out = true;
-	else if (!strcasecmp (s, "false"))  *out = false;
-	else return false;
+	int value = boolean_word_lookup (s, strlen (s));
+	if (value == -1)
+		return false;
 
+	*out = value;
 	return true;
 }
 
@@ -3509,27 +3552,283 @@ regex_free (void *regex)
 // Adding basic support for subgroups is easy: check `re_nsub' and output into
 // a `struct strv' (if all we want is the substrings).
 
-static struct str_map
+struct regex_cache_entry
+{
+	LIST_HEADER (struct regex_cache_entry)
+
+	char *key;                          ///< Flags and the expression
+	regex_t *re;                        ///< Compiled expression
+};
+
+struct regex_cache
+{
+	struct str_map map;                 ///< Keys to regex_cache_entry
+	struct regex_cache_entry *head;     ///< Least recently used entry
+	struct regex_cache_entry *tail;     ///< Most recently used entry
+	size_t limit;                       ///< Maximum entries, 0 for no limit
+
+	size_t hits;                        ///< Lookups that found an entry
+	size_t misses;                      ///< Lookups that compiled an entry
+};
+
+static struct regex_cache
 regex_cache_make (void)
 {
-	return str_map_make (regex_free);
+	return (struct regex_cache) { .map = str_map_make (NULL), .limit = 256 };
+}
+
+static void
+regex_cache_evict (struct regex_cache *self, struct regex_cache_entry *entry)
+{
+	LIST_UNLINK_WITH_TAIL (self->head, self->tail, entry);
+	str_map_set (&self->map, entry->key, NULL);
+	regex_free (entry->re);
+	free (entry->key);
+	free (entry);
+}
+
+static void
+regex_cache_free (struct regex_cache *self)
+{
+	while (self->head)
+		regex_cache_evict (self, self->head);
+	str_map_free (&self->map);
 }
 
 static bool
-regex_cache_match (struct str_map *cache, const char *regex, int flags,
+regex_cache_match (struct regex_cache *self, const char *regex, int flags,
 	const char *s, struct error **e)
 {
-	regex_t *re = str_map_find (cache, regex);
+	// Flags change the meaning of the expression, so they're a part of the key
+	char *key = xstrdup_printf ("%d %s", flags, regex);
+	struct regex_cache_entry *entry = str_map_find (&self->map, key);
+	if (entry)
+	{
+		self->hits++;
+		free (key);
+
+		LIST_UNLINK_WITH_TAIL (self->head, self->tail, entry);
+		LIST_APPEND_WITH_TAIL (self->head, self->tail, entry);
+		return regexec (entry->re, s, 0, NULL, 0) != REG_NOMATCH;
+	}
+
+	self->misses++;
+	regex_t *re = regex_compile (regex, flags, e);
 	if (!re)
 	{
-		re = regex_compile (regex, flags, e);
-		if (!re)
-			return false;
-		str_map_set (cache, regex, re);
+		free (key);
+		return false;
 	}
+
+	while (self->limit && self->map.len >= self->limit)
+		regex_cache_evict (self, self->head);
+
+	entry = xcalloc (1, sizeof *entry);
+	entry->key = key;
+	entry->re = re;
+	str_map_set (&self->map, key, entry);
+	LIST_APPEND_WITH_TAIL (self->head, self->tail, entry);
 	return regexec (re, s, 0, NULL, 0) != REG_NOMATCH;
 }
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// Matching a string against many expressions is mostly about ruling them out
+// quickly.  We extract a literal that any match must contain from each
+// expression where it's easy to do conservatively, and before running any
+// of them, we collect all pairs of adjacent bytes in the string into a bitmap.
+// Expressions whose literal has a pair missing from the string are skipped.
+
+#define REGEX_SET_PAIR_BITS 4096
+
+struct regex_set_entry
+{
+	regex_t *re;                        ///< Compiled expression
+	char *literal;                      ///< Required literal, or NULL
+};
+
+struct regex_set
+{
+	ARRAY (struct regex_set_entry, entries)
+};
+
+static struct regex_set
+regex_set_make (void)
+{
+	struct regex_set self = {};
+	ARRAY_INIT (self.entries);
+	return self;
+}
+
+static void
+regex_set_free (struct regex_set *self)
+{
+	for (size_t i = 0; i < self->entries_len; i++)
+	{
+		regex_free (self->entries[i].re);
+		free (self->entries[i].literal);
+	}
+	free (self->entries);
+}
+
+/// Skip a bracket expression, returning a pointer to its closing bracket
+static const char *
+regex_set_skip_bracket (const char *p)
+{
+	if (*++p == '^')
+		p++;
+	if (*p == ']')
+		p++;
+	for (; *p && *p != ']'; p++)
+	{
+		if (*p != '[' || (p[1] != ':' && p[1] != '.' && p[1] != '='))
+			continue;
+
+		char terminator[3] = { p[1], ']', 0 };
+		if (!(p = strstr (p + 2, terminator)))
+			return NULL;
+		p++;
+	}
+	return *p ? p : NULL;
+}
+
+static void
+regex_set_keep_longer (struct str *best, struct str *run)
+{
+	if (run->len > best->len)
+	{
+		str_reset (best);
+		str_append_data (best, run->str, run->len);
+	}
+	str_reset (run);
+}
+
+/// Find the longest run of literal characters outside of any group, leaving
+/// out those that a quantifier applies to.  May give up at any point.
+static char *
+regex_set_extract_literal (const char *regex, int flags)
+{
+	bool extended = flags & REG_EXTENDED, icase = flags & REG_ICASE;
+	if (strchr (regex, '|'))
+		return NULL;
+
+	// Multibyte locales fold a few non-ASCII characters to ASCII letters:
+	// U+212A KELVIN SIGN to "k", U+017F LATIN SMALL LETTER LONG S to "s",
+	// and U+0130 and U+0131, the dotted and dotless I, to "i"
+	bool fold_letters = icase && MB_CUR_MAX > 1;
+
+	struct str run = str_make (), best = str_make ();
+	for (const char *p = regex; *p; p++)
+	{
+		unsigned char c = *p;
+		bool quantifier = c == '*' || (extended && strchr ("?+{", c));
+		bool literal = !quantifier && !strchr ("^$.[\\", c)
+			&& !(extended && strchr ("()", c));
+
+		if (c == '\\')
+		{
+			if (!(c = *++p) || (!extended && c == '('))
+				break;
+			quantifier = !extended && strchr ("{?+", c);
+			literal = c < 0x80 && !isalnum_ascii (c)
+				&& !strchr ("<>`'(){}?+", c);
+		}
+		else if (c == '[' && !(p = regex_set_skip_bracket (p)))
+			break;
+		else if (extended && c == '(')
+			break;
+
+		// Interval bounds aren't literals either
+		if (quantifier && c == '{')
+		{
+			if (!(p = strstr (p, extended ? "}" : "\\}")))
+				break;
+			p += !extended;
+		}
+
+		if (literal && !(icase && c >= 0x80)
+		 && !(fold_letters && strchr ("KkSsIi", c)))
+		{
+			str_append_c (&run, tolower_ascii (c));
+			continue;
+		}
+
+		// Remove the whole last character, which might be multibyte
+		if (quantifier)
+		{
+			while (run.len && (run.str[run.len - 1] & 0xC0) == 0x80)
+				run.len--;
+			if (run.len)
+				run.len--;
+		}
+		regex_set_keep_longer (&best, &run);
+	}
+	regex_set_keep_longer (&best, &run);
+	str_free (&run);
+
+	// Single bytes wouldn't make any use of the pair bitmap
+	if (best.len >= 2)
+		return str_steal (&best);
+	str_free (&best);
+	return NULL;
+}
+
+static bool
+regex_set_add (struct regex_set *self, const char *regex, int flags,
+	struct error **e)
+{
+	regex_t *re = regex_compile (regex, flags, e);
+	if (!re)
+		return false;
+
+	ARRAY_RESERVE (self->entries, 1);
+	self->entries[self->entries_len++] = (struct regex_set_entry)
+		{ .re = re, .literal = regex_set_extract_literal (regex, flags) };
+	return true;
+}
+
+static unsigned
+regex_set_pair (const char *p)
+{
+	return (tolower_ascii ((unsigned char) p[0]) * 67
+		+ tolower_ascii ((unsigned char) p[1])) % REGEX_SET_PAIR_BITS;
+}
+
+/// Store whether each of the expressions matches the string in "matched",
+/// return the number of matches.  With "matched" being NULL, it stops
+/// at the first match.
+static size_t
+regex_set_match (const struct regex_set *self, const char *s, bool *matched)
+{
+	uint64_t pairs[REGEX_SET_PAIR_BITS / 64] = {};
+	for (const char *p = s; *p && p[1]; p++)
+	{
+		unsigned pair = regex_set_pair (p);
+		pairs[pair / 64] |= (uint64_t) 1 << (pair % 64);
+	}
+
+	size_t count = 0;
+	for (size_t i = 0; i < self->entries_len; i++)
+	{
+		const struct regex_set_entry *entry = &self->entries[i];
+		bool result = true;
+		for (const char *p = entry->literal; result && p && p[1]; p++)
+		{
+			unsigned pair = regex_set_pair (p);
+			result = (pairs[pair / 64] >> (pair % 64)) & 1;
+		}
+		if (result)
+			result = regexec (entry->re, s, 0, NULL, 0) != REG_NOMATCH;
+		if (matched)
+			matched[i] = result;
+		if (result)
+			count++;
+		if (result && !matched)
+			break;
+	}
+	return count;
+}
+
 // --- Simple file I/O ---------------------------------------------------------
 
 static bool
@@ -3559,10 +3858,14 @@ read_file (const char *filename, struct str *output, struct error **e)
 		filename, strerror (errno));
 }
 
-/// Overwrites filename contents with data; creates directories as needed
+/// Writes file contents to a file descriptor
+typedef bool (*write_file_fn) (int fd, void *user_data, struct error **e);
+
+/// Overwrites filename contents with whatever the callback writes;
+/// creates directories as needed
 static bool
-write_file (const char *filename, const void *data, size_t data_len,
-	struct error **e)
+write_file_with (const char *filename,
+	write_file_fn writer, void *user_data, struct error **e)
 {
 	char *dir = xstrdup (filename);
 	bool parents_created = mkdir_with_parents (dirname (dir), e);
@@ -3570,38 +3873,41 @@ write_file (const char *filename, const void *data, size_t data_len,
 	if (!parents_created)
 		return false;
 
-	FILE *fp = fopen (filename, "w");
-	if (!fp)
+	int fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
 	{
 		return error_set (e, "could not open `%s' for writing: %s",
 			filename, strerror (errno));
 	}
 
-	fwrite (data, data_len, 1, fp);
-	bool success = !ferror (fp) && !fflush (fp)
-		&& (!fsync (fileno (fp)) || errno == EINVAL);
-	fclose (fp);
-
-	if (!success)
+	bool success = false;
+	struct error *error = NULL;
+	if (!writer (fd, user_data, &error))
 	{
-		return error_set (e, "writing to `%s' failed: %s",
-			filename, strerror (errno));
+		error_set (e, "writing to `%s' failed: %s", filename, error->message);
+		error_free (error);
 	}
-	return true;
+	else if (fsync (fd) && errno != EINVAL)
+		error_set (e, "writing to `%s' failed: %s", filename, strerror (errno));
+	else
+		success = true;
+
+	xclose (fd);
+	return success;
 }
 
-/// Wrapper for write_file() that makes sure that the new data has been written
-/// to disk in its entirety before overriding the old file
+/// Wrapper for write_file_with() that makes sure that the new data has been
+/// written to disk in its entirety before overriding the old file
 static bool
-write_file_safe (const char *filename, const void *data, size_t data_len,
-	struct error **e)
+write_file_safe_with (const char *filename,
+	write_file_fn writer, void *user_data, struct error **e)
 {
 	// XXX: ideally we would also open the directory, use *at() versions
 	//   of functions and call fsync() on the directory as appropriate
 	// FIXME: this should behave similarly to mkstemp(), just with 0666;
 	//   as it is, this function is not particularly safe
 	char *temp = xstrdup_printf ("%s.new", filename);
-	bool success = write_file (temp, data, data_len, e);
+	bool success = write_file_with (temp, writer, user_data, e);
 	if (success && !(success = !rename (temp, filename)))
 		error_set (e, "could not rename `%s' to `%s': %s",
 			temp, filename, strerror (errno));
@@ -3609,6 +3915,32 @@ write_file_safe (const char *filename, const void *data, size_t data_len,
 	return success;
 }
 
+static bool
+write_file_data (int fd, void *user_data, struct error **e)
+{
+	const struct str *data = user_data;
+	return xwrite (fd, data->str, data->len, e);
+}
+
+/// Overwrites filename contents with data; creates directories as needed
+static bool
+write_file (const char *filename, const void *data, size_t data_len,
+	struct error **e)
+{
+	struct str wrapper = { .str = (char *) data, .len = data_len };
+	return write_file_with (filename, write_file_data, &wrapper, e);
+}
+
+/// Wrapper for write_file() that makes sure that the new data has been written
+/// to disk in its entirety before overriding the old file
+static bool
+write_file_safe (const char *filename, const void *data, size_t data_len,
+	struct error **e)
+{
+	struct str wrapper = { .str = (char *) data, .len = data_len };
+	return write_file_safe_with (filename, write_file_data, &wrapper, e);
+}
+
 // --- Simple configuration ----------------------------------------------------
 
 // This is the bare minimum to make an application configurable.
@@ -4506,6 +4838,12 @@ struct config_item
 
 	const struct config_schema *schema; ///< Schema describing this value
 	void *user_data;                    ///< User value attached by schema owner
+
+	/// Items referenced more than once are shared and must not be modified,
+	/// see config_item_make_private().  Their children get frozen, since
+	/// they can be reached from multiple places, even with a single reference.
+	unsigned ref_count;                 ///< Reference count
+	bool frozen;                        ///< Reachable from a shared item
 };
 
 struct config_schema
@@ -4566,22 +4904,110 @@ config_item_free (struct config_item *self)
 	}
 }
 
+// Shared items may be read from and released by other threads
+#if defined __GNUC__
+#define CONFIG_ITEM_REF_COUNT(x) __atomic_load_n (&(x), __ATOMIC_ACQUIRE)
+#define CONFIG_ITEM_REF(x)       __atomic_add_fetch (&(x), 1, __ATOMIC_RELAXED)
+#define CONFIG_ITEM_UNREF(x)     __atomic_sub_fetch (&(x), 1, __ATOMIC_ACQ_REL)
+#else // ! __GNUC__
+#define CONFIG_ITEM_REF_COUNT(x) (x)
+#define CONFIG_ITEM_REF(x)       (++(x))
+#define CONFIG_ITEM_UNREF(x)     (--(x))
+#endif // ! __GNUC__
+
+static struct config_item *
+config_item_ref (struct config_item *self)
+{
+	CONFIG_ITEM_REF (self->ref_count);
+	return self;
+}
+
 static void
 config_item_destroy (struct config_item *self)
 {
+	if (CONFIG_ITEM_UNREF (self->ref_count))
+		return;
+
 	config_item_free (self);
 	free (self);
 }
 
+/// Whether the item may be modified in place
+static bool
+config_item_is_private (const struct config_item *self)
+{
+	return !self->frozen && CONFIG_ITEM_REF_COUNT (self->ref_count) == 1;
+}
+
+/// Mark a subtree as immutable before it gets shared.  Frozen items are never
+/// thawed, only replaced with copies, so they may already be read from other
+/// threads, and the recursion stops at them.
+static void
+config_item_freeze (struct config_item *self)
+{
+	if (self->frozen)
+		return;
+
+	self->frozen = true;
+	if (self->type != CONFIG_ITEM_OBJECT)
+		return;
+
+	struct str_map_iter iter = str_map_iter_make (&self->value.object);
+	struct config_item *child;
+	while ((child = str_map_iter_next (&iter)))
+		config_item_freeze (child);
+}
+
+/// Make a shallow copy of the value, nested items get shared
+static void
+config_item_copy_value (struct config_item *self,
+	const struct config_item *source)
+{
+	self->type = source->type;
+	switch (source->type)
+	{
+	case CONFIG_ITEM_STRING:
+	case CONFIG_ITEM_STRING_ARRAY:
+		self->value.string = str_make ();
+		str_append_data (&self->value.string,
+			source->value.string.str, source->value.string.len);
+		break;
+	case CONFIG_ITEM_OBJECT:
+	{
+		self->value.object =
+			str_map_make ((str_map_free_fn) config_item_destroy);
+		struct str_map_iter iter = str_map_iter_make (&source->value.object);
+		struct config_item *child;
+		while ((child = str_map_iter_next (&iter)))
+		{
+			config_item_freeze (child);
+			str_map_set (&self->value.object, iter.link->key,
+				config_item_ref (child));
+		}
+		break;
+	}
+	default:
+		memcpy (&self->value, &source->value, sizeof source->value);
+	}
+}
+
 /// Doesn't do any validations or handle schemas, just moves source data
 /// to the target item and destroys the source item
 static void
 config_item_move (struct config_item *self, struct config_item *source)
 {
+	hard_assert (config_item_is_private (self));
+	config_item_free (self);
+	if (!config_item_is_private (source))
+	{
+		config_item_copy_value (self, source);
+		config_item_destroy (source);
+		return;
+	}
+
 	// Not quite sure how to handle that
 	hard_assert (!source->schema);
 
-	config_item_free (self);
 	self->type = source->type;
 	memcpy (&self->value, &source->value, sizeof source->value);
 	free (source);
@@ -4592,9 +5018,55 @@ config_item_new (enum config_item_type type)
 {
 	struct config_item *self = xcalloc (1, sizeof *self);
 	self->type = type;
+	self->ref_count = 1;
 	return self;
 }
 
+/// Return an item that may be modified in place of the one passed in,
+/// which is consumed.  Only shared items need to be copied, and only
+/// shallowly, so changing a nested item copies just the path leading to it.
+static struct config_item *
+config_item_make_private (struct config_item *self)
+{
+	if (config_item_is_private (self))
+		return self;
+
+	struct config_item *copy = config_item_new (self->type);
+	config_item_copy_value (copy, self);
+	copy->schema = self->schema;
+	copy->user_data = self->user_data;
+	config_item_destroy (self);
+	return copy;
+}
+
+/// Make an object's child private, replacing it within the object as needed.
+/// This doesn't change the object's structure, so it can be iterated over.
+static struct config_item *
+config_item_unshare (struct config_item *object, const char *key)
+{
+	hard_assert (config_item_is_private (object));
+	struct config_item *child = str_map_find (&object->value.object, key);
+	if (child && !config_item_is_private (child))
+		str_map_set (&object->value.object, key,
+			(child = config_item_make_private (config_item_ref (child))));
+	return child;
+}
+
+/// Make all items within an object private, so that any of them can be
+/// modified, even when looked up with config_item_get()
+static void
+config_item_unshare_all (struct config_item *object)
+{
+	struct str_map_iter iter = str_map_iter_make (&object->value.object);
+	while (str_map_iter_next (&iter))
+	{
+		struct config_item *child =
+			config_item_unshare (object, iter.link->key);
+		if (child->type == CONFIG_ITEM_OBJECT)
+			config_item_unshare_all (child);
+	}
+}
+
 static struct config_item *
 config_item_null (void)
 {
@@ -4698,9 +5170,23 @@ config_item_set_from (struct config_item *self, struct config_item *source,
 		return true;
 	}
 
+	// Shared items must not be modified, and the caller keeps its reference
+	// to the source in case of failure
+	struct config_item *shared = NULL;
+	if (!config_item_is_private (source))
+	{
+		shared = source;
+		source = config_item_new (shared->type);
+		config_item_copy_value (source, shared);
+	}
+
 	source->user_data = self->user_data;
 	if (!config_item_validate_by_schema (source, schema, e))
+	{
+		if (shared)
+			config_item_destroy (source);
 		return false;
+	}
 
 	// Make sure the string subtype fits the schema
 	if (config_item_type_is_string (source->type)
@@ -4708,6 +5194,8 @@ config_item_set_from (struct config_item *self, struct config_item *source,
 		source->type = schema->type;
 
 	config_item_move (self, source);
+	if (shared)
+		config_item_destroy (shared);
 
 	// Notify owner about the change so that they can apply it
 	if (schema->on_change)
@@ -4744,55 +5232,165 @@ config_item_get (struct config_item *self, const char *path, struct error **e)
 	return result;
 }
 
-// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-
-struct config_writer
+/// Like config_item_get(), but makes the item and the path leading to it
+/// private, so that it can be modified.  The root may get replaced as well,
+/// and any pointers to items on the path need to be looked up again.
+static struct config_item *
+config_item_get_private (struct config_item **root, const char *path,
+	struct error **e)
 {
-	struct str *output;
-	unsigned indent;
-};
+	struct config_item *self = *root = config_item_make_private (*root);
+	hard_assert (self->type == CONFIG_ITEM_OBJECT);
 
-static void config_item_write_object_innards
-	(struct config_writer *self, struct config_item *object);
+	struct strv v = strv_make ();
+	cstr_split (path, ".", false, &v);
+
+	struct config_item *result = NULL;
+	size_t i = 0;
+	while (true)
+	{
+		const char *key = v.vector[i];
+		if (!*key)
+			error_set (e, "empty path element");
+		else if (!(self = config_item_unshare (self, key)))
+			error_set (e, "`%s' not found in object", key);
+		else if (++i == v.len)
+			result = self;
+		else if (self->type != CONFIG_ITEM_OBJECT)
+			error_set (e, "`%s' is not an object", key);
+		else
+			continue;
+		break;
+	}
+	strv_free (&v);
+	return result;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// How much output to buffer before writing it out to a file descriptor
+#define CONFIG_WRITER_BUFFER_SIZE  (64 << 10)
+
+struct config_writer
+{
+	struct str *output;                 ///< Output buffer
+	unsigned indent;                    ///< Current indentation level
+
+	int fd;                             ///< Flush the output here, or -1
+	struct error *error;                ///< The first write error
+};
+
+static void
+config_writer_flush (struct config_writer *self,
+	const char *data, size_t len)
+{
+	if (!self->error)
+		xwrite (self->fd, data, len, &self->error);
+}
+
+static void
+config_writer_put (struct config_writer *self, const char *data, size_t len)
+{
+	if (self->fd < 0)
+	{
+		str_append_data (self->output, data, len);
+		return;
+	}
+
+	if (self->output->len + len > CONFIG_WRITER_BUFFER_SIZE)
+	{
+		config_writer_flush (self, self->output->str, self->output->len);
+		self->output->str[self->output->len = 0] = '\0';
+	}
+	if (len >= CONFIG_WRITER_BUFFER_SIZE)
+		config_writer_flush (self, data, len);
+	else
+		str_append_data (self->output, data, len);
+}
+
+static void
+config_writer_put_cstr (struct config_writer *self, const char *s)
+{
+	config_writer_put (self, s, strlen (s));
+}
+
+static void
+config_writer_put_indent (struct config_writer *self)
+{
+	static const char tabs[] = "\t\t\t\t\t\t\t\t";
+	for (unsigned i = self->indent; i; )
+	{
+		unsigned n = MIN (i, sizeof tabs - 1);
+		config_writer_put (self, tabs, n);
+		i -= n;
+	}
+}
+
+static void
+config_writer_put_integer (struct config_writer *self, int64_t i)
+{
+	char buf[24], *p = buf + sizeof buf;
+	uint64_t u = i < 0 ? -(uint64_t) i : (uint64_t) i;
+	do
+		*--p = '0' + u % 10;
+	while (u /= 10);
+	if (i < 0)
+		*--p = '-';
+	config_writer_put (self, p, buf + sizeof buf - p);
+}
+
+static void config_item_write_object_innards
+	(struct config_writer *self, struct config_item *object);
 
 static void
-config_item_write_string (struct str *output, const struct str *s)
+config_item_write_string (struct config_writer *self, const char *s, size_t len)
 {
-	str_append_c (output, '"');
-	for (size_t i = 0; i < s->len; i++)
+	static const char hex[] = "0123456789abcdef";
+
+	// Runs of characters that need no escaping are copied over at once
+	const char *end = s + len, *clean = s;
+	config_writer_put (self, "\"", 1);
+	for (; s < end; s++)
 	{
-		unsigned char c = s->str[i];
-		if      (c == '\n')  str_append (output, "\\n");
-		else if (c == '\r')  str_append (output, "\\r");
-		else if (c == '\t')  str_append (output, "\\t");
-		else if (c == '\\')  str_append (output, "\\\\");
-		else if (c == '"')   str_append (output, "\\\"");
+		unsigned char c = *s;
+		if (c != '\\' && c != '"' && !iscntrl_ascii (c))
+			continue;
+
+		config_writer_put (self, clean, s - clean);
+		clean = s + 1;
+
+		char escape[4] = { '\\', c, 0, 0 };
+		if      (c == '\n')  escape[1] = 'n';
+		else if (c == '\r')  escape[1] = 'r';
+		else if (c == '\t')  escape[1] = 't';
 		else if (iscntrl_ascii (c))
-			str_append_printf (output, "\\x%02x", c);
-		else
-			str_append_c (output, c);
+		{
+			escape[1] = 'x';
+			escape[2] = hex[c >> 4];
+			escape[3] = hex[c & 0xf];
+			config_writer_put (self, escape, 4);
+			continue;
+		}
+		config_writer_put (self, escape, 2);
 	}
-	str_append_c (output, '"');
+	config_writer_put (self, clean, end - clean);
+	config_writer_put (self, "\"", 1);
 }
 
 static void
 config_item_write_object
 	(struct config_writer *self, struct config_item *value)
 {
-	char indent[self->indent + 1];
-	memset (indent, '\t', self->indent);
-	indent[self->indent] = 0;
-
-	str_append_c (self->output, '{');
+	config_writer_put (self, "{", 1);
 	if (value->value.object.len)
 	{
 		self->indent++;
-		str_append_c (self->output, '\n');
+		config_writer_put (self, "\n", 1);
 		config_item_write_object_innards (self, value);
 		self->indent--;
-		str_append (self->output, indent);
+		config_writer_put_indent (self);
 	}
-	str_append_c (self->output, '}');
+	config_writer_put (self, "}", 1);
 }
 
 static void
@@ -4801,17 +5399,18 @@ config_item_write_value (struct config_writer *self, struct config_item *value)
 	switch (value->type)
 	{
 	case CONFIG_ITEM_NULL:
-		str_append (self->output, "null");
+		config_writer_put_cstr (self, "null");
 		break;
 	case CONFIG_ITEM_BOOLEAN:
-		str_append (self->output, value->value.boolean ? "on" : "off");
+		config_writer_put_cstr (self, value->value.boolean ? "on" : "off");
 		break;
 	case CONFIG_ITEM_INTEGER:
-		str_append_printf (self->output, "%" PRIi64, value->value.integer);
+		config_writer_put_integer (self, value->value.integer);
 		break;
 	case CONFIG_ITEM_STRING:
 	case CONFIG_ITEM_STRING_ARRAY:
-		config_item_write_string (self->output, &value->value.string);
+		config_item_write_string (self,
+			value->value.string.str, value->value.string.len);
 		break;
 	case CONFIG_ITEM_OBJECT:
 		config_item_write_object (self, value);
@@ -4826,15 +5425,15 @@ static bool config_tokenizer_is_word_char (int c);
 
 static void
 config_item_write_kv_pair (struct config_writer *self,
-	const char *key, struct config_item *value)
+	const char *key, size_t key_len, struct config_item *value)
 {
-	char indent[self->indent + 1];
-	memset (indent, '\t', self->indent);
-	indent[self->indent] = 0;
-
 	if (value->schema && value->schema->comment)
-		str_append_printf (self->output,
-			"%s# %s\n", indent, value->schema->comment);
+	{
+		config_writer_put_indent (self);
+		config_writer_put (self, "# ", 2);
+		config_writer_put_cstr (self, value->schema->comment);
+		config_writer_put (self, "\n", 1);
+	}
 
 	char *end = NULL;
 	bool can_use_word = ((void) strtoll (key, &end, 10), end == key);
@@ -4842,18 +5441,22 @@ config_item_write_kv_pair (struct config_writer *self,
 		if (!config_tokenizer_is_word_char (*p))
 			can_use_word = false;
 
-	str_append (self->output, indent);
+	config_writer_put_indent (self);
 	if (can_use_word)
-		str_append (self->output, key);
+		config_writer_put (self, key, key_len);
 	else
-	{
-		struct str s = { .str = (char *) key, .len = strlen (key) };
-		config_item_write_string (self->output, &s);
-	}
+		config_item_write_string (self, key, key_len);
 
-	str_append (self->output, " = ");
+	config_writer_put (self, " = ", 3);
 	config_item_write_value (self, value);
-	str_append_c (self->output, '\n');
+	config_writer_put (self, "\n", 1);
+}
+
+static int
+config_item_write_compare_links (const void *a, const void *b)
+{
+	return strcmp ((*(const struct str_map_link **) a)->key,
+		(*(const struct str_map_link **) b)->key);
 }
 
 static void
@@ -4862,21 +5465,78 @@ config_item_write_object_innards
 {
 	hard_assert (object->type == CONFIG_ITEM_OBJECT);
 
+	// Sort the keys, so that the output doesn't depend on hashing
+	size_t len = object->value.object.len;
+	struct str_map_link **links = xcalloc (len, sizeof *links);
+
 	struct str_map_iter iter = str_map_iter_make (&object->value.object);
-	struct config_item *value;
-	while ((value = str_map_iter_next (&iter)))
-		config_item_write_kv_pair (self, iter.link->key, value);
+	for (size_t i = 0; str_map_iter_next (&iter); i++)
+		links[i] = iter.link;
+	qsort (links, len, sizeof *links, config_item_write_compare_links);
+
+	for (size_t i = 0; i < len; i++)
+		config_item_write_kv_pair (self,
+			links[i]->key, links[i]->key_length, links[i]->data);
+	free (links);
 }
 
 static void
-config_item_write (struct config_item *value,
-	bool object_innards, struct str *output)
+config_item_write_real (struct config_writer *self,
+	struct config_item *value, bool object_innards)
 {
-	struct config_writer writer = { .output = output, .indent = 0 };
 	if (object_innards)
-		config_item_write_object_innards (&writer, value);
+		config_item_write_object_innards (self, value);
 	else
-		config_item_write_value (&writer, value);
+		config_item_write_value (self, value);
+}
+
+static void
+config_item_write (struct config_item *value,
+	bool object_innards, struct str *output)
+{
+	struct config_writer writer = { .output = output, .fd = -1 };
+	config_item_write_real (&writer, value, object_innards);
+}
+
+/// Stream the serialized item to a file descriptor, using a bounded buffer
+static bool
+config_item_write_to_fd (struct config_item *value,
+	bool object_innards, int fd, struct error **e)
+{
+	struct str buffer = str_make ();
+	struct config_writer writer = { .output = &buffer, .fd = fd };
+	config_item_write_real (&writer, value, object_innards);
+	config_writer_flush (&writer, buffer.str, buffer.len);
+	str_free (&buffer);
+
+	if (!writer.error)
+		return true;
+
+	error_propagate (e, writer.error);
+	return false;
+}
+
+struct config_item_write_args
+{
+	struct config_item *value;          ///< The item to write
+	bool object_innards;                ///< Leave out the outer braces
+};
+
+static bool
+config_item_write_file_data (int fd, void *user_data, struct error **e)
+{
+	struct config_item_write_args *args = user_data;
+	return config_item_write_to_fd (args->value, args->object_innards, fd, e);
+}
+
+/// Like write_file_safe(), except the item is streamed to the file
+static bool
+config_item_write_file_safe (struct config_item *value,
+	bool object_innards, const char *filename, struct error **e)
+{
+	struct config_item_write_args args = { value, object_innards };
+	return write_file_safe_with
+		(filename, config_item_write_file_data, &args, e);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -4925,12 +5585,11 @@ config_token_name (enum config_token token)
 
 struct config_tokenizer
 {
+	const char *start;                  ///< Beginning of input
 	const char *p;                      ///< Current position in input
 	size_t len;                         ///< How many bytes of input are left
 
-	bool report_line;                   ///< Whether to count lines at all
-	unsigned line;                      ///< Current line
-	unsigned column;                    ///< Current column
+	bool report_line;                   ///< Whether to report lines at all
 
 	int64_t integer;                    ///< Parsed boolean or integer value
 	struct str string;                  ///< Parsed string value
@@ -4940,8 +5599,8 @@ struct config_tokenizer
 static struct config_tokenizer
 config_tokenizer_make (const char *p, size_t len)
 {
-	return (struct config_tokenizer)
-		{ .p = p, .len = len, .report_line = true, .string = str_make () };
+	return (struct config_tokenizer) { .start = p, .p = p, .len = len,
+		.report_line = true, .string = str_make () };
 }
 
 static void
@@ -4959,17 +5618,16 @@ config_tokenizer_is_word_char (int c)
 static int
 config_tokenizer_advance (struct config_tokenizer *self)
 {
-	int c = *self->p++;
-	if (c == '\n' && self->report_line)
-	{
-		self->column = 0;
-		self->line++;
-	}
-	else
-		self->column++;
-
 	self->len--;
-	return c;
+	return *self->p++;
+}
+
+/// Skip over a run of bytes that need no further processing
+static void
+config_tokenizer_skip (struct config_tokenizer *self, size_t n)
+{
+	self->len -= n;
+	self->p += n;
 }
 
 static void config_tokenizer_error (struct config_tokenizer *self,
@@ -4986,12 +5644,22 @@ config_tokenizer_error (struct config_tokenizer *self,
 	str_append_vprintf (&description, format, ap);
 	va_end (ap);
 
+	// Only count lines when we need to know the position
+	unsigned line = 0;
+	const char *line_start = self->start;
+	for (const char *p = self->start; p < self->p; p++)
+		if (*p == '\n')
+		{
+			line++;
+			line_start = p + 1;
+		}
+
 	if (self->report_line)
 		error_set (e, "near line %u, column %u: %s",
-			self->line + 1, self->column + 1, description.str);
+			line + 1, (unsigned) (self->p - line_start) + 1, description.str);
 	else if (self->len)
 		error_set (e, "near character %u: %s",
-			self->column + 1, description.str);
+			(unsigned) (self->p - self->start) + 1, description.str);
 	else
 		error_set (e, "near end: %s", description.str);
 
@@ -5098,14 +5766,21 @@ static bool
 config_tokenizer_dq_string (struct config_tokenizer *self, struct str *output,
 	struct error **e)
 {
-	unsigned char c = config_tokenizer_advance (self);
+	config_tokenizer_advance (self);
 	while (self->len)
 	{
-		if ((c = config_tokenizer_advance (self)) == '"')
+		// Copy over everything up until the next special character at once
+		size_t run = 0;
+		while (run < self->len && self->p[run] != '"' && self->p[run] != '\\')
+			run++;
+		str_append_data (output, self->p, run);
+		config_tokenizer_skip (self, run);
+		if (!self->len)
+			break;
+
+		if (config_tokenizer_advance (self) == '"')
 			return true;
-		if (c != '\\')
-			str_append_c (output, c);
-		else if (!config_tokenizer_escape_sequence (self, output, e))
+		if (!config_tokenizer_escape_sequence (self, output, e))
 			return false;
 	}
 	config_tokenizer_error (self, e, "premature end of string");
@@ -5116,15 +5791,18 @@ static bool
 config_tokenizer_bt_string (struct config_tokenizer *self, struct str *output,
 	struct error **e)
 {
-	unsigned char c = config_tokenizer_advance (self);
-	while (self->len)
+	config_tokenizer_advance (self);
+	const char *end = memchr (self->p, '`', self->len);
+	if (!end)
 	{
-		if ((c = config_tokenizer_advance (self)) == '`')
-			return true;
-		str_append_c (output, c);
+		config_tokenizer_skip (self, self->len);
+		config_tokenizer_error (self, e, "premature end of string");
+		return false;
 	}
-	config_tokenizer_error (self, e, "premature end of string");
-	return false;
+
+	str_append_data (output, self->p, end - self->p);
+	config_tokenizer_skip (self, end - self->p + 1);
+	return true;
 }
 
 static bool
@@ -5167,11 +5845,18 @@ config_tokenizer_next (struct config_tokenizer *self, struct error **e)
 	case '}':   config_tokenizer_advance (self);  return CONFIG_T_RBRACE;
 
 	case '#':
+	{
 		// Comments go until newline
-		while (self->len)
-			if (config_tokenizer_advance (self) == '\n')
-				return CONFIG_T_NEWLINE;
-		return CONFIG_T_ABORT;
+		const char *end = memchr (self->p, '\n', self->len);
+		if (!end)
+		{
+			config_tokenizer_skip (self, self->len);
+			return CONFIG_T_ABORT;
+		}
+
+		config_tokenizer_skip (self, end - self->p + 1);
+		return CONFIG_T_NEWLINE;
+	}
 
 	case '"':
 	case '`':
@@ -5187,39 +5872,45 @@ config_tokenizer_next (struct config_tokenizer *self, struct error **e)
 	}
 
 	// Our input doesn't need to be NUL-terminated but we want to use strtoll()
-	char buf[48] = "", *end = buf;
-	size_t buf_len = MIN (sizeof buf - 1, self->len);
-
-	errno = 0;
-	self->integer = strtoll (strncpy (buf, self->p, buf_len), &end, 10);
-	if (errno == ERANGE)
+	char c = *self->p;
+	if (isdigit_ascii (c) || c == '-' || c == '+')
 	{
-		config_tokenizer_error (self, e, "integer out of range");
-		return CONFIG_T_ABORT;
-	}
-	if (end != buf)
-	{
-		self->len -= end - buf;
-		self->p += end - buf;
-		return CONFIG_T_INTEGER;
+		char buf[48] = "", *end = buf;
+		size_t buf_len = MIN (sizeof buf - 1, self->len);
+
+		errno = 0;
+		self->integer = strtoll (strncpy (buf, self->p, buf_len), &end, 10);
+		if (errno == ERANGE)
+		{
+			config_tokenizer_error (self, e, "integer out of range");
+			return CONFIG_T_ABORT;
+		}
+		if (end != buf)
+		{
+			config_tokenizer_skip (self, end - buf);
+			return CONFIG_T_INTEGER;
+		}
 	}
 
-	if (!config_tokenizer_is_word_char (*self->p))
+	if (!config_tokenizer_is_word_char (c))
 	{
 		config_tokenizer_error (self, e, "invalid input");
 		return CONFIG_T_ABORT;
 	}
 
+	size_t run = 1;
+	while (run < self->len && config_tokenizer_is_word_char (self->p[run]))
+		run++;
+
 	str_reset (&self->string);
-	do
-		str_append_c (&self->string, config_tokenizer_advance (self));
-	while (self->len && config_tokenizer_is_word_char (*self->p));
+	str_append_data (&self->string, self->p, run);
+	config_tokenizer_skip (self, run);
 
+	int boolean;
 	if (!strcmp (self->string.str, "null"))
 		return CONFIG_T_NULL;
-
-	bool boolean;
-	if (!set_boolean_if_valid (&boolean, self->string.str))
+	if ((boolean = boolean_word_lookup
+		(self->string.str, self->string.len)) == -1)
 		return CONFIG_T_WORD;
 
 	self->integer = boolean;
@@ -5231,6 +5922,7 @@ config_tokenizer_next (struct config_tokenizer *self, struct error **e)
 struct config_parser
 {
 	struct config_tokenizer tokenizer;  ///< Tokenizer
+	struct str key;                     ///< Key being parsed
 
 	struct error *error;                ///< Tokenizer error
 	enum config_token token;            ///< Current token in the tokenizer
@@ -5245,6 +5937,7 @@ config_parser_make (const char *script, size_t len)
 	return (struct config_parser)
 	{
 		.tokenizer = config_tokenizer_make (script, len),
+		.key = str_make (),
 		.replace_token = true,
 	};
 }
@@ -5253,6 +5946,7 @@ static void
 config_parser_free (struct config_parser *self)
 {
 	config_tokenizer_free (&self->tokenizer);
+	str_free (&self->key);
 	if (self->error)
 		error_free (self->error);
 }
@@ -5296,34 +5990,24 @@ config_parser_expect
 // We don't need no generator, but a few macros will come in handy.
 // From time to time C just doesn't have the right features.
 
-#define PEEK()         config_parser_peek   (self, err)
-#define ACCEPT(token)  config_parser_accept (self, token, err)
-#define EXPECT(token)  config_parser_expect (self, token, err)
+#define PEEK()         config_parser_peek   (self, out)
+#define ACCEPT(token)  config_parser_accept (self, token, out)
+#define EXPECT(token)  config_parser_expect (self, token, out)
 #define SKIP_NL()      do {} while (ACCEPT (CONFIG_T_NEWLINE))
 
-static struct config_item *config_parser_parse_object
-	(struct config_parser *self, jmp_buf out);
+// Values are attached to their parent as soon as they're created,
+// so that on error, everything can be freed along with the root object
+// from a single place, and we don't need to set up jumps on every level.
+
+static void config_parser_parse_object
+	(struct config_parser *self, struct config_item *object, jmp_buf out);
 
+/// Objects are returned empty, to be finished after they've been attached
 static struct config_item *
 config_parser_parse_value (struct config_parser *self, jmp_buf out)
 {
-	struct config_item *volatile result = NULL;
-	jmp_buf err;
-
-	if (setjmp (err))
-	{
-		if (result)
-			config_item_destroy (result);
-		longjmp (out, 1);
-	}
-
 	if (ACCEPT (CONFIG_T_LBRACE))
-	{
-		result = config_parser_parse_object (self, out);
-		SKIP_NL ();
-		EXPECT (CONFIG_T_RBRACE);
-		return result;
-	}
+		return config_item_object ();
 	if (ACCEPT (CONFIG_T_NULL))
 		return config_item_null ();
 	if (ACCEPT (CONFIG_T_BOOLEAN))
@@ -5339,20 +6023,21 @@ config_parser_parse_value (struct config_parser *self, jmp_buf out)
 	longjmp (out, 1);
 }
 
+/// Parse the rest of an object value, after its left brace
+static void
+config_parser_finish_object (struct config_parser *self,
+	struct config_item *object, jmp_buf out)
+{
+	config_parser_parse_object (self, object, out);
+	SKIP_NL ();
+	EXPECT (CONFIG_T_RBRACE);
+}
+
 /// Parse a single "key = value" assignment into @a object
 static bool
 config_parser_parse_kv_pair (struct config_parser *self,
 	struct config_item *object, jmp_buf out)
 {
-	char *volatile key = NULL;
-	jmp_buf err;
-
-	if (setjmp (err))
-	{
-		free (key);
-		longjmp (out, 1);
-	}
-
 	SKIP_NL ();
 
 	// Either this object's closing right brace if called recursively,
@@ -5365,17 +6050,17 @@ config_parser_parse_kv_pair (struct config_parser *self,
 	if (!ACCEPT (CONFIG_T_STRING))
 		EXPECT (CONFIG_T_WORD);
 
-	key = xstrdup (self->tokenizer.string.str);
+	str_reset (&self->key);
+	str_append_str (&self->key, &self->tokenizer.string);
 	SKIP_NL ();
 
 	EXPECT (CONFIG_T_EQUALS);
 	SKIP_NL ();
 
-	str_map_set (&object->value.object, key,
-		config_parser_parse_value (self, err));
-
-	free (key);
-	key = NULL;
+	struct config_item *value = config_parser_parse_value (self, out);
+	str_map_set (&object->value.object, self->key.str, value);
+	if (value->type == CONFIG_ITEM_OBJECT)
+		config_parser_finish_object (self, value, out);
 
 	if (PEEK () == CONFIG_T_RBRACE
 	 || PEEK () == CONFIG_T_ABORT)
@@ -5386,21 +6071,12 @@ config_parser_parse_kv_pair (struct config_parser *self,
 }
 
 /// Parse the inside of an object definition
-static struct config_item *
-config_parser_parse_object (struct config_parser *self, jmp_buf out)
+static void
+config_parser_parse_object (struct config_parser *self,
+	struct config_item *object, jmp_buf out)
 {
-	struct config_item *volatile object = config_item_object ();
-	jmp_buf err;
-
-	if (setjmp (err))
-	{
-		config_item_destroy (object);
-		longjmp (out, 1);
-	}
-
-	while (config_parser_parse_kv_pair (self, object, err))
+	while (config_parser_parse_kv_pair (self, object, out))
 		;
-	return object;
 }
 
 #undef PEEK
@@ -5441,25 +6117,49 @@ config_item_parse (const char *script, size_t len,
 		// and telling the line number would look awkward
 		parser.tokenizer.report_line = false;
 		object = config_parser_parse_value (self, err);
+		if (object->type == CONFIG_ITEM_OBJECT)
+			config_parser_finish_object (self, object, err);
 	}
 	else
-		object = config_parser_parse_object (self, err);
+	{
+		object = config_item_object ();
+		config_parser_parse_object (self, object, err);
+	}
 	config_parser_expect (self, CONFIG_T_ABORT, err);
 end:
 	config_parser_free (self);
 	return object;
 }
 
-/// Clone an item.  Schema assignments aren't retained.
+/// Clone an item, including all nested items, which can then be modified
+/// freely.  Its schema assignment isn't retained.
 static struct config_item *
 config_item_clone (struct config_item *self)
 {
-	// Oh well, it saves code
-	struct str tmp = str_make ();
-	config_item_write (self, false, &tmp);
-	struct config_item *result =
-		config_item_parse (tmp.str, tmp.len, true, NULL);
-	str_free (&tmp);
+	struct config_item *result = config_item_new (self->type);
+	if (self->type != CONFIG_ITEM_OBJECT)
+	{
+		config_item_copy_value (result, self);
+		return result;
+	}
+
+	result->value.object = str_map_make ((str_map_free_fn) config_item_destroy);
+	struct str_map_iter iter = str_map_iter_make (&self->value.object);
+	struct config_item *child;
+	while ((child = str_map_iter_next (&iter)))
+		str_map_set (&result->value.object, iter.link->key,
+			config_item_clone (child));
+	return result;
+}
+
+/// Like config_item_clone(), but nested items are shared with the original,
+/// which makes the copy cheap.  See config_item_get_private() for changing
+/// them.  Its schema assignment isn't retained either.
+static struct config_item *
+config_item_copy (struct config_item *self)
+{
+	struct config_item *result = config_item_new (self->type);
+	config_item_copy_value (result, self);
 	return result;
 }
 
@@ -5485,6 +6185,463 @@ end:
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+// Parsed configuration can be stored in a simple binary format, which is
+// a lot faster to read back in, or to pass on to another process.
+// It only consists of sizes and data, and is portable between machines.
+
+static void
+config_item_pack_data (struct str *output, const char *data, size_t len)
+{
+	str_pack_u32 (output, len);
+	str_append_data (output, data, len);
+}
+
+/// Serialize an item into a binary format.  Schemas aren't retained.
+static void
+config_item_pack (const struct config_item *self, struct str *output)
+{
+	str_pack_u8 (output, self->type);
+	switch (self->type)
+	{
+	case CONFIG_ITEM_BOOLEAN:
+		str_pack_u8 (output, self->value.boolean);
+		break;
+	case CONFIG_ITEM_INTEGER:
+		str_pack_u64 (output, self->value.integer);
+		break;
+	case CONFIG_ITEM_STRING:
+	case CONFIG_ITEM_STRING_ARRAY:
+		config_item_pack_data (output,
+			self->value.string.str, self->value.string.len);
+		break;
+	case CONFIG_ITEM_OBJECT:
+	{
+		str_pack_u32 (output, self->value.object.len);
+		struct str_map_iter iter = str_map_iter_make (&self->value.object);
+		const struct config_item *child;
+		while ((child = str_map_iter_next (&iter)))
+		{
+			const char *key = iter.link->key;
+			config_item_pack_data (output, key, strlen (key));
+			config_item_pack (child, output);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+static bool
+config_item_unpack_data (struct msg_unpacker *unpacker, struct str *output)
+{
+	uint32_t len = 0;
+	if (!msg_unpacker_u32 (unpacker, &len)
+	 || msg_unpacker_get_available (unpacker) < len
+	 || !utf8_validate (unpacker->data + unpacker->offset, len))
+		return false;
+
+	str_append_data (output, unpacker->data + unpacker->offset, len);
+	unpacker->offset += len;
+	return true;
+}
+
+/// Objects nested any deeper are considered malformed, to bound recursion
+#define CONFIG_ITEM_UNPACK_MAX_DEPTH  256
+
+static struct config_item *config_item_unpack_nested
+	(struct msg_unpacker *unpacker, unsigned depth);
+
+static bool
+config_item_unpack_object (struct msg_unpacker *unpacker,
+	struct config_item *object, unsigned depth)
+{
+	uint32_t len = 0;
+	bool ok = msg_unpacker_u32 (unpacker, &len);
+
+	struct str key = str_make ();
+	for (uint32_t i = 0; ok && i < len; i++)
+	{
+		str_reset (&key);
+		struct config_item *child = NULL;
+		if ((ok = config_item_unpack_data (unpacker, &key)
+			&& strlen (key.str) == key.len
+			&& (child = config_item_unpack_nested (unpacker, depth))))
+			str_map_set (&object->value.object, key.str, child);
+	}
+	str_free (&key);
+	return ok;
+}
+
+static struct config_item *
+config_item_unpack_nested (struct msg_unpacker *unpacker, unsigned depth)
+{
+	uint8_t type = 0, boolean = 0;
+	uint64_t integer = 0;
+	if (!msg_unpacker_u8 (unpacker, &type))
+		return NULL;
+
+	struct config_item *self = NULL;
+	switch (type)
+	{
+	case CONFIG_ITEM_NULL:
+		return config_item_null ();
+	case CONFIG_ITEM_BOOLEAN:
+		if (!msg_unpacker_u8 (unpacker, &boolean) || boolean > 1)
+			return NULL;
+		return config_item_boolean (boolean);
+	case CONFIG_ITEM_INTEGER:
+		if (!msg_unpacker_u64 (unpacker, &integer))
+			return NULL;
+		return config_item_integer ((int64_t) integer);
+	case CONFIG_ITEM_STRING:
+	case CONFIG_ITEM_STRING_ARRAY:
+		self = config_item_string (NULL);
+		self->type = type;
+		if (config_item_unpack_data (unpacker, &self->value.string))
+			return self;
+		break;
+	case CONFIG_ITEM_OBJECT:
+		if (depth >= CONFIG_ITEM_UNPACK_MAX_DEPTH)
+			return NULL;
+
+		self = config_item_object ();
+		if (config_item_unpack_object (unpacker, self, depth + 1))
+			return self;
+		break;
+	default:
+		return NULL;
+	}
+
+	config_item_destroy (self);
+	return NULL;
+}
+
+/// Deserialize an item from the binary format, or return NULL if malformed
+static struct config_item *
+config_item_unpack (struct msg_unpacker *unpacker)
+{
+	return config_item_unpack_nested (unpacker, 0);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+#define CONFIG_SNAPSHOT_MAGIC    "LCFG"
+#define CONFIG_SNAPSHOT_VERSION  1
+
+/// Identifies the source text of a snapshot; this needs to be stable,
+/// so the randomized siphash_wrapper() cannot be used
+static uint64_t
+config_snapshot_hash (const struct str *source)
+{
+	static const unsigned char key[16] = "liberty config\n";
+	return siphash (key, (const unsigned char *) source->str, source->len);
+}
+
+static void
+config_snapshot_pack (const struct str *source, const struct config_item *root,
+	struct str *output)
+{
+	str_append (output, CONFIG_SNAPSHOT_MAGIC);
+	str_pack_u32 (output, CONFIG_SNAPSHOT_VERSION);
+	str_pack_u64 (output, source->len);
+	str_pack_u64 (output, config_snapshot_hash (source));
+	config_item_pack (root, output);
+}
+
+/// Returns NULL unless the snapshot is valid and matches the source text
+static struct config_item *
+config_snapshot_unpack (const struct str *source, const struct str *snapshot)
+{
+	size_t magic_len = sizeof CONFIG_SNAPSHOT_MAGIC - 1;
+	if (snapshot->len < magic_len
+	 || memcmp (snapshot->str, CONFIG_SNAPSHOT_MAGIC, magic_len))
+		return NULL;
+
+	struct msg_unpacker unpacker = msg_unpacker_make
+		(snapshot->str + magic_len, snapshot->len - magic_len);
+	uint32_t version = 0;
+	uint64_t len = 0, hash = 0;
+	if (!msg_unpacker_u32 (&unpacker, &version)
+	 || version != CONFIG_SNAPSHOT_VERSION
+	 || !msg_unpacker_u64 (&unpacker, &len) || len != source->len
+	 || !msg_unpacker_u64 (&unpacker, &hash)
+	 || hash != config_snapshot_hash (source))
+		return NULL;
+
+	struct config_item *root = config_item_unpack (&unpacker);
+	if (root && (root->type != CONFIG_ITEM_OBJECT
+		|| msg_unpacker_get_available (&unpacker)))
+	{
+		config_item_destroy (root);
+		return NULL;
+	}
+	return root;
+}
+
+/// Like config_read_from_file(), but use a binary snapshot of the parsed
+/// configuration when it is up to date, or try to refresh it otherwise
+static struct config_item *
+config_read_from_file_cached (const char *filename, const char *snapshot_path,
+	struct error **e)
+{
+	struct config_item *root = NULL;
+	struct str data = str_make ();
+	struct str snapshot = str_make ();
+	if (!read_file (filename, &data, e))
+		goto end;
+
+	// The snapshot is just an optimization, so any errors are ignored
+	if (read_file (snapshot_path, &snapshot, NULL)
+	 && (root = config_snapshot_unpack (&data, &snapshot)))
+		goto end;
+
+	struct error *error = NULL;
+	if (!(root = config_item_parse (data.str, data.len, false, &error)))
+	{
+		error_set (e, "parse error in `%s': %s", filename, error->message);
+		error_free (error);
+		goto end;
+	}
+
+	str_reset (&snapshot);
+	config_snapshot_pack (&data, root, &snapshot);
+	if (!write_file_safe (snapshot_path, snapshot.str, snapshot.len, &error))
+	{
+		print_debug ("%s", error->message);
+		error_free (error);
+	}
+end:
+	str_free (&data);
+	str_free (&snapshot);
+	return root;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// Parsed schema defaults, keyed by their text
+static struct str_map g_config_defaults;
+/// Protects g_config_defaults, configurations may be loaded from any thread
+static pthread_mutex_t g_config_defaults_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Return a new item with the parsed default value of a schema.
+/// Each distinct default is only parsed once, the result is cloned.
+static struct config_item *
+config_schema_get_default (const struct config_schema *schema,
+	struct error **e)
+{
+	if (!schema->default_)
+		return config_item_null ();
+
+	hard_assert (!pthread_mutex_lock (&g_config_defaults_lock));
+	if (!g_config_defaults.map)
+		g_config_defaults =
+			str_map_make ((str_map_free_fn) config_item_destroy);
+
+	struct config_item *item =
+		str_map_find (&g_config_defaults, schema->default_);
+	if (!item && (item = config_item_parse (schema->default_,
+		strlen (schema->default_), true, e)))
+		str_map_set (&g_config_defaults, schema->default_, item);
+	if (item)
+		item = config_item_clone (item);
+	hard_assert (!pthread_mutex_unlock (&g_config_defaults_lock));
+	return item;
+}
+
+/// Release parsed schema defaults, e.g., before the program exits
+static void
+config_schema_free_defaults (void)
+{
+	hard_assert (!pthread_mutex_lock (&g_config_defaults_lock));
+	if (g_config_defaults.map)
+		str_map_free (&g_config_defaults);
+	hard_assert (!pthread_mutex_unlock (&g_config_defaults_lock));
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// Compare values, disregarding schemas and the subtype of strings
+static bool
+config_item_equal (const struct config_item *a, const struct config_item *b)
+{
+	if (a == b)
+		return true;
+	if (config_item_type_is_string (a->type)
+	 && config_item_type_is_string (b->type))
+		return a->value.string.len == b->value.string.len
+			&& !memcmp (a->value.string.str, b->value.string.str,
+				a->value.string.len);
+	if (a->type != b->type)
+		return false;
+
+	switch (a->type)
+	{
+	case CONFIG_ITEM_NULL:     return true;
+	case CONFIG_ITEM_BOOLEAN:  return a->value.boolean == b->value.boolean;
+	case CONFIG_ITEM_INTEGER:  return a->value.integer == b->value.integer;
+	case CONFIG_ITEM_OBJECT:   break;
+	default:
+		hard_assert (!"invalid config item type value");
+	}
+
+	if (a->value.object.len != b->value.object.len)
+		return false;
+
+	struct str_map_iter iter = str_map_iter_make (&a->value.object);
+	struct config_item *child, *other;
+	while ((child = str_map_iter_next (&iter)))
+		if (!(other = str_map_find (&b->value.object, iter.link->key))
+		 || !config_item_equal (child, other))
+			return false;
+	return true;
+}
+
+enum config_diff_type
+{
+	CONFIG_DIFF_ADDED,                  ///< Only present in the new tree
+	CONFIG_DIFF_REMOVED,                ///< Only present in the old tree
+	CONFIG_DIFF_CHANGED                 ///< Present in both, not equal
+};
+
+/// Either of the items is NULL when the path is missing from that tree
+typedef void (*config_diff_fn) (enum config_diff_type type, const char *path,
+	struct config_item *old, struct config_item *new, void *user_data);
+
+static void
+config_item_diff_object (struct config_item *old, struct config_item *new,
+	struct str *path, config_diff_fn callback, void *user_data)
+{
+	size_t path_len = path->len;
+	struct str_map_iter iter = str_map_iter_make (&old->value.object);
+	struct config_item *o, *n;
+	while ((o = str_map_iter_next (&iter)))
+	{
+		if (path_len)
+			str_append_c (path, '.');
+		str_append (path, iter.link->key);
+
+		if (!(n = str_map_find (&new->value.object, iter.link->key)))
+			callback (CONFIG_DIFF_REMOVED, path->str, o, NULL, user_data);
+		else if (o->type == CONFIG_ITEM_OBJECT
+			&& n->type == CONFIG_ITEM_OBJECT)
+			config_item_diff_object (o, n, path, callback, user_data);
+		else if (!config_item_equal (o, n))
+			callback (CONFIG_DIFF_CHANGED, path->str, o, n, user_data);
+
+		str_remove_slice (path, path_len, path->len - path_len);
+	}
+
+	iter = str_map_iter_make (&new->value.object);
+	while ((n = str_map_iter_next (&iter)))
+	{
+		if (str_map_find (&old->value.object, iter.link->key))
+			continue;
+
+		if (path_len)
+			str_append_c (path, '.');
+		str_append (path, iter.link->key);
+		callback (CONFIG_DIFF_ADDED, path->str, NULL, n, user_data);
+		str_remove_slice (path, path_len, path->len - path_len);
+	}
+}
+
+/// Report dot-separated paths of all leaf items that differ between two
+/// objects.  Whole subtrees are reported when they're added or removed.
+static void
+config_item_diff (struct config_item *old, struct config_item *new,
+	config_diff_fn callback, void *user_data)
+{
+	hard_assert (old->type == CONFIG_ITEM_OBJECT);
+	hard_assert (new->type == CONFIG_ITEM_OBJECT);
+
+	struct str path = str_make ();
+	config_item_diff_object (old, new, &path, callback, user_data);
+	str_free (&path);
+}
+
+static void config_item_reload_object
+	(struct config_item *old, struct config_item *new);
+
+/// Pass a new value through the schema of the old item, if it has any
+static void
+config_item_reload_value (struct config_item *old, struct config_item *new,
+	const char *key)
+{
+	struct error *e = NULL;
+	if (!config_item_set_from (old, new, &e))
+	{
+		print_warning ("not reloading configuration item `%s': %s",
+			key, e->message);
+		error_free (e);
+		config_item_destroy (new);
+	}
+}
+
+static void
+config_item_reload_removed (struct config_item *parent, const char *key)
+{
+	struct config_item *old = config_item_unshare (parent, key);
+	if (old->type == CONFIG_ITEM_OBJECT)
+	{
+		struct config_item *empty = config_item_object ();
+		config_item_reload_object (old, empty);
+		config_item_destroy (empty);
+		if (old->value.object.len)
+			return;
+	}
+	if (!old->schema)
+	{
+		str_map_set (&parent->value.object, key, NULL);
+		return;
+	}
+
+	// Items with schemas have to stay, and they have valid defaults
+	config_item_reload_value
+		(old, config_schema_get_default (old->schema, NULL), key);
+}
+
+/// Bring an object up to date with another one, which gets emptied.
+/// Unchanged items are retained, and only changed ones are notified about.
+static void
+config_item_reload_object (struct config_item *old, struct config_item *new)
+{
+	// The maps cannot be modified while they are being iterated over
+	struct strv keys = strv_make ();
+	struct str_map_iter iter = str_map_iter_make (&old->value.object);
+	struct config_item *o, *n;
+	while ((o = str_map_iter_next (&iter)))
+	{
+		if (!(n = str_map_find (&new->value.object, iter.link->key)))
+			strv_append (&keys, iter.link->key);
+		else if (config_item_equal (o, n))
+			continue;
+		else if (o->type == CONFIG_ITEM_OBJECT
+			&& n->type == CONFIG_ITEM_OBJECT)
+			config_item_reload_object (config_item_unshare (old,
+				iter.link->key), config_item_unshare (new, iter.link->key));
+		else
+			strv_append (&keys, iter.link->key);
+	}
+
+	iter = str_map_iter_make (&new->value.object);
+	while ((n = str_map_iter_next (&iter)))
+		if (!str_map_find (&old->value.object, iter.link->key))
+			strv_append (&keys, iter.link->key);
+
+	for (size_t i = 0; i < keys.len; i++)
+	{
+		const char *key = keys.vector[i];
+		if (!(n = str_map_steal (&new->value.object, key)))
+			config_item_reload_removed (old, key);
+		else if (!(o = config_item_unshare (old, key)))
+			str_map_set (&old->value.object, key, n);
+		else
+			config_item_reload_value (o, n, key);
+	}
+	strv_free (&keys);
+}
+
 /// "user_data" is passed to allow its immediate use in validation callbacks
 static struct config_item *
 config_schema_initialize_item (const struct config_schema *schema,
@@ -5492,8 +6649,7 @@ config_schema_initialize_item (const struct config_schema *schema,
 	struct error **e)
 {
 	hard_assert (parent->type == CONFIG_ITEM_OBJECT);
-	struct config_item *item =
-		str_map_find (&parent->value.object, schema->name);
+	struct config_item *item = config_item_unshare (parent, schema->name);
 
 	if (item)
 	{
@@ -5508,14 +6664,11 @@ config_schema_initialize_item (const struct config_schema *schema,
 	}
 
 	struct error *error = NULL;
-	if (schema->default_)
-		item = config_item_parse
-			(schema->default_, strlen (schema->default_), true, &error);
-	else
-		item = config_item_null ();
-
-	if (item)
+	if ((item = config_schema_get_default (schema, &error)))
+	{
+		item = config_item_make_private (item);
 		item->user_data = user_data;
+	}
 
 	if (error || !config_item_validate_by_schema (item, schema, &error))
 	{
@@ -5602,6 +6755,7 @@ struct config
 {
 	struct str_map modules;             ///< Toplevel modules
 	struct config_item *root;           ///< CONFIG_ITEM_OBJECT
+	unsigned generation;                ///< Invalidates config_path handles
 };
 
 static struct config
@@ -5637,7 +6791,11 @@ config_load (struct config *self, struct config_item *root)
 	hard_assert (root->type == CONFIG_ITEM_OBJECT);
 	if (self->root)
 		config_item_destroy (self->root);
-	self->root = root;
+
+	// Loaders are free to modify anything they find in their subtrees
+	self->root = root = config_item_make_private (root);
+	config_item_unshare_all (root);
+	self->generation++;
 
 	struct str_map_iter iter = str_map_iter_make (&self->modules);
 	struct config_module *module;
@@ -5652,6 +6810,130 @@ config_load (struct config *self, struct config_item *root)
 		if (module->loader)
 			module->loader (subtree, module->user_data);
 	}
+
+	// Loaders may have replaced items that have been looked up meanwhile
+	self->generation++;
+}
+
+/// Call this when replacing items in the tree other than through config_load()
+static void
+config_invalidate (struct config *self)
+{
+	self->generation++;
+}
+
+/// Return a reference to the current tree, which is not going to change,
+/// and which can be read from another thread.  Release it with
+/// config_item_destroy().  Items are copied on write, and only the first
+/// snapshot after a change needs to walk the items that have been replaced.
+///
+/// The tree gets frozen, so items within it can no longer be modified
+/// in place, even through pointers obtained before.  From now on, use
+/// config_get_private() to find items that are to be changed.
+static struct config_item *
+config_snapshot (struct config *self)
+{
+	config_item_freeze (self->root);
+	return config_item_ref (self->root);
+}
+
+/// Find an item that may be modified, even while snapshots exist.
+/// Only the path leading to it gets copied, so items nested within
+/// the result need to be looked up through this function as well.
+static struct config_item *
+config_get_private (struct config *self, const char *path, struct error **e)
+{
+	struct config_item *item = config_item_get (self->root, path, e);
+	if (!item)
+		return NULL;
+
+	// Copying any item on the path would also copy the item itself
+	struct config_item *private =
+		config_item_get_private (&self->root, path, NULL);
+	if (private != item)
+		config_invalidate (self);
+	return private;
+}
+
+/// Apply a new configuration tree to the current one, taking ownership of it.
+/// Unlike config_load(), module loaders aren't run again, and schema owners
+/// are only notified about items that have actually changed.
+static void
+config_reload (struct config *self, struct config_item *root)
+{
+	hard_assert (root->type == CONFIG_ITEM_OBJECT);
+	if (!self->root)
+	{
+		config_load (self, root);
+		return;
+	}
+
+	// Either tree may share items with snapshots.  Items of the new tree end
+	// up in the current one, where they must remain modifiable.
+	self->root = config_item_make_private (self->root);
+	root = config_item_make_private (root);
+	config_item_unshare_all (root);
+
+	// Fixed the same way as in config_load(), so that subtrees stay intact
+	struct str_map_iter iter = str_map_iter_make (&self->modules);
+	struct config_module *module;
+	while ((module = str_map_iter_next (&iter)))
+	{
+		struct config_item *subtree = str_map_find
+			(&root->value.object, module->name);
+		if (!subtree || subtree->type != CONFIG_ITEM_OBJECT)
+			str_map_set (&root->value.object, module->name,
+				config_item_object ());
+	}
+
+	config_item_reload_object (self->root, root);
+	config_item_destroy (root);
+
+	// Items without schemas might have been added or removed
+	config_invalidate (self);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// A path to an item that only needs to be resolved once per configuration
+/// load, so that frequently accessed items can be retrieved cheaply
+struct config_path
+{
+	struct config *config;              ///< Configuration
+	char *path;                         ///< Dot-separated path to the item
+	unsigned generation;                ///< Configuration generation
+	struct config_item *item;           ///< Resolved item or NULL
+};
+
+static struct config_path
+config_path_make (struct config *config, const char *path)
+{
+	return (struct config_path)
+	{
+		.config = config,
+		.path = xstrdup (path),
+		.generation = config->generation - 1,
+	};
+}
+
+static void
+config_path_free (struct config_path *self)
+{
+	free (self->path);
+}
+
+/// Returns NULL when the item doesn't exist
+static struct config_item *
+config_path_get (struct config_path *self)
+{
+	struct config *config = self->config;
+	if (self->generation == config->generation)
+		return self->item;
+
+	self->generation = config->generation;
+	return self->item = config->root
+		? config_item_get (config->root, self->path, NULL)
+		: NULL;
 }
 
 // --- Protocol modules --------------------------------------------------------
@@ -0,0 +1,600 @@
+/*
+ * tests/bench.c
+ *
+ * Copyright (c) 2026, Přemysl Eric Janouch <p@janouch.name>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define PROGRAM_NAME "bench"
+#define PROGRAM_VERSION "0"
+
+// The MPD client is a full wrapper and needs the network
+#define LIBERTY_WANT_POLLER
+#define LIBERTY_WANT_ASYNC
+
+#define LIBERTY_WANT_PROTO_HTTP
+#define LIBERTY_WANT_PROTO_MPD
+
+#include "../liberty.c"
+#include "../liberty-xdg.c"
+
+#include <dirent.h>
+
+// --- Framework ---------------------------------------------------------------
+
+/// Run each measurement for at least this long, in nanoseconds
+#define BENCH_MIN_DURATION 500000000
+
+typedef void (*bench_iteration_fn) (void *user_data);
+
+static int64_t
+bench_now (void)
+{
+	struct timespec ts;
+	hard_assert (!clock_gettime (CLOCK_BEST, &ts));
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// Repeat the iteration for a while, and report how long each one took.
+/// If "bytes" is non-zero, throughput is reported as well.
+static void
+bench_run (const char *name, bench_iteration_fn fn, void *user_data,
+	size_t bytes)
+{
+	int64_t start = bench_now (), elapsed = 0;
+	size_t iterations = 0;
+	do
+	{
+		fn (user_data);
+		iterations++;
+	}
+	while ((elapsed = bench_now () - start) < BENCH_MIN_DURATION);
+
+	double ns = (double) elapsed / iterations;
+	printf ("%-40s %14.0f ns/op", name, ns);
+	if (bytes)
+		printf (" %10.1f MB/s", bytes / ns * 1e3);
+	putchar ('\n');
+}
+
+// --- HTTP --------------------------------------------------------------------
+
+static const char *g_bench_http_requests[] =
+{
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) "
+		"Gecko/20100101 Firefox/128.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+		"*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Connection: keep-alive\r\n"
+	"Cookie: session=0123456789abcdef; theme=dark\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"\r\n",
+
+	"POST /api/v1/items HTTP/1.1\r\n"
+	"Host: api.example.com\r\n"
+	"Content-Type: application/json\r\n"
+	"Content-Length: 27\r\n"
+	"\r\n"
+	"{\"name\":\"item\",\"count\":42}\n",
+
+	"PUT /upload HTTP/1.1\r\n"
+	"Host: api.example.com\r\n"
+	"Transfer-Encoding: chunked\r\n"
+	"\r\n"
+	"10\r\n0123456789abcdef\r\n"
+	"8;ext=1\r\n01234567\r\n"
+	"0\r\n"
+	"\r\n",
+};
+
+struct bench_http
+{
+	struct str input;                   ///< Pipelined requests
+	size_t segment;                     ///< Bytes per push, or zero for all
+	size_t messages;                    ///< Messages parsed in an iteration
+	size_t content;                     ///< Body bytes in an iteration
+};
+
+static bool
+bench_http_on_headers_read (void *user_data)
+{
+	(void) user_data;
+	return true;
+}
+
+static bool
+bench_http_on_content (void *user_data, const void *data, size_t len)
+{
+	(void) data;
+
+	struct bench_http *self = user_data;
+	if (len)
+		self->content += len;
+	else
+		self->messages++;
+	return true;
+}
+
+static void
+bench_http_iteration (void *user_data)
+{
+	struct bench_http *self = user_data;
+	struct http_parser parser = http_parser_make (HTTP_PARSER_REQUEST);
+	parser.on_headers_read = bench_http_on_headers_read;
+	parser.on_content = bench_http_on_content;
+	parser.user_data = self;
+
+	self->messages = self->content = 0;
+	size_t segment = self->segment ? self->segment : self->input.len;
+	for (size_t offset = 0; offset < self->input.len; offset += segment)
+		hard_assert (http_parser_push (&parser, self->input.str + offset,
+			MIN (segment, self->input.len - offset), NULL));
+	hard_assert (http_parser_push (&parser, NULL, 0, NULL));
+	http_parser_free (&parser);
+}
+
+static void
+bench_http_parser (void)
+{
+	struct bench_http self = { .input = str_make () };
+	for (size_t i = 0; i < 3000; i++)
+		str_append (&self.input,
+			g_bench_http_requests[i % N_ELEMENTS (g_bench_http_requests)]);
+
+	// Whole buffers measure the parser itself, segments add split heads
+	bench_run ("http_parser, all at once",
+		bench_http_iteration, &self, self.input.len);
+	hard_assert (self.messages == 3000);
+
+	self.segment = 1460;
+	bench_run ("http_parser, 1460-byte segments",
+		bench_http_iteration, &self, self.input.len);
+	hard_assert (self.messages == 3000);
+
+	self.segment = 16;
+	bench_run ("http_parser, 16-byte segments",
+		bench_http_iteration, &self, self.input.len);
+	hard_assert (self.messages == 3000);
+
+	str_free (&self.input);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static const char g_bench_http_upgrade[] =
+	"websocket/13, HTTP/2.0, h2c, IRC/6.9, RTA/x11, SHTTP/1.3, , ";
+static const char g_bench_http_media_type[] =
+	"Multipart/Form-Data; charset=\"utf\\-8\"; "
+	"boundary=----WebKitFormBoundary7MA4YWxkTrZu0gW; format=flowed";
+
+static void
+bench_http_upgrade_iteration (void *user_data)
+{
+	(void) user_data;
+
+	struct http_protocol *protocols = NULL;
+	hard_assert (http_parse_upgrade (g_bench_http_upgrade, &protocols));
+	LIST_FOR_EACH (struct http_protocol, iter, protocols)
+		http_protocol_destroy (iter);
+}
+
+static void
+bench_http_media_type_iteration (void *user_data)
+{
+	struct str_map *parameters = user_data;
+	char *type = NULL, *subtype = NULL;
+	hard_assert (http_parse_media_type
+		(g_bench_http_media_type, &type, &subtype, parameters));
+	free (type);
+	free (subtype);
+	str_map_clear (parameters);
+}
+
+static void
+bench_http_headers (void)
+{
+	bench_run ("http_parse_upgrade", bench_http_upgrade_iteration,
+		NULL, sizeof g_bench_http_upgrade - 1);
+
+	struct str_map parameters = str_map_make (free);
+	parameters.key_xfrm = tolower_ascii_strxfrm;
+	bench_run ("http_parse_media_type", bench_http_media_type_iteration,
+		&parameters, sizeof g_bench_http_media_type - 1);
+	str_map_free (&parameters);
+}
+
+// --- Configuration -----------------------------------------------------------
+
+/// Lookups to make within a single iteration, individual ones are too short
+#define BENCH_CONFIG_LOOKUPS 1000
+
+static const char g_bench_config[] =
+	"behaviour = {\n"
+	"  date_change_line = \"%a %e %B %Y\"\n"
+	"  read_line_buffer_size = 4096\n"
+	"  attributes = {\n"
+	"    highlight = \"bold\"\n"
+	"    timestamp = \"dim\"\n"
+	"  }\n"
+	"}\n"
+	"servers = {\n"
+	"  libera = {\n"
+	"    addresses = \"irc.libera.chat:6697\"\n"
+	"    tls = on\n"
+	"    autojoin = \"#irc,#chat\"\n"
+	"  }\n"
+	"}\n";
+
+static const char *g_bench_config_item = "behaviour.attributes.highlight";
+
+static void
+bench_config_get_iteration (void *user_data)
+{
+	struct config *config = user_data;
+	for (size_t i = 0; i < BENCH_CONFIG_LOOKUPS; i++)
+		hard_assert (config_item_get (config->root, g_bench_config_item, NULL));
+}
+
+static void
+bench_config_path_iteration (void *user_data)
+{
+	// Making the handle volatile keeps the compiler from merging lookups
+	struct config_path *volatile path = user_data;
+	for (size_t i = 0; i < BENCH_CONFIG_LOOKUPS; i++)
+		hard_assert (config_path_get (path));
+}
+
+static void
+bench_config_lookup (void)
+{
+	struct config config = config_make ();
+	config_load (&config, config_item_parse
+		(g_bench_config, sizeof g_bench_config - 1, false, NULL));
+
+	bench_run ("config_item_get, 1000 lookups",
+		bench_config_get_iteration, &config, 0);
+
+	struct config_path path = config_path_make (&config, g_bench_config_item);
+	bench_run ("config_path_get, 1000 lookups",
+		bench_config_path_iteration, &path, 0);
+	config_path_free (&path);
+
+	config_free (&config);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// Objects in the generated configuration, each about 200 bytes long
+#define BENCH_CONFIG_OBJECTS 25000
+
+static void
+bench_config_parse_iteration (void *user_data)
+{
+	const struct str *input = user_data;
+	struct error *e = NULL;
+	struct config_item *root =
+		config_item_parse (input->str, input->len, false, &e);
+	if (!root)
+		exit_fatal ("%s", e->message);
+	config_item_destroy (root);
+}
+
+static void
+bench_config_parse (void)
+{
+	struct str input = str_make ();
+	for (size_t i = 0; i < BENCH_CONFIG_OBJECTS; i++)
+		str_append_printf (&input,
+			"# Server number %zu\n"
+			"server_%zu = {\n"
+			"\taddresses = \"irc%zu.example.com:6697\"\n"
+			"\tnickname = `nick_%zu`\n"
+			"\trealname = \"Name \\\"%zu\\\"\\n\"\n"
+			"\tport = %zu\n"
+			"\ttls = %s\n"
+			"\tproxy = null\n"
+			"}\n", i, i, i, i, i, 1024 + i, i % 2 ? "on" : "off");
+
+	bench_run ("config_item_parse, with freeing",
+		bench_config_parse_iteration, &input, input.len);
+	str_free (&input);
+}
+
+// --- MPD ---------------------------------------------------------------------
+
+/// Songs in the synthetic "listallinfo" response
+#define BENCH_MPD_SONGS 50000
+
+/// How much input to process at once, as if read from a socket
+#define BENCH_MPD_READ_SIZE 65536
+
+enum bench_mpd_mode { BENCH_MPD_COLLECT, BENCH_MPD_KV, BENCH_MPD_RECORD };
+
+struct bench_mpd
+{
+	struct str dump;                    ///< The whole response
+	enum bench_mpd_mode mode;           ///< How to receive the response
+	size_t records;                     ///< Songs received
+	bool done;                          ///< The task has finished
+};
+
+static void
+bench_mpd_on_response (const struct mpd_response *response,
+	const struct strv *data, void *user_data)
+{
+	struct bench_mpd *self = user_data;
+	hard_assert (response->success);
+	for (size_t i = 0; i < data->len; i++)
+		if (!strncmp (data->vector[i], "file: ", 6))
+			self->records++;
+	self->done = true;
+}
+
+static void
+bench_mpd_on_kv (char *key, char *value, void *user_data)
+{
+	(void) value;
+
+	struct bench_mpd *self = user_data;
+	if (key && !strcasecmp_ascii (key, "file"))
+		self->records++;
+}
+
+static void
+bench_mpd_on_record (const struct strv *record, void *user_data)
+{
+	(void) record;
+
+	struct bench_mpd *self = user_data;
+	self->records++;
+}
+
+static void
+bench_mpd_iteration (void *user_data)
+{
+	struct bench_mpd *self = user_data;
+	struct poller poller;
+	poller_init (&poller);
+	struct mpd_client client = mpd_client_make (&poller);
+	client.got_hello = xstrdup ("0.23.0");
+
+	struct mpd_client_task *task =
+		mpd_client_add_task (&client, bench_mpd_on_response, self);
+	if (self->mode == BENCH_MPD_KV)
+		task->on_kv = bench_mpd_on_kv;
+	if (self->mode == BENCH_MPD_RECORD)
+		task->on_record = bench_mpd_on_record;
+
+	self->records = 0;
+	self->done = false;
+	for (size_t offset = 0; offset < self->dump.len; )
+	{
+		size_t len = MIN (BENCH_MPD_READ_SIZE, self->dump.len - offset);
+		str_append_data (&client.read_buffer, self->dump.str + offset, len);
+		hard_assert (mpd_client_process_input (&client));
+		offset += len;
+	}
+	hard_assert (self->done && self->records == BENCH_MPD_SONGS);
+
+	mpd_client_free (&client);
+	poller_free (&poller);
+}
+
+static void
+bench_mpd (void)
+{
+	struct bench_mpd self = { .dump = str_make () };
+	for (size_t i = 0; i < BENCH_MPD_SONGS; i++)
+	{
+		size_t album = i / 12, artist = album / 5;
+		str_append_printf (&self.dump,
+			"file: Artist %zu/Album %zu/%02zu - Track.flac\n"
+			"Last-Modified: 2024-01-01T00:00:00Z\n"
+			"Format: 44100:16:2\n"
+			"Artist: Artist %zu\n"
+			"Album: Album %zu\n"
+			"Title: Track %zu\n"
+			"Track: %zu\n"
+			"Date: 1999\n"
+			"Genre: Rock\n"
+			"Time: 245\n"
+			"duration: 244.573\n",
+			artist, album, i % 12 + 1, artist, album, i, i % 12 + 1);
+	}
+	str_append (&self.dump, "OK\n");
+
+	// Collecting everything for the completion callback is the baseline
+	bench_run ("mpd_client, collected response",
+		bench_mpd_iteration, &self, self.dump.len);
+	self.mode = BENCH_MPD_KV;
+	bench_run ("mpd_client, streamed lines",
+		bench_mpd_iteration, &self, self.dump.len);
+	self.mode = BENCH_MPD_RECORD;
+	bench_run ("mpd_client, streamed records",
+		bench_mpd_iteration, &self, self.dump.len);
+
+	str_free (&self.dump);
+}
+
+// --- Desktop files -----------------------------------------------------------
+
+/// Files in the synthetic applications directory
+#define BENCH_DESKTOP_FILES 5000
+
+static const char *g_bench_desktop_languages[] =
+	{ "cs", "de", "es", "fr", "it", "ja", "pl", "pt_BR", "ru", "zh_CN" };
+
+struct bench_desktop
+{
+	char *directory;                    ///< The applications directory
+	bool mapped;                        ///< Use desktop_file_open()
+	size_t listed;                      ///< Applications to be listed
+};
+
+static void
+bench_desktop_write (const char *directory, size_t i)
+{
+	struct str data = str_make ();
+	str_append_printf (&data,
+		"[Desktop Entry]\n"
+		"Type=Application\n"
+		"Version=1.5\n"
+		"Name=Application %zu\n", i);
+	for (size_t k = 0; k < N_ELEMENTS (g_bench_desktop_languages); k++)
+		str_append_printf (&data, "Name[%s]=Application %zu (%s)\n"
+			"Comment[%s]=Does things number %zu\n",
+			g_bench_desktop_languages[k], i, g_bench_desktop_languages[k],
+			g_bench_desktop_languages[k], i);
+	str_append_printf (&data,
+		"Comment=Does things number %zu\n"
+		"Exec=application-%zu %%U\n"
+		"Icon=application-%zu\n"
+		"Terminal=false\n"
+		"NoDisplay=%s\n"
+		"Categories=Utility;Development;\n"
+		"MimeType=text/plain;text/x-c;\n"
+		"Actions=new-window;\n"
+		"\n"
+		"[Desktop Action new-window]\n"
+		"Name=New Window\n"
+		"Exec=application-%zu --new-window\n",
+		i, i, i, i % 10 ? "false" : "true", i);
+
+	char *path = xstrdup_printf ("%s/application-%zu.desktop", directory, i);
+	struct error *e = NULL;
+	if (!write_file (path, data.str, data.len, &e))
+		exit_fatal ("%s", e->message);
+	free (path);
+	str_free (&data);
+}
+
+/// Look up what a launcher menu would need
+static void
+bench_desktop_list (struct bench_desktop *self, struct desktop_file *entry)
+{
+	const char *group = "Desktop Entry";
+	char *name = desktop_file_get_localestring
+		(entry, group, "Name", "de_DE.UTF-8");
+	char *exec = desktop_file_get_string (entry, group, "Exec");
+	char *icon = desktop_file_get_string (entry, group, "Icon");
+	if (name && exec && icon
+	 && !desktop_file_get_bool (entry, group, "NoDisplay")
+	 && !desktop_file_get_bool (entry, group, "Hidden"))
+		self->listed++;
+	free (name);
+	free (exec);
+	free (icon);
+}
+
+static void
+bench_desktop_iteration (void *user_data)
+{
+	struct bench_desktop *self = user_data;
+	DIR *dir = opendir (self->directory);
+	hard_assert (dir);
+
+	self->listed = 0;
+	struct dirent *entry;
+	struct str data = str_make ();
+	while ((entry = readdir (dir)))
+	{
+		if (*entry->d_name == '.')
+			continue;
+
+		struct desktop_file file = {};
+		char *path = xstrdup_printf ("%s/%s", self->directory, entry->d_name);
+		if (self->mapped)
+			hard_assert (desktop_file_open (path, &file, NULL));
+		else
+		{
+			str_reset (&data);
+			hard_assert (read_file (path, &data, NULL));
+			file = desktop_file_make (data.str, data.len);
+		}
+		free (path);
+
+		bench_desktop_list (self, &file);
+		desktop_file_free (&file);
+	}
+	str_free (&data);
+	closedir (dir);
+	hard_assert (self->listed == BENCH_DESKTOP_FILES / 10 * 9);
+}
+
+static void
+bench_desktop (void)
+{
+	const char *tmpdir = getenv ("TMPDIR");
+	struct bench_desktop self = { .directory = xstrdup_printf
+		("%s/bench-%ld", tmpdir ? tmpdir : "/tmp", (long) getpid ()) };
+	if (mkdir (self.directory, 0700))
+		exit_fatal ("%s: %s", self.directory, strerror (errno));
+	for (size_t i = 0; i < BENCH_DESKTOP_FILES; i++)
+		bench_desktop_write (self.directory, i);
+
+	bench_run ("desktop files, read and parsed",
+		bench_desktop_iteration, &self, 0);
+	self.mapped = true;
+	bench_run ("desktop files, desktop_file_open",
+		bench_desktop_iteration, &self, 0);
+
+	for (size_t i = 0; i < BENCH_DESKTOP_FILES; i++)
+	{
+		char *path = xstrdup_printf
+			("%s/application-%zu.desktop", self.directory, i);
+		(void) unlink (path);
+		free (path);
+	}
+	(void) rmdir (self.directory);
+	free (self.directory);
+}
+
+// --- Main --------------------------------------------------------------------
+
+int
+main (int argc, char *argv[])
+{
+	struct str_map benchmarks = str_map_make (NULL);
+#define REGISTER(name) str_map_set (&benchmarks, #name, bench_ ## name);
+	REGISTER (http_parser)
+	REGISTER (http_headers)
+	REGISTER (config_lookup)
+	REGISTER (config_parse)
+	REGISTER (mpd)
+	REGISTER (desktop)
+
+	// Without arguments, run everything, in no particular order
+	struct str_map_iter iter = str_map_iter_make (&benchmarks);
+	void (*benchmark) (void) = NULL;
+	if (argc < 2)
+		while ((benchmark = str_map_iter_next (&iter)))
+			benchmark ();
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!(benchmark = str_map_find (&benchmarks, argv[i])))
+		{
+			fprintf (stderr, "Unknown benchmark: %s\n", argv[i]);
+			exit (EXIT_FAILURE);
+		}
+		benchmark ();
+	}
+
+	str_map_free (&benchmarks);
+	return 0;
+}
@@ -104,6 +104,34 @@ test_http_parse_upgrade (const uint8_t *data, size_t size)
 	str_free (&wrap);
 }
 
+static bool
+test_http_parser_on_headers_read (void *user_data)
+{
+	(void) user_data;
+	return true;
+}
+
+static bool
+test_http_parser_on_content (void *user_data, const void *data, size_t len)
+{
+	(void) user_data;
+	(void) data;
+	(void) len;
+	return true;
+}
+
+static void
+test_http_parser_push (const uint8_t *data, size_t size)
+{
+	struct http_parser parser = http_parser_make (HTTP_PARSER_REQUEST);
+	parser.on_headers_read = test_http_parser_on_headers_read;
+	parser.on_content      = test_http_parser_on_content;
+
+	if (http_parser_push (&parser, data, size, NULL))
+		http_parser_push (&parser, NULL, 0, NULL);
+	http_parser_free (&parser);
+}
+
 // --- SCGI --------------------------------------------------------------------
 
 static bool
@@ -193,6 +221,16 @@ test_fcgi_nv_parser_push (const uint8_t *data, size_t size)
 	str_map_free (&values);
 }
 
+static void
+test_fcgi_nv_parse (const uint8_t *data, size_t size)
+{
+	struct str_map values = str_map_make (NULL);
+	char *storage = NULL;
+	(void) fcgi_nv_parse (data, size, &values, &storage);
+	str_map_free (&values);
+	free (storage);
+}
+
 // --- Config ------------------------------------------------------------------
 
 static void
@@ -204,6 +242,15 @@ test_config_item_parse (const uint8_t *data, size_t size)
 		config_item_destroy (item);
 }
 
+static void
+test_config_item_unpack (const uint8_t *data, size_t size)
+{
+	struct msg_unpacker unpacker = msg_unpacker_make (data, size);
+	struct config_item *item = config_item_unpack (&unpacker);
+	if (item)
+		config_item_destroy (item);
+}
+
 // --- MPD ---------------------------------------------------------------------
 
 static void
@@ -241,11 +288,14 @@ LLVMFuzzerInitialize (int *argcp, char ***argvp)
 	REGISTER (irc_parse_message)
 	REGISTER (http_parse_media_type)
 	REGISTER (http_parse_upgrade)
+	REGISTER (http_parser_push)
 	REGISTER (scgi_parser_push)
 	REGISTER (ws_parser_push)
 	REGISTER (fcgi_parser_push)
 	REGISTER (fcgi_nv_parser_push)
+	REGISTER (fcgi_nv_parse)
 	REGISTER (config_item_parse)
+	REGISTER (config_item_unpack)
 	REGISTER (mpd_client_process_input)
 
 	char **argv = *argvp, *option = "-test=", *name = NULL;
@@ -24,6 +24,8 @@
 
 #include "../liberty.c"
 
+#include <locale.h>
+
 // --- Memory ------------------------------------------------------------------
 
 #define KILO 1024
@@ -366,6 +368,102 @@ test_base64 (void)
 	str_free (&decoded);
 }
 
+// --- Regular expressions -----------------------------------------------------
+
+static void
+test_regex_cache (void)
+{
+	struct regex_cache cache = regex_cache_make ();
+	cache.limit = 2;
+
+	hard_assert (!regex_cache_match (&cache, "^a", 0, "A", NULL));
+	hard_assert (regex_cache_match (&cache, "^a", REG_ICASE, "A", NULL));
+	hard_assert (regex_cache_match (&cache, "^a", 0, "a", NULL));
+	hard_assert (cache.hits == 1 && cache.misses == 2);
+
+	// The least recently used entry should get evicted
+	hard_assert (regex_cache_match (&cache, "b", 0, "b", NULL));
+	hard_assert (regex_cache_match (&cache, "^a", 0, "a", NULL));
+	hard_assert (cache.hits == 2 && cache.misses == 3 && cache.map.len == 2);
+
+	struct error *e = NULL;
+	hard_assert (!regex_cache_match (&cache, "(", REG_EXTENDED, "", &e));
+	error_free (e);
+	regex_cache_free (&cache);
+}
+
+static void
+test_regex_set (void)
+{
+	static const struct { const char *regex; int flags; const char *literal; }
+	patterns[] =
+	{
+		{ "foo(bar)?baz",        REG_EXTENDED,             "foo"  },
+		{ "qux?quux",            REG_EXTENDED,             "quux" },
+		{ "x{2,3}yz",            REG_EXTENDED,             "yz"   },
+		{ "ab\\{2\\}cd",         0,                        "cd"   },
+		{ "[[:alpha:]]ab\\.c",   REG_EXTENDED,             "ab.c" },
+		{ "\\(ab\\)*cd",         0,                        NULL   },
+		{ "(a|b)cd",             REG_EXTENDED,             NULL   },
+		{ "žluť?oučký",          REG_EXTENDED,             "oučký" },
+		{ "ŽLUŤOUČKÝ KůŇ",       REG_EXTENDED | REG_ICASE, "lu"   },
+		{ "^Hello",              REG_EXTENDED | REG_ICASE, "hello" },
+	};
+	static const char *subjects[] =
+	{
+		"foobaz", "foobarbaz", "fobaz", "ququux", "xxyz", "xyz", "abbcd",
+		"acd", "Zab.c", "cd", "bcd", "žluoučký", "žlutoučký", "HELLO",
+		"žluťoučký kůň", "",
+	};
+
+	struct regex_set set = regex_set_make ();
+	for (size_t i = 0; i < N_ELEMENTS (patterns); i++)
+	{
+		hard_assert (regex_set_add
+			(&set, patterns[i].regex, patterns[i].flags, NULL));
+
+		const char *literal = set.entries[i].literal;
+		hard_assert (!literal == !patterns[i].literal);
+		hard_assert (!literal || !strcmp (literal, patterns[i].literal));
+	}
+
+	// The prefilter must never change the results
+	for (size_t i = 0; i < N_ELEMENTS (subjects); i++)
+	{
+		bool matched[N_ELEMENTS (patterns)];
+		size_t count = 0;
+		for (size_t k = 0; k < N_ELEMENTS (patterns); k++)
+		{
+			regex_t *re = set.entries[k].re;
+			count += (matched[k] = !regexec (re, subjects[i], 0, NULL, 0));
+		}
+
+		bool result[N_ELEMENTS (patterns)];
+		hard_assert (regex_set_match (&set, subjects[i], result) == count);
+		hard_assert (!memcmp (result, matched, sizeof result));
+		hard_assert (regex_set_match (&set, subjects[i], NULL) == !!count);
+	}
+	regex_set_free (&set);
+
+	// Case-insensitive matching may fold non-ASCII characters to letters
+	if (!setlocale (LC_CTYPE, "C.UTF-8"))
+		return;
+
+	set = regex_set_make ();
+	hard_assert (regex_set_add (&set, "class", REG_ICASE, NULL));
+	hard_assert (regex_set_add (&set, "a::b", REG_ICASE, NULL));
+	hard_assert (!strcmp (set.entries[0].literal, "cla"));
+	hard_assert (!strcmp (set.entries[1].literal, "a::b"));
+
+	bool result[2];
+	if (!regexec (set.entries[0].re, "claſſ", 0, NULL, 0))
+		hard_assert (regex_set_match (&set, "claſſ", result) == 1);
+	hard_assert (regex_set_match (&set, "CLASS", result) == 1 && result[0]);
+	hard_assert (regex_set_match (&set, "A::B", result) == 1 && result[1]);
+	regex_set_free (&set);
+	setlocale (LC_CTYPE, "C");
+}
+
 // --- Asynchronous jobs -------------------------------------------------------
 
 struct test_async_data
@@ -659,6 +757,23 @@ test_config_load (struct config_item *subtree, void *user_data)
 	config_schema_apply_to_object (g_config_test, subtree, user_data);
 }
 
+static void
+test_config_on_diff (enum config_diff_type type, const char *path,
+	struct config_item *old, struct config_item *new, void *user_data)
+{
+	(void) old;
+	(void) new;
+
+	const char *prefix[] = { "+", "-", "~" };
+	strv_append_owned (user_data, xstrdup_printf ("%s%s", prefix[type], path));
+}
+
+static int
+test_config_compare_paths (const void *a, const void *b)
+{
+	return strcmp (*(const char **) a, *(const char **) b);
+}
+
 static void
 test_config (void)
 {
@@ -670,6 +785,18 @@ test_config (void)
 	config_schema_call_changed (config.root);
 	hard_assert (b == false);
 
+	// Defaults are only parsed once, but each user gets their own copy
+	size_t defaults_len = g_config_defaults.len;
+	struct config_item *default_ =
+		config_schema_get_default (&g_config_test[1], NULL);
+	struct config_item *other =
+		config_schema_get_default (&g_config_test[1], NULL);
+	hard_assert (default_->value.integer == 1 && default_ != other
+		&& other->value.integer == 1);
+	hard_assert (g_config_defaults.len == defaults_len);
+	config_item_destroy (default_);
+	config_item_destroy (other);
+
 	struct config_item *invalid = config_item_integer (-1);
 	hard_assert (!config_item_set_from (config_item_get (config.root,
 		"top.bar", NULL), invalid, NULL));
@@ -678,15 +805,164 @@ test_config (void)
 	hard_assert (!strcmp ("qux\001`a",
 		config_item_get (config.root, "top.123", NULL)->value.string.str));
 
+	struct config_path path = config_path_make (&config, "top.bar");
+	struct config_item *bar = config_path_get (&path);
+	hard_assert (bar && bar->value.integer == 1);
+	hard_assert (config_path_get (&path) == bar);
+
+	const char *script = "top = { bar = 2 }";
+	struct config_item *root =
+		config_item_parse (script, strlen (script), false, NULL);
+	config_load (&config, root);
+	bar = config_path_get (&path);
+	hard_assert (bar && bar->value.integer == 2);
+	config_path_free (&path);
+
+	// Error positions are only computed when needed
+	struct error *e = NULL;
+	script = "a = 1\nb = {\n\tc = \"x\\\"y\" `z`\n\td = 12 @\n}";
+	hard_assert (!config_item_parse (script, strlen (script), false, &e));
+	hard_assert (!strcmp (e->message, "near line 4, column 9: invalid input"));
+	error_free (e);
+
 	struct str s = str_make ();
 	config_item_write (config.root, true, &s);
 	print_debug ("%s", s.str);
+	hard_assert (strstr (s.str, "\t\"123\" = \"qux\\x01`a\"\n\tbar = 2\n"));
+
+	// Streaming to a file descriptor yields the same output
+	FILE *fp = tmpfile ();
+	hard_assert (fp);
+	hard_assert
+		(config_item_write_to_fd (config.root, true, fileno (fp), NULL));
+	char streamed[s.len + 1];
+	rewind (fp);
+	hard_assert (fread (streamed, 1, sizeof streamed, fp) == s.len);
+	hard_assert (!memcmp (streamed, s.str, s.len));
+	fclose (fp);
 	struct config_item *parsed = config_item_parse (s.str, s.len, false, NULL);
 	hard_assert (parsed);
+
+	// Snapshots need to match their source text, and not be damaged
+	struct str snapshot = str_make ();
+	config_snapshot_pack (&s, parsed, &snapshot);
+	config_item_destroy (parsed);
+	hard_assert ((parsed = config_snapshot_unpack (&s, &snapshot)));
+	hard_assert (!strcmp ("qux\001`a",
+		config_item_get (parsed, "top.123", NULL)->value.string.str));
+	hard_assert (config_item_get (parsed, "top.bar", NULL)->value.integer == 2);
 	config_item_destroy (parsed);
+
+	snapshot.len--;
+	hard_assert (!config_snapshot_unpack (&s, &snapshot));
+	snapshot.len++;
+	s.str[0] ^= 1;
+	hard_assert (!config_snapshot_unpack (&s, &snapshot));
+
+	// Excessive nesting is refused rather than recursed into
+	for (int depth = CONFIG_ITEM_UNPACK_MAX_DEPTH;
+		depth <= CONFIG_ITEM_UNPACK_MAX_DEPTH + 1; depth++)
+	{
+		str_reset (&snapshot);
+		for (int i = 0; i < depth; i++)
+		{
+			str_pack_u8 (&snapshot, CONFIG_ITEM_OBJECT);
+			str_pack_u32 (&snapshot, i + 1 < depth);
+			if (i + 1 < depth)
+				config_item_pack_data (&snapshot, "x", 1);
+		}
+
+		struct msg_unpacker unpacker =
+			msg_unpacker_make (snapshot.str, snapshot.len);
+		parsed = config_item_unpack (&unpacker);
+		hard_assert (!parsed == (depth > CONFIG_ITEM_UNPACK_MAX_DEPTH));
+		if (parsed)
+			config_item_destroy (parsed);
+	}
+	str_free (&snapshot);
 	str_free (&s);
 
+	// Reloads should only touch what has changed
+	script = "top = { foo = on\nbar = -1\nnew = 1 }\nmisc = { x = 1 }";
+	root = config_item_parse (script, strlen (script), false, NULL);
+	struct strv diff = strv_make ();
+	config_item_diff (config.root, root, test_config_on_diff, &diff);
+	qsort (diff.vector, diff.len, sizeof *diff.vector,
+		test_config_compare_paths);
+	char *joined = strv_join (&diff, " ");
+	hard_assert (!strcmp (joined, "+misc +top.new -top.123 ~top.bar ~top.foo"));
+	free (joined);
+	strv_free (&diff);
+
+	struct config_item *item123 =
+		config_item_get (config.root, "top.123", NULL);
+	item123->value.string.str[0] = 'Q';
+	config_reload (&config, root);
+	hard_assert (b == true);
+	hard_assert (config_item_get (config.root, "top.bar", NULL) == bar);
+	hard_assert (bar->value.integer == 2);
+	hard_assert (config_item_get (config.root, "top.123", NULL) == item123);
+	hard_assert (!strcmp ("qux\001`a", item123->value.string.str));
+	hard_assert (config_item_get (config.root, "misc.x", NULL));
+
+	b = false;
+	script = "top = { foo = on\nnew = 2 }";
+	config_reload (&config,
+		config_item_parse (script, strlen (script), false, NULL));
+	hard_assert (b == false);
+	hard_assert (bar->value.integer == 1);
+	hard_assert (!config_item_get (config.root, "misc", NULL));
+	hard_assert (config_item_get (config.root, "top.new", NULL)
+		->value.integer == 2);
+
+	// Snapshots are shared, and changes only copy the path to the item
+	struct config_item *snapshot_root = config_snapshot (&config);
+	struct config_item *item = config_item_get (config.root, "top.new", NULL);
+	hard_assert (!config_item_is_private (item));
+	item = config_get_private (&config, "top.new", NULL);
+	hard_assert (config_item_is_private (item));
+	hard_assert (item != config_item_get (snapshot_root, "top.new", NULL));
+	hard_assert (config_item_get (config.root, "top.foo", NULL)
+		== config_item_get (snapshot_root, "top.foo", NULL));
+	hard_assert (config_item_set_from (item, config_item_integer (3), NULL));
+	hard_assert (config_item_get (snapshot_root, "top.new", NULL)
+		->value.integer == 2);
+
+	// Clones are entirely independent of the original, unlike copies
+	item = config_item_clone (snapshot_root);
+	struct config_item *top = config_item_get (item, "top", NULL);
+	hard_assert (config_item_is_private (top));
+	hard_assert (top != config_item_get (snapshot_root, "top", NULL));
+	hard_assert (config_item_equal (item, snapshot_root));
+	config_item_destroy (item);
+
+	item = config_item_copy (snapshot_root);
+	hard_assert (!config_item_is_private (config_item_get (item, "top", NULL)));
+	hard_assert (config_item_get (item, "top", NULL)
+		== config_item_get (snapshot_root, "top", NULL));
+	config_item_destroy (item);
+
+	// Snapshots also make it possible to undo changes
+	config_reload (&config, snapshot_root);
+	item = config_item_get (config.root, "top.new", NULL);
+	hard_assert (item->value.integer == 2);
+
+	// Even items that only existed in the snapshot can be modified
+	script = "top = { foo = on\nnew = 2\nextra = { x = 1 } }";
+	config_reload (&config,
+		config_item_parse (script, strlen (script), false, NULL));
+	snapshot_root = config_snapshot (&config);
+	script = "top = { foo = on\nnew = 2 }";
+	config_reload (&config,
+		config_item_parse (script, strlen (script), false, NULL));
+	config_reload (&config, snapshot_root);
+	item = config_item_get (config.root, "top.extra.x", NULL);
+	hard_assert (config_item_is_private (item));
+	hard_assert (config_item_set_from (item, config_item_integer (2), NULL));
+
 	config_free (&config);
+	config_schema_free_defaults ();
+	hard_assert (!g_config_defaults.map);
 }
 
 // --- Main --------------------------------------------------------------------
@@ -706,6 +982,8 @@ main (int argc, char *argv[])
 	test_add_simple (&test, "/str-map",        NULL, test_str_map);
 	test_add_simple (&test, "/utf-8",          NULL, test_utf8);
 	test_add_simple (&test, "/base64",         NULL, test_base64);
+	test_add_simple (&test, "/regex-cache",    NULL, test_regex_cache);
+	test_add_simple (&test, "/regex-set",      NULL, test_regex_set);
 	test_add_simple (&test, "/async",          NULL, test_async);
 	test_add_simple (&test, "/config",         NULL, test_config);
 
@@ -105,6 +105,222 @@ test_http_parser (void)
 
 	LIST_FOR_EACH (struct http_protocol, iter, protocols)
 		http_protocol_destroy (iter);
+
+	// NUL is neither a delimiter nor anything else, even within strings
+	const char nul[] = "a\0;\"b\0\"";
+	struct http_tokenizer t = http_tokenizer_make (nul, sizeof nul - 1);
+	soft_assert (http_tokenizer_next (&t, false) == HTTP_T_TOKEN);
+	soft_assert (!strcmp (t.string.str, "a"));
+	soft_assert (http_tokenizer_next (&t, false) == HTTP_T_ERROR);
+	soft_assert (http_tokenizer_next (&t, false) == HTTP_T_DELIMITER);
+	soft_assert (http_tokenizer_next (&t, false) == HTTP_T_ERROR);
+	http_tokenizer_free (&t);
+}
+
+struct http_fixture
+{
+	struct http_parser parser;
+	struct str log;                     ///< A summary of all messages
+	const char *pushed;                 ///< The last pushed input
+	size_t pushed_len;                  ///< Length of the last pushed input
+	bool copied;                        ///< Content wasn't passed in place
+};
+
+static bool
+test_http_message_on_headers_read (void *user_data)
+{
+	struct http_fixture *fixture = user_data;
+	struct http_parser *parser = &fixture->parser;
+	if (parser->type == HTTP_PARSER_REQUEST)
+		str_append_printf (&fixture->log, "%.*s %.*s %d ",
+			(int) parser->method_len, parser->method,
+			(int) parser->target_len, parser->target, parser->keep_alive);
+	else
+		str_append_printf (&fixture->log, "%u ", parser->status);
+
+	const char *host = NULL;
+	size_t host_len = 0;
+	if (http_parser_get_header (parser, HTTP_HEADER_HOST, &host, &host_len))
+		soft_assert (host_len == 1 && *host == 'x');
+	return true;
+}
+
+static bool
+test_http_message_on_content (void *user_data, const void *data, size_t len)
+{
+	struct http_fixture *fixture = user_data;
+	if (len && ((const char *) data < fixture->pushed
+	 || (const char *) data + len > fixture->pushed + fixture->pushed_len))
+		fixture->copied = true;
+	if (len)
+		str_append_data (&fixture->log, data, len);
+	else
+		str_append_c (&fixture->log, '|');
+	return true;
+}
+
+static void
+test_http_message_run (enum http_parser_type type,
+	const char *input, const char *expected)
+{
+	size_t len = strlen (input);
+	for (size_t chunk = 1; chunk <= len; chunk++)
+	{
+		struct http_fixture fixture =
+			{ .parser = http_parser_make (type), .log = str_make () };
+		fixture.parser.on_headers_read = test_http_message_on_headers_read;
+		fixture.parser.on_content = test_http_message_on_content;
+		fixture.parser.user_data = &fixture;
+
+		for (size_t i = 0; i < len; i += chunk)
+		{
+			fixture.pushed = input + i;
+			fixture.pushed_len = MIN (chunk, len - i);
+			hard_assert (http_parser_push (&fixture.parser,
+				fixture.pushed, fixture.pushed_len, NULL));
+		}
+		hard_assert (http_parser_push (&fixture.parser, NULL, 0, NULL));
+		soft_assert (!strcmp (fixture.log.str, expected));
+		soft_assert (!fixture.copied);
+
+		http_parser_free (&fixture.parser);
+		str_free (&fixture.log);
+	}
+}
+
+static bool
+test_http_message_fails (const char *input)
+{
+	struct http_fixture fixture = { .parser =
+		http_parser_make (HTTP_PARSER_REQUEST), .log = str_make () };
+	fixture.parser.on_headers_read = test_http_message_on_headers_read;
+	fixture.parser.on_content = test_http_message_on_content;
+	fixture.parser.user_data = &fixture;
+
+	struct error *e = NULL;
+	bool failed =
+		!http_parser_push (&fixture.parser, input, strlen (input), &e);
+	if (e)
+		error_free (e);
+
+	http_parser_free (&fixture.parser);
+	str_free (&fixture.log);
+	return failed;
+}
+
+static void
+test_http_message (void)
+{
+	for (size_t i = 1; i < HTTP_HEADER_COUNT; i++)
+	{
+		char *name = xstrdup (http_header_name (i));
+		soft_assert (http_header_resolve (name, strlen (name)) == i);
+		for (char *p = name; *p; p++)
+			*p = toupper_ascii (*p);
+		soft_assert (http_header_resolve (name, strlen (name)) == i);
+		soft_assert (!http_header_resolve (name, strlen (name) - 1));
+		free (name);
+	}
+
+	// Pipelined requests, with all kinds of framing
+	test_http_message_run (HTTP_PARSER_REQUEST,
+		"\r\nGET /a HTTP/1.1\r\nHost: x \r\nConnection: keep-alive\r\n\r\n"
+		"POST /b HTTP/1.1\r\ncontent-length: 5\r\n\r\nhello"
+		"PUT /c HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n"
+		"3;ext=1\r\nabc\r\n2\r\nde\r\n0\r\nX-Trailer: y\r\n\r\n"
+		"GET /d HTTP/1.0\n\n",
+		"GET /a 1 |POST /b 1 hello|PUT /c 1 abcde|GET /d 0 |");
+
+	test_http_message_run (HTTP_PARSER_RESPONSE,
+		"HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nhi"
+		"HTTP/1.1 204 No Content\r\nContent-Length: 5\r\n\r\n"
+		"HTTP/1.0 200 OK\r\n\r\nrest",
+		"200 hi|204 |200 rest|");
+
+	soft_assert (test_http_message_fails
+		("GET / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n"));
+	soft_assert (test_http_message_fails
+		("GET / HTTP/1.1\r\nA: b\r\n folded\r\n\r\n"));
+	soft_assert (test_http_message_fails
+		("GET / HTTP/1.1\r\nName : value\r\n\r\n"));
+	soft_assert (test_http_message_fails
+		("GET / HTTP/2.0\r\n\r\n"));
+}
+
+struct http_chunked_fixture
+{
+	struct str data;                    ///< Decoded data
+	struct str trailers;                ///< Decoded trailer fields
+};
+
+static bool
+test_http_chunked_on_data (void *user_data, const void *data, size_t len)
+{
+	struct http_chunked_fixture *fixture = user_data;
+	str_append_data (&fixture->data, data, len);
+	return true;
+}
+
+static bool
+test_http_chunked_on_trailer (void *user_data, const struct http_header *field)
+{
+	struct http_chunked_fixture *fixture = user_data;
+	str_append_printf (&fixture->trailers, "%.*s=%.*s",
+		(int) field->name_len, field->name,
+		(int) field->value_len, field->value);
+	return true;
+}
+
+static void
+test_http_chunked (void)
+{
+	const char *parts[] = { "Hello", ", ", "world!" };
+	struct str encoded = str_make ();
+	for (size_t i = 0; i < N_ELEMENTS (parts); i++)
+	{
+		char header[HTTP_CHUNK_HEADER_MAX];
+		struct iovec iov[3];
+		http_chunked_encode (header, parts[i], strlen (parts[i]), iov);
+		for (size_t k = 0; k < N_ELEMENTS (iov); k++)
+			str_append_data (&encoded, iov[k].iov_base, iov[k].iov_len);
+	}
+
+	struct str_map trailers = str_map_make (NULL);
+	str_map_set (&trailers, "Digest", "x");
+	http_chunked_encode_last (&encoded, &trailers);
+	str_map_free (&trailers);
+
+	size_t body_len = encoded.len;
+	str_append (&encoded, "NEXT");
+
+	for (size_t chunk = 1; chunk <= encoded.len; chunk++)
+	{
+		struct http_chunked_fixture fixture =
+			{ .data = str_make (), .trailers = str_make () };
+		struct http_chunked_decoder decoder = http_chunked_decoder_make ();
+		decoder.on_data = test_http_chunked_on_data;
+		decoder.on_trailer = test_http_chunked_on_trailer;
+		decoder.user_data = &fixture;
+
+		size_t used = 0;
+		for (size_t i = 0; i < encoded.len; i += chunk)
+		{
+			ssize_t processed = http_chunked_decoder_push (&decoder,
+				encoded.str + i, MIN (chunk, encoded.len - i), NULL);
+			hard_assert (processed != -1);
+			used += processed;
+		}
+
+		soft_assert (decoder.state == HTTP_CHUNKED_DONE);
+		soft_assert (used == body_len);
+		soft_assert (!strcmp (fixture.data.str, "Hello, world!"));
+		soft_assert (!strcmp (fixture.trailers.str, "Digest=x"));
+
+		http_chunked_decoder_free (&decoder);
+		str_free (&fixture.data);
+		str_free (&fixture.trailers);
+	}
+	str_free (&encoded);
 }
 
 struct scgi_fixture
@@ -168,6 +384,408 @@ test_scgi_parser (void)
 	scgi_parser_free (parser);
 }
 
+struct fcgi_fixture
+{
+	struct fcgi_parser parser;
+	struct str stdin_data;
+	unsigned records;
+};
+
+static bool
+test_fcgi_parser_on_message (const struct fcgi_parser *parser, void *user_data)
+{
+	struct fcgi_fixture *fixture = user_data;
+	soft_assert (parser->version == FCGI_VERSION_1);
+	soft_assert (parser->request_id == 1);
+
+	switch (fixture->records++)
+	{
+	case 0:
+		soft_assert (parser->type == FCGI_BEGIN_REQUEST);
+		soft_assert (parser->content_length == 8);
+		soft_assert (parser->content[1] == FCGI_RESPONDER);
+		break;
+	case 1:
+		soft_assert (parser->type == FCGI_STDIN);
+		soft_assert (parser->padding_length == 3);
+		str_append_data (&fixture->stdin_data,
+			parser->content, parser->content_length);
+		break;
+	case 2:
+		soft_assert (parser->type == FCGI_STDIN);
+		soft_assert (!parser->content_length);
+		break;
+	default:
+		hard_assert (!"unexpected record");
+	}
+	return true;
+}
+
+static void
+test_fcgi_parser (void)
+{
+	const char stream[] =
+		"\x01\x01\x00\x01\x00\x08\x00\x00"
+			"\x00\x01\x00\x00\x00\x00\x00\x00"
+		"\x01\x05\x00\x01\x00\x05\x03\x00" "Hello" "\x00\x00\x00"
+		"\x01\x05\x00\x01\x00\x00\x00\x00";
+
+	// Try both the in-place and the buffering paths
+	for (size_t chunk = 1; chunk <= sizeof stream - 1; chunk++)
+	{
+		struct fcgi_fixture fixture =
+			{ .parser = fcgi_parser_make (), .stdin_data = str_make () };
+		fixture.parser.on_message = test_fcgi_parser_on_message;
+		fixture.parser.user_data = &fixture;
+
+		for (size_t i = 0; i < sizeof stream - 1; i += chunk)
+			soft_assert (fcgi_parser_push (&fixture.parser, stream + i,
+				MIN (chunk, sizeof stream - 1 - i)));
+
+		soft_assert (fixture.records == 3);
+		soft_assert (!strcmp (fixture.stdin_data.str, "Hello"));
+		soft_assert (!fixture.parser.input.len);
+
+		fcgi_parser_free (&fixture.parser);
+		str_free (&fixture.stdin_data);
+	}
+}
+
+static void
+test_fcgi_nv (void)
+{
+	struct str_map map = str_map_make (free);
+	str_map_set (&map, "SHORT", xstrdup (""));
+	str_map_set (&map, "REQUEST_URI", xstrdup ("/"));
+	char long_value[300];
+	memset (long_value, 'x', sizeof long_value - 1);
+	long_value[sizeof long_value - 1] = '\0';
+	str_map_set (&map, "LONG", xstrdup (long_value));
+
+	struct str nv = str_make ();
+	fcgi_nv_convert (&map, &nv);
+
+	// Parse it all at once, with values stored in one allocation
+	struct str_map parsed = str_map_make (NULL);
+	char *storage = NULL;
+	soft_assert (fcgi_nv_parse (nv.str, nv.len, &parsed, &storage));
+	soft_assert (parsed.len == map.len);
+	soft_assert (!strcmp (str_map_find (&parsed, "LONG"), long_value));
+	soft_assert (!strcmp (str_map_find (&parsed, "REQUEST_URI"), "/"));
+	str_map_free (&parsed);
+	free (storage);
+
+	// Truncated input must be rejected
+	parsed = str_map_make (free);
+	soft_assert (!fcgi_nv_parse (nv.str, nv.len - 1, &parsed, NULL));
+	str_map_free (&parsed);
+
+	// And incrementally, in all possible chunk sizes
+	for (size_t chunk = 1; chunk <= nv.len; chunk++)
+	{
+		parsed = str_map_make (free);
+		struct fcgi_nv_parser parser = fcgi_nv_parser_make ();
+		parser.output = &parsed;
+		for (size_t i = 0; i < nv.len; i += chunk)
+			fcgi_nv_parser_push (&parser, nv.str + i, MIN (chunk, nv.len - i));
+		fcgi_nv_parser_free (&parser);
+
+		soft_assert (parsed.len == map.len);
+		soft_assert (!strcmp (str_map_find (&parsed, "LONG"), long_value));
+		soft_assert (!strcmp (str_map_find (&parsed, "SHORT"), ""));
+		str_map_free (&parsed);
+	}
+
+	str_free (&nv);
+	str_map_free (&map);
+}
+
+struct fcgi_writer_fixture
+{
+	struct str written;                 ///< Everything written out
+	size_t calls;                       ///< Number of write callback calls
+
+	struct str content;                 ///< Reassembled stream
+	size_t records;                     ///< Number of stream records
+	bool ended;                         ///< FCGI_END_REQUEST received
+};
+
+static void
+test_fcgi_writer_write (void *user_data, const struct iovec *iov, int iovcnt)
+{
+	struct fcgi_writer_fixture *fixture = user_data;
+	for (int i = 0; i < iovcnt; i++)
+		str_append_data (&fixture->written, iov[i].iov_base, iov[i].iov_len);
+	fixture->calls++;
+}
+
+static bool
+test_fcgi_writer_on_message (const struct fcgi_parser *parser, void *user_data)
+{
+	struct fcgi_writer_fixture *fixture = user_data;
+	soft_assert (parser->request_id == 1);
+	soft_assert (!((parser->content_length + parser->padding_length)
+		% FCGI_ALIGNMENT));
+
+	soft_assert (!fixture->ended);
+	if (parser->type == FCGI_END_REQUEST)
+		fixture->ended = true;
+	else if (parser->type == FCGI_STDOUT)
+	{
+		str_append_data (&fixture->content,
+			parser->content, parser->content_length);
+		fixture->records++;
+	}
+	else
+		hard_assert (!"unexpected record");
+	return true;
+}
+
+static void
+test_fcgi_writer (void)
+{
+	struct fcgi_writer_fixture fixture =
+		{ .written = str_make (), .content = str_make () };
+	struct fcgi_writer writer = fcgi_writer_make (FCGI_STDOUT, 1);
+	writer.user_data = &fixture;
+	writer.write_cb = test_fcgi_writer_write;
+
+	struct str expected = str_make ();
+	char small[100], large[200000];
+	for (size_t i = 0; i < sizeof large; i++)
+		large[i] = i * 7;
+
+	// Small writes should get coalesced into as few records as possible
+	for (int i = 0; i < 1000; i++)
+	{
+		memset (small, i, sizeof small);
+		fcgi_writer_write (&writer, small, sizeof small);
+		str_append_data (&expected, small, sizeof small);
+	}
+	soft_assert (fixture.calls == 1);
+
+	fcgi_writer_write (&writer, large, sizeof large);
+	str_append_data (&expected, large, sizeof large);
+	soft_assert (fixture.calls == 2);
+
+	fcgi_writer_write (&writer, "x", 1);
+	str_append_c (&expected, 'x');
+	fcgi_writer_end_request (&writer, 0, FCGI_REQUEST_COMPLETE);
+	soft_assert (fixture.calls == 3);
+	fcgi_writer_free (&writer);
+
+	struct fcgi_parser parser = fcgi_parser_make ();
+	parser.on_message = test_fcgi_writer_on_message;
+	parser.user_data = &fixture;
+	soft_assert (fcgi_parser_push (&parser,
+		fixture.written.str, fixture.written.len));
+	fcgi_parser_free (&parser);
+
+	soft_assert (fixture.ended);
+	soft_assert (fixture.records == 2 + 4 + 1 + 1);
+	soft_assert (fixture.content.len == expected.len
+		&& !memcmp (fixture.content.str, expected.str, expected.len));
+
+	str_free (&expected);
+	str_free (&fixture.written);
+	str_free (&fixture.content);
+}
+
+static void
+test_fcgi_pack_record (struct str *output,
+	enum fcgi_type type, uint16_t request_id, const void *data, size_t len)
+{
+	str_pack_u8  (output, FCGI_VERSION_1);
+	str_pack_u8  (output, type);
+	str_pack_u16 (output, request_id);
+	str_pack_u16 (output, len);
+	str_pack_u8  (output, 0);
+	str_pack_u8  (output, 0);
+	str_append_data (output, data, len);
+}
+
+struct fcgi_muxer_fixture
+{
+	struct fcgi_muxer muxer;
+	struct str written;
+	bool closed;
+
+	struct str_map values;
+	struct str stdout_data[4];
+	unsigned ended;
+	unsigned finalized;
+};
+
+static void
+test_fcgi_muxer_write (void *user_data, const struct iovec *iov, int iovcnt)
+{
+	struct fcgi_muxer_fixture *fixture = user_data;
+	for (int i = 0; i < iovcnt; i++)
+		str_append_data (&fixture->written, iov[i].iov_base, iov[i].iov_len);
+}
+
+static void
+test_fcgi_muxer_close (void *user_data)
+{
+	struct fcgi_muxer_fixture *fixture = user_data;
+	fixture->closed = true;
+}
+
+static bool
+test_fcgi_muxer_request_start (struct fcgi_request *request)
+{
+	const char *method = str_map_find (&request->headers, "REQUEST_METHOD");
+	hard_assert (method);
+
+	// The request may be finished right away, whatever gets returned
+	bool accept = !strcmp (method, "POST");
+	if (!strcmp (method, "HEAD"))
+		fcgi_request_finish (request, 0);
+	return accept;
+}
+
+static void
+test_fcgi_muxer_request_finalize (struct fcgi_request *request)
+{
+	struct fcgi_muxer_fixture *fixture = request->muxer->user_data;
+	fixture->finalized++;
+}
+
+static void
+test_fcgi_muxer_request_push
+	(struct fcgi_request *request, const void *data, size_t len)
+{
+	// Just echo the input back
+	if (len)
+		fcgi_request_write (request, data, len);
+	else
+		fcgi_request_finish (request, 0);
+}
+
+static bool
+test_fcgi_muxer_on_message (const struct fcgi_parser *parser, void *user_data)
+{
+	struct fcgi_muxer_fixture *fixture = user_data;
+	struct fcgi_nv_parser nv_parser = fcgi_nv_parser_make ();
+	switch (parser->type)
+	{
+	case FCGI_GET_VALUES_RESULT:
+		nv_parser.output = &fixture->values;
+		fcgi_nv_parser_push (&nv_parser,
+			parser->content, parser->content_length);
+		break;
+	case FCGI_STDOUT:
+		hard_assert (parser->request_id < N_ELEMENTS (fixture->stdout_data));
+		str_append_data (&fixture->stdout_data[parser->request_id],
+			parser->content, parser->content_length);
+		break;
+	case FCGI_END_REQUEST:
+		soft_assert (parser->content[4] == FCGI_REQUEST_COMPLETE);
+		fixture->ended++;
+		break;
+	default:
+		hard_assert (!"unexpected record");
+	}
+	fcgi_nv_parser_free (&nv_parser);
+	return true;
+}
+
+static void
+test_fcgi_muxer (void)
+{
+	struct fcgi_muxer_fixture fixture =
+	{
+		.muxer = fcgi_muxer_make (),
+		.written = str_make (),
+		.values = str_map_make (free),
+	};
+	for (size_t i = 0; i < N_ELEMENTS (fixture.stdout_data); i++)
+		fixture.stdout_data[i] = str_make ();
+
+	struct fcgi_muxer *muxer = &fixture.muxer;
+	muxer->user_data = &fixture;
+	muxer->write_cb = test_fcgi_muxer_write;
+	muxer->close_cb = test_fcgi_muxer_close;
+	muxer->request_start_cb = test_fcgi_muxer_request_start;
+	muxer->request_push_cb = test_fcgi_muxer_request_push;
+	muxer->request_finalize_cb = test_fcgi_muxer_request_finalize;
+
+	struct str input = str_make ();
+	struct str nv = str_make ();
+	struct str_map map = str_map_make (free);
+	str_map_set (&map, FCGI_MPXS_CONNS, xstrdup (""));
+	str_map_set (&map, FCGI_MAX_REQS, xstrdup (""));
+	str_map_set (&map, "X_UNKNOWN", xstrdup (""));
+	fcgi_nv_convert (&map, &nv);
+	test_fcgi_pack_record (&input, FCGI_GET_VALUES, 0, nv.str, nv.len);
+
+	str_map_clear (&map);
+	str_reset (&nv);
+	str_map_set (&map, "REQUEST_METHOD", xstrdup ("POST"));
+	fcgi_nv_convert (&map, &nv);
+
+	// Interleave two requests, and make them finish in a different order
+	const char begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN };
+	for (uint16_t id = 1; id <= 2; id++)
+		test_fcgi_pack_record (&input, FCGI_BEGIN_REQUEST, id,
+			begin, sizeof begin);
+	for (uint16_t id = 1; id <= 2; id++)
+		test_fcgi_pack_record (&input, FCGI_PARAMS, id, nv.str, nv.len);
+	for (uint16_t id = 1; id <= 2; id++)
+		test_fcgi_pack_record (&input, FCGI_PARAMS, id, "", 0);
+	test_fcgi_pack_record (&input, FCGI_STDIN, 2, "two", 3);
+	test_fcgi_pack_record (&input, FCGI_STDIN, 1, "one", 3);
+	test_fcgi_pack_record (&input, FCGI_STDIN, 2, "", 0);
+
+	// Rejected requests are never handed over to the handler
+	str_map_set (&map, "REQUEST_METHOD", xstrdup ("GET"));
+	str_reset (&nv);
+	fcgi_nv_convert (&map, &nv);
+	test_fcgi_pack_record (&input, FCGI_BEGIN_REQUEST, 3, begin, sizeof begin);
+	test_fcgi_pack_record (&input, FCGI_PARAMS, 3, nv.str, nv.len);
+	test_fcgi_pack_record (&input, FCGI_PARAMS, 3, "", 0);
+
+	fcgi_muxer_push (muxer, input.str, input.len);
+	soft_assert (muxer->requests_active == 1);
+
+	// Nor are those that the handler finishes while rejecting them
+	str_map_set (&map, "REQUEST_METHOD", xstrdup ("HEAD"));
+	str_reset (&nv);
+	fcgi_nv_convert (&map, &nv);
+	str_map_free (&map);
+	str_reset (&input);
+	test_fcgi_pack_record (&input, FCGI_BEGIN_REQUEST, 3, begin, sizeof begin);
+	test_fcgi_pack_record (&input, FCGI_PARAMS, 3, nv.str, nv.len);
+	test_fcgi_pack_record (&input, FCGI_PARAMS, 3, "", 0);
+	str_free (&nv);
+	test_fcgi_pack_record (&input, FCGI_STDIN, 1, "", 0);
+	fcgi_muxer_push (muxer, input.str, input.len);
+	str_free (&input);
+	soft_assert (!muxer->requests_active);
+	soft_assert (!fixture.closed);
+
+	struct fcgi_parser parser = fcgi_parser_make ();
+	parser.on_message = test_fcgi_muxer_on_message;
+	parser.user_data = &fixture;
+	soft_assert (fcgi_parser_push (&parser,
+		fixture.written.str, fixture.written.len));
+	fcgi_parser_free (&parser);
+
+	soft_assert (fixture.values.len == 2);
+	soft_assert (!strcmp (str_map_find (&fixture.values, FCGI_MPXS_CONNS),
+		"1"));
+	soft_assert (!strcmp (fixture.stdout_data[1].str, "one"));
+	soft_assert (!strcmp (fixture.stdout_data[2].str, "two"));
+	soft_assert (fixture.ended == 4);
+	soft_assert (fixture.finalized == 3);
+
+	fcgi_muxer_free (muxer);
+	str_free (&fixture.written);
+	str_map_free (&fixture.values);
+	for (size_t i = 0; i < N_ELEMENTS (fixture.stdout_data); i++)
+		str_free (&fixture.stdout_data[i]);
+}
+
 static bool
 test_websockets_on_frame_header (void *user_data, const struct ws_parser *self)
 {
@@ -204,6 +822,532 @@ test_websockets (void)
 	ws_parser_free (&parser);
 }
 
+struct mpd_fixture_song
+{
+	unsigned id;                        ///< Song ID
+	unsigned long version;              ///< Queue version of last change
+	const char *title;                  ///< Song title
+};
+
+struct mpd_fixture
+{
+	struct poller poller;
+	struct mpd_client client;
+
+	int server;                         ///< Our end of the connection
+	struct poller_fd server_event;      ///< Server can read
+	struct str server_input;            ///< Unprocessed server input
+	struct str server_output;           ///< Server output yet to be sent
+	struct strv server_list;            ///< Commands in a command list
+	bool in_list;                       ///< Collecting a command list
+	unsigned requests;                  ///< Commands and lists received
+
+	struct mpd_fixture_song queue[8];   ///< Server queue
+	size_t queue_len;                   ///< Server queue length
+	unsigned long version;              ///< Server queue version
+
+	struct strv results;                ///< Formatted responses
+	void *stream;                       ///< Streaming test state
+	size_t pending;                     ///< Tasks yet to be finished
+};
+
+enum { TEST_MPD_PICTURE_SIZE = 100000, TEST_MPD_CHUNK_SIZE = 8192 };
+
+static char
+test_mpd_picture_byte (size_t offset)
+{
+	// Make sure to include plenty of newlines and zeros
+	return offset * 7 % 13;
+}
+
+static void
+test_mpd_server_song (struct mpd_fixture *fixture, struct str *output,
+	size_t position)
+{
+	const struct mpd_fixture_song *song = &fixture->queue[position];
+	str_append_printf (output, "file: %u.flac\nTitle: %s\nPos: %zu\nId: %u\n",
+		song->id, song->title, position, song->id);
+}
+
+/// Our own little MPD, with just enough commands to exercise the client
+static bool
+test_mpd_server_execute (struct mpd_fixture *fixture,
+	struct str *output, const char *command)
+{
+	int count = 0;
+	size_t offset = 0;
+	unsigned long version = 0;
+	unsigned id = 0;
+	if (!strcmp (command, "status"))
+		str_append_printf (output, "playlist: %lu\nplaylistlength: %zu\n",
+			fixture->version, fixture->queue_len);
+	else if (!strcmp (command, "playlistinfo"))
+		for (size_t i = 0; i < fixture->queue_len; i++)
+			test_mpd_server_song (fixture, output, i);
+	else if (sscanf (command, "plchangesposid %lu", &version) == 1)
+	{
+		for (size_t i = 0; i < fixture->queue_len; i++)
+			if (fixture->queue[i].version > version)
+				str_append_printf (output, "cpos: %zu\nId: %u\n",
+					i, fixture->queue[i].id);
+	}
+	else if (sscanf (command, "playlistid %u", &id) == 1)
+	{
+		size_t i = 0;
+		while (i < fixture->queue_len && fixture->queue[i].id != id)
+			i++;
+		if (i == fixture->queue_len)
+			return false;
+		test_mpd_server_song (fixture, output, i);
+	}
+	else if (sscanf (command, "albumart cover %zu", &offset) == 1)
+	{
+		size_t len = MIN (TEST_MPD_PICTURE_SIZE - offset, TEST_MPD_CHUNK_SIZE);
+		str_append_printf (output, "size: %d\nbinary: %zu\n",
+			TEST_MPD_PICTURE_SIZE, len);
+		for (size_t i = 0; i < len; i++)
+			str_append_c (output, test_mpd_picture_byte (offset + i));
+		str_append_c (output, '\n');
+	}
+	else if (!strcmp (command, "readpicture empty 0"))
+		str_append (output, "binary: 0\n\n");
+	else if (!strncmp (command, "echo ", 5))
+		str_append_printf (output, "value: %s\n", command + 5);
+	else if (sscanf (command, "dump %d", &count) == 1)
+		for (int i = 0; i < count; i++)
+			str_append_printf (output,
+				"file: %d.flac\nTitle: Track %d\nTime: 180\n", i, i);
+	else if (strcmp (command, "ping"))
+		return false;
+	return true;
+}
+
+static void
+test_mpd_server_process (struct mpd_fixture *fixture, const char *command)
+{
+	if (!strcmp (command, "command_list_ok_begin"))
+	{
+		fixture->in_list = true;
+		return;
+	}
+	if (fixture->in_list && strcmp (command, "command_list_end"))
+	{
+		strv_append (&fixture->server_list, command);
+		return;
+	}
+
+	fixture->requests++;
+	struct str *output = &fixture->server_output;
+	if (!fixture->in_list)
+	{
+		if (test_mpd_server_execute (fixture, output, command))
+			str_append (output, "OK\n");
+		else
+			str_append_printf (output, "ACK [5@0] {%s} nope\n", command);
+	}
+	else
+	{
+		size_t i = 0;
+		for (; i < fixture->server_list.len; i++)
+		{
+			const char *listed = fixture->server_list.vector[i];
+			if (!test_mpd_server_execute (fixture, output, listed))
+				break;
+			str_append (output, "list_OK\n");
+		}
+		if (i == fixture->server_list.len)
+			str_append (output, "OK\n");
+		else
+			str_append_printf (output, "ACK [5@%zu] {%s} nope\n",
+				i, fixture->server_list.vector[i]);
+
+		strv_reset (&fixture->server_list);
+		fixture->in_list = false;
+	}
+}
+
+static void
+test_mpd_server_on_ready (const struct pollfd *pfd, void *user_data)
+{
+	struct mpd_fixture *fixture = user_data;
+	struct str *input = &fixture->server_input;
+	hard_assert (socket_io_try_read (pfd->fd, input) == SOCKET_IO_OK);
+
+	char *start = input->str, *p;
+	while ((p = memchr (start, '\n', input->str + input->len - start)))
+	{
+		*p = 0;
+		test_mpd_server_process (fixture, start);
+		start = p + 1;
+	}
+	str_remove_slice (input, 0, start - input->str);
+
+	struct str *output = &fixture->server_output;
+	hard_assert (socket_io_try_write (pfd->fd, output) == SOCKET_IO_OK);
+	poller_fd_set (&fixture->server_event,
+		output->len ? (POLLIN | POLLOUT) : POLLIN);
+}
+
+static void
+test_mpd_on_response (const struct mpd_response *response,
+	const struct strv *data, void *user_data)
+{
+	struct mpd_fixture *fixture = user_data;
+	struct str result = str_make ();
+	if (response->success)
+		str_append (&result, "OK");
+	else
+		str_append_printf (&result, "ACK %d@%d %s", response->error,
+			response->list_offset, response->message_text);
+	for (size_t i = 0; i < data->len; i++)
+		str_append_printf (&result, " %s", data->vector[i]);
+
+	strv_append_owned (&fixture->results, str_steal (&result));
+	fixture->pending--;
+}
+
+static void
+test_mpd_run (struct mpd_fixture *fixture)
+{
+	while (fixture->pending)
+		poller_run (&fixture->poller);
+}
+
+static void
+test_mpd_init (struct mpd_fixture *fixture)
+{
+	memset (fixture, 0, sizeof *fixture);
+	fixture->server_input = str_make ();
+	fixture->server_output = str_make ();
+	fixture->server_list = strv_make ();
+	fixture->results = strv_make ();
+
+	poller_init (&fixture->poller);
+	fixture->client = mpd_client_make (&fixture->poller);
+
+	int fds[2];
+	hard_assert (!socketpair (AF_UNIX, SOCK_STREAM, 0, fds));
+	fixture->server = fds[1];
+	set_blocking (fds[1], false);
+	fixture->server_event = poller_fd_make (&fixture->poller, fds[1]);
+	fixture->server_event.dispatcher = test_mpd_server_on_ready;
+	fixture->server_event.user_data = fixture;
+	str_append (&fixture->server_output, "OK MPD 0.23.0\n");
+	poller_fd_set (&fixture->server_event, POLLIN | POLLOUT);
+	mpd_client_finish_connection (&fixture->client, fds[0]);
+}
+
+static void
+test_mpd_free (struct mpd_fixture *fixture)
+{
+	mpd_client_free (&fixture->client);
+	poller_fd_reset (&fixture->server_event);
+	xclose (fixture->server);
+	poller_free (&fixture->poller);
+
+	str_free (&fixture->server_input);
+	str_free (&fixture->server_output);
+	strv_free (&fixture->server_list);
+	strv_free (&fixture->results);
+}
+
+static void
+test_mpd_batch (void)
+{
+	struct mpd_fixture fixture;
+	test_mpd_init (&fixture);
+
+	// Many independent commands should take just a single round trip
+	char *expected[20];
+	for (int i = 0; i < (int) N_ELEMENTS (expected); i++)
+	{
+		char *number = xstrdup_printf ("%d", i);
+		mpd_client_queue (&fixture.client,
+			test_mpd_on_response, &fixture, "echo", number, NULL);
+		expected[i] = xstrdup_printf ("OK value: %s", number);
+		free (number);
+		fixture.pending++;
+	}
+	test_mpd_run (&fixture);
+	soft_assert (fixture.requests == 1);
+	soft_assert (fixture.results.len == N_ELEMENTS (expected));
+	for (size_t i = 0; i < N_ELEMENTS (expected); i++)
+	{
+		soft_assert (!strcmp (fixture.results.vector[i], expected[i]));
+		free (expected[i]);
+	}
+
+	// MPD stops processing a command list at the first failure
+	strv_reset (&fixture.results);
+	mpd_client_queue (&fixture.client,
+		test_mpd_on_response, &fixture, "echo", "a", NULL);
+	mpd_client_queue (&fixture.client,
+		test_mpd_on_response, &fixture, "fail", NULL);
+	mpd_client_queue (&fixture.client,
+		test_mpd_on_response, &fixture, "echo", "b", NULL);
+	fixture.pending += 3;
+	test_mpd_run (&fixture);
+	soft_assert (fixture.requests == 2);
+	soft_assert (fixture.results.len == 3);
+	soft_assert (!strcmp (fixture.results.vector[0], "OK value: a"));
+	soft_assert (!strcmp (fixture.results.vector[1], "ACK 5@1 nope"));
+	soft_assert (!strcmp (fixture.results.vector[2], "ACK 0@0 Not executed"));
+
+	// Lone commands don't need a list, and ordering is kept with direct ones
+	strv_reset (&fixture.results);
+	mpd_client_queue (&fixture.client,
+		test_mpd_on_response, &fixture, "echo", "queued", NULL);
+	mpd_client_send_command (&fixture.client, "ping", NULL);
+	mpd_client_add_task (&fixture.client, test_mpd_on_response, &fixture);
+	fixture.pending += 2;
+	test_mpd_run (&fixture);
+	soft_assert (fixture.requests == 4);
+	soft_assert (fixture.results.len == 2);
+	soft_assert (!strcmp (fixture.results.vector[0], "OK value: queued"));
+	soft_assert (!strcmp (fixture.results.vector[1], "OK"));
+
+	test_mpd_free (&fixture);
+}
+
+struct mpd_stream_fixture
+{
+	int records;                        ///< Records received
+	int pairs;                          ///< Key-value pairs received
+	bool ok;                            ///< Everything was as expected
+};
+
+static void
+test_mpd_on_record (const struct strv *record, void *user_data)
+{
+	struct mpd_fixture *fixture = user_data;
+	struct mpd_stream_fixture *stream = fixture->stream;
+	char *expected = xstrdup_printf ("file: %d.flac", stream->records++);
+	if (record->len != 3 || strcmp (record->vector[0], expected))
+		stream->ok = false;
+	free (expected);
+}
+
+static void
+test_mpd_on_kv (char *key, char *value, void *user_data)
+{
+	struct mpd_fixture *fixture = user_data;
+	struct mpd_stream_fixture *stream = fixture->stream;
+	if (!key || !*value)
+		stream->ok = false;
+	stream->pairs++;
+}
+
+static void
+test_mpd_stream (void)
+{
+	struct mpd_fixture fixture;
+	test_mpd_init (&fixture);
+
+	// A synthetic database dump, delivered one song at a time
+	struct mpd_stream_fixture stream = { .ok = true };
+	fixture.stream = &stream;
+	mpd_client_send_command (&fixture.client, "dump", "10000", NULL);
+	struct mpd_client_task *task =
+		mpd_client_add_task (&fixture.client, test_mpd_on_response, &fixture);
+	task->on_record = test_mpd_on_record;
+	fixture.pending++;
+	test_mpd_run (&fixture);
+	soft_assert (stream.ok && stream.records == 10000);
+	soft_assert (fixture.results.len == 1
+		&& !strcmp (fixture.results.vector[0], "OK"));
+
+	// Streaming also works within batches, and doesn't affect other tasks
+	strv_reset (&fixture.results);
+	stream = (struct mpd_stream_fixture) { .ok = true };
+	task = mpd_client_queue (&fixture.client,
+		test_mpd_on_response, &fixture, "dump", "2", NULL);
+	task->on_kv = test_mpd_on_kv;
+	mpd_client_queue (&fixture.client,
+		test_mpd_on_response, &fixture, "echo", "x", NULL);
+	fixture.pending += 2;
+	test_mpd_run (&fixture);
+	soft_assert (stream.ok && stream.pairs == 2 * 3);
+	soft_assert (fixture.results.len == 2
+		&& !strcmp (fixture.results.vector[0], "OK")
+		&& !strcmp (fixture.results.vector[1], "OK value: x"));
+
+	test_mpd_free (&fixture);
+}
+
+static void
+test_mpd_on_picture (const void *data, size_t len, void *user_data)
+{
+	struct mpd_fixture *fixture = user_data;
+	str_append_data (fixture->stream, data, len);
+}
+
+static void
+test_mpd_binary (void)
+{
+	struct mpd_fixture fixture;
+	test_mpd_init (&fixture);
+
+	// The first chunk tells us the size, all the others follow in a batch
+	struct str picture = str_make ();
+	fixture.stream = &picture;
+	mpd_client_fetch_binary (&fixture.client, "albumart", "cover",
+		test_mpd_on_picture, test_mpd_on_response, &fixture);
+	fixture.pending++;
+	test_mpd_run (&fixture);
+	soft_assert (fixture.requests == 2);
+	soft_assert (fixture.results.len == 1
+		&& !strcmp (fixture.results.vector[0], "OK"));
+
+	bool intact = picture.len == TEST_MPD_PICTURE_SIZE;
+	for (size_t i = 0; intact && i < picture.len; i++)
+		intact = picture.str[i] == test_mpd_picture_byte (i);
+	soft_assert (intact);
+
+	// Errors are reported just once
+	strv_reset (&fixture.results);
+	str_reset (&picture);
+	mpd_client_fetch_binary (&fixture.client, "readpicture", "cover",
+		test_mpd_on_picture, test_mpd_on_response, &fixture);
+	fixture.pending++;
+	test_mpd_run (&fixture);
+	soft_assert (!picture.len);
+	soft_assert (fixture.results.len == 1
+		&& !strcmp (fixture.results.vector[0], "ACK 5@0 nope"));
+
+	// Empty binary data is still terminated by a newline
+	strv_reset (&fixture.results);
+	mpd_client_send_command (&fixture.client,
+		"readpicture", "empty", "0", NULL);
+	mpd_client_add_task (&fixture.client, test_mpd_on_response, &fixture);
+	fixture.pending++;
+	test_mpd_run (&fixture);
+	soft_assert (fixture.results.len == 1
+		&& !strcmp (fixture.results.vector[0], "OK binary: 0"));
+
+	str_free (&picture);
+	test_mpd_free (&fixture);
+}
+
+struct mpd_cache_fixture
+{
+	unsigned statuses;                  ///< Status updates
+	unsigned changes;                   ///< Changed positions
+	size_t length;                      ///< Queue length, as reported
+};
+
+static void
+test_mpd_cache_on_status (void *user_data)
+{
+	struct mpd_cache_fixture *fixture = user_data;
+	fixture->statuses++;
+}
+
+static void
+test_mpd_cache_on_queue_resize (size_t length, void *user_data)
+{
+	struct mpd_cache_fixture *fixture = user_data;
+	fixture->length = length;
+}
+
+static void
+test_mpd_cache_on_queue_change (size_t position,
+	const struct mpd_cache_song *song, void *user_data)
+{
+	(void) position;
+	(void) song;
+
+	struct mpd_cache_fixture *fixture = user_data;
+	fixture->changes++;
+}
+
+static void
+test_mpd_cache_sync (struct mpd_fixture *fixture, struct mpd_cache *cache)
+{
+	mpd_cache_refresh (cache);
+	while (cache->updating)
+		poller_run (&fixture->poller);
+}
+
+static bool
+test_mpd_cache_matches (struct mpd_fixture *fixture, struct mpd_cache *cache)
+{
+	if (cache->queue_len != fixture->queue_len)
+		return false;
+	for (size_t i = 0; i < cache->queue_len; i++)
+	{
+		const char *title = mpd_cache_song_get (cache->queue[i], "title");
+		if (!title || strcmp (title, fixture->queue[i].title)
+		 || cache->queue[i]->position != i)
+			return false;
+	}
+	return true;
+}
+
+static void
+test_mpd_cache (void)
+{
+	struct mpd_fixture fixture;
+	test_mpd_init (&fixture);
+
+	static const char *titles[] = { "One", "Two", "Three", "Four", "Five" };
+	for (size_t i = 0; i < N_ELEMENTS (titles); i++)
+		fixture.queue[fixture.queue_len++] = (struct mpd_fixture_song)
+			{ .id = i + 1, .version = 1, .title = titles[i] };
+	fixture.version = 1;
+
+	struct mpd_cache_fixture events = {};
+	struct mpd_cache cache = mpd_cache_make (&fixture.client);
+	cache.user_data = &events;
+	cache.on_status = test_mpd_cache_on_status;
+	cache.on_queue_resize = test_mpd_cache_on_queue_resize;
+	cache.on_queue_change = test_mpd_cache_on_queue_change;
+
+	test_mpd_cache_sync (&fixture, &cache);
+	soft_assert (events.statuses == 1);
+	soft_assert (events.length == 5 && events.changes == 5);
+	soft_assert (test_mpd_cache_matches (&fixture, &cache));
+
+	// Removal only moves the following songs, we don't need to refetch them
+	fixture.queue_len--;
+	memmove (fixture.queue + 1, fixture.queue + 2,
+		(fixture.queue_len - 1) * sizeof *fixture.queue);
+	fixture.version++;
+	for (size_t i = 1; i < fixture.queue_len; i++)
+		fixture.queue[i].version = fixture.version;
+
+	events = (struct mpd_cache_fixture) {};
+	fixture.requests = 0;
+	test_mpd_cache_sync (&fixture, &cache);
+	soft_assert (fixture.requests == 2);
+	soft_assert (events.length == 4 && events.changes == 3);
+	soft_assert (test_mpd_cache_matches (&fixture, &cache));
+	soft_assert (cache.songs.len == 4);
+
+	// Modified and new songs are fetched, in a single batch
+	fixture.version++;
+	fixture.queue[1].title = "Changed";
+	fixture.queue[1].version = fixture.version;
+	fixture.queue[fixture.queue_len++] = (struct mpd_fixture_song)
+		{ .id = 6, .version = fixture.version, .title = "Six" };
+
+	events = (struct mpd_cache_fixture) {};
+	fixture.requests = 0;
+	test_mpd_cache_sync (&fixture, &cache);
+	soft_assert (fixture.requests == 3);
+	soft_assert (events.length == 5 && events.changes == 2);
+	soft_assert (test_mpd_cache_matches (&fixture, &cache));
+
+	// Nothing to do when the version stays the same
+	events = (struct mpd_cache_fixture) {};
+	fixture.requests = 0;
+	test_mpd_cache_sync (&fixture, &cache);
+	soft_assert (fixture.requests == 1 && !events.changes);
+
+	mpd_client_reset (&fixture.client);
+	mpd_cache_free (&cache);
+	test_mpd_free (&fixture);
+}
+
 // --- Main --------------------------------------------------------------------
 
 int
@@ -214,9 +1358,18 @@ main (int argc, char *argv[])
 
 	test_add_simple (&test, "/irc",            NULL, test_irc);
 	test_add_simple (&test, "/http-parser",    NULL, test_http_parser);
+	test_add_simple (&test, "/http-message",   NULL, test_http_message);
+	test_add_simple (&test, "/http-chunked",   NULL, test_http_chunked);
 	test_add_simple (&test, "/scgi-parser",    NULL, test_scgi_parser);
+	test_add_simple (&test, "/fcgi-parser",    NULL, test_fcgi_parser);
+	test_add_simple (&test, "/fcgi-nv",        NULL, test_fcgi_nv);
+	test_add_simple (&test, "/fcgi-writer",    NULL, test_fcgi_writer);
+	test_add_simple (&test, "/fcgi-muxer",     NULL, test_fcgi_muxer);
 	test_add_simple (&test, "/websockets",     NULL, test_websockets);
-	// TODO: test FastCGI and MPD
+	test_add_simple (&test, "/mpd-batch",      NULL, test_mpd_batch);
+	test_add_simple (&test, "/mpd-stream",     NULL, test_mpd_stream);
+	test_add_simple (&test, "/mpd-binary",     NULL, test_mpd_binary);
+	test_add_simple (&test, "/mpd-cache",      NULL, test_mpd_cache);
 
 	return test_run (&test);
 }
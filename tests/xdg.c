@@ -28,6 +28,7 @@ static const char file[] =
 	"Version = 1.0\n"
 	"Name=\\s\\n\\t\\r\\\\\n"
 	"Name[fr]=Nom\n"
+	"Name[de_AT]=Bezeichnung\n"
 	"Hidden=true\n"
 	"Categories=Utility;TextEditor;\n"
 	"Number=42";
@@ -55,6 +56,146 @@ test_desktop_file (void)
 	desktop_file_free (&entry);
 }
 
+static void
+test_desktop_file_localized (void)
+{
+	char *path = xstrdup ("/tmp/liberty-test-XXXXXX");
+	int fd = mkstemp (path);
+	hard_assert (fd >= 0);
+	hard_assert (write (fd, file, sizeof file - 1) == sizeof file - 1);
+	xclose (fd);
+
+	struct desktop_file entry = {};
+	struct error *e = NULL;
+	hard_assert (desktop_file_open (path, &entry, &e));
+	hard_assert (!unlink (path));
+	free (path);
+
+	const char *group = "Desktop Entry";
+	hard_assert (!strcmp (desktop_file_get_localized
+		(&entry, group, "Name", "fr_FR.UTF-8@euro"), "Nom"));
+	hard_assert (!strcmp (desktop_file_get_localized
+		(&entry, group, "Name", "de_AT"), "Bezeichnung"));
+	hard_assert (!strcmp (desktop_file_get_localized
+		(&entry, group, "Name", "de_DE"), "\\s\\n\\t\\r\\\\"));
+
+	char *value = desktop_file_get_localestring (&entry, group, "Name", "C");
+	hard_assert (!strcmp (value, " \n\t\r\\"));
+	free (value);
+
+	// Exceed the number of lookups served by scanning the group
+	for (int i = 0; i < 20; i++)
+		hard_assert (!desktop_file_get (&entry, group, "Missing"));
+	hard_assert (!strcmp (desktop_file_get (&entry, group, "Name[fr]"), "Nom"));
+	hard_assert (!desktop_file_get (&entry, "Missing", "Name"));
+
+	desktop_file_free (&entry);
+	hard_assert (!desktop_file_open ("/nonexistent", &entry, &e));
+	error_free (e);
+}
+
+#ifdef LIBERTY_XDG_WANT_X11
+
+static void
+test_xsettings_pad (struct str *s)
+{
+	while (s->len % 4)
+		str_pack_u8 (s, 0);
+}
+
+static void
+test_xsettings_begin (struct str *s, uint32_t serial, uint32_t n_settings)
+{
+	str_reset (s);
+	str_pack_u8 (s, MSBFirst);
+	test_xsettings_pad (s);
+	str_pack_u32 (s, serial);
+	str_pack_u32 (s, n_settings);
+}
+
+static void
+test_xsettings_add (struct str *s, const char *name, uint32_t serial,
+	const char *value)
+{
+	str_pack_u8 (s, value ? XDG_XSETTINGS_STRING : XDG_XSETTINGS_INTEGER);
+	str_pack_u8 (s, 0);
+	str_pack_u16 (s, strlen (name));
+	str_append (s, name);
+	test_xsettings_pad (s);
+	str_pack_u32 (s, serial);
+	if (!value)
+	{
+		str_pack_u32 (s, serial);
+		return;
+	}
+
+	str_pack_u32 (s, strlen (value));
+	str_append (s, value);
+	test_xsettings_pad (s);
+}
+
+/// Load the buffer, and check that exactly the expected settings have changed
+static void
+test_xsettings_expect (struct xdg_xsettings *xs, Window owner,
+	const struct str *s, const char *expected)
+{
+	struct strv changed = strv_make ();
+	xdg_xsettings_load (xs, owner,
+		(const unsigned char *) s->str, s->len, &changed);
+	char *joined = strv_join (&changed, ",");
+	hard_assert (!strcmp (joined, expected));
+	free (joined);
+	strv_free (&changed);
+}
+
+static void
+test_xsettings (void)
+{
+	struct xdg_xsettings xs = xdg_xsettings_make ();
+	struct str s = str_make ();
+	test_xsettings_begin (&s, 1, 2);
+	test_xsettings_add (&s, "Net/ThemeName", 1, "Adwaita");
+	test_xsettings_add (&s, "Net/DoubleClickTime", 1, NULL);
+	test_xsettings_expect (&xs, 1, &s, "Net/ThemeName,Net/DoubleClickTime");
+	test_xsettings_expect (&xs, 1, &s, "");
+
+	// Only settings with new serials are replaced
+	struct xdg_xsettings_setting *setting =
+		str_map_find (&xs.settings, "Net/DoubleClickTime");
+	test_xsettings_begin (&s, 2, 2);
+	test_xsettings_add (&s, "Net/ThemeName", 2, "Breeze");
+	test_xsettings_add (&s, "Net/DoubleClickTime", 1, NULL);
+	test_xsettings_expect (&xs, 1, &s, "Net/ThemeName");
+	hard_assert (str_map_find (&xs.settings, "Net/DoubleClickTime") == setting);
+	setting = str_map_find (&xs.settings, "Net/ThemeName");
+	hard_assert (!strcmp (setting->string.str, "Breeze"));
+
+	// Removals are only detected within complete data
+	test_xsettings_begin (&s, 3, 1);
+	test_xsettings_add (&s, "Net/DoubleClickTime", 1, NULL);
+	s.len -= 2;
+	test_xsettings_expect (&xs, 1, &s, "");
+	hard_assert (xs.settings.len == 2);
+	s.len += 2;
+	test_xsettings_expect (&xs, 1, &s, "Net/ThemeName");
+	hard_assert (xs.settings.len == 1);
+
+	// Serials of another manager mean nothing
+	test_xsettings_begin (&s, 3, 2);
+	test_xsettings_add (&s, "Net/DoubleClickTime", 1, NULL);
+	test_xsettings_add (&s, "Gtk/FontName", 1, "Sans 10");
+	test_xsettings_expect (&xs, 2, &s, "Net/DoubleClickTime,Gtk/FontName");
+
+	str_reset (&s);
+	test_xsettings_expect (&xs, None, &s, "Net/DoubleClickTime,Gtk/FontName");
+	hard_assert (!xs.settings.len);
+
+	str_free (&s);
+	xdg_xsettings_free (&xs);
+}
+
+#endif // LIBERTY_XDG_WANT_X11
+
 int
 main (int argc, char *argv[])
 {
@@ -62,6 +203,11 @@ main (int argc, char *argv[])
 	test_init (&test, argc, argv);
 
 	test_add_simple (&test, "/desktop-file", NULL, test_desktop_file);
+	test_add_simple (&test, "/desktop-file/localized", NULL,
+		test_desktop_file_localized);
+#ifdef LIBERTY_XDG_WANT_X11
+	test_add_simple (&test, "/xsettings", NULL, test_xsettings);
+#endif // LIBERTY_XDG_WANT_X11
 
 	return test_run (&test);
 }
@@ -0,0 +1,206 @@
+# perfhash.awk: generate C lookup functions for static keyword sets
+#
+# SPDX-License-Identifier: 0BSD
+#
+# Usage: env LC_ALL=C awk -f perfhash.awk foo.c > foo.c.new
+#
+# The input is passed through, except that code following keyword lists
+# gets regenerated.  Lists are written in comments of the following form,
+# where the optional "fold" makes the lookup ASCII case-insensitive:
+#
+#   // perfhash.awk: function_name default_value [fold]
+#   //   keyword1  value1
+#   //   keyword2  value2
+#   static int
+#   function_name (const char *s, size_t len)
+#   ...
+#   // perfhash.awk: end
+#
+# Values are arbitrary C expressions convertible to int.  The generated
+# function finds a keyword's only possible slot in a table using a hash
+# function with a seed searched for so that there are no collisions,
+# and then compares it with the input, returning the default on mismatch.
+# The table size is a compile-time constant, so the modulo is cheap.
+#
+# So as to not repeat existing lists, keywords can also be taken from
+# an X-macro defined earlier in the file, with lines of the form
+# XX (ID, "keyword") or XX (ID, ..., "keyword"), where the keyword is
+# the last argument.  The values are then PREFIX followed by the ID:
+#
+#   // perfhash.awk: function_name default_value [fold] xmacro MACRO PREFIX
+#   static int
+#   ...
+#   // perfhash.awk: end
+
+function fatal(message) {
+	print FILENAME ":" FNR ": fatal error: " message > "/dev/stderr"
+	exit 1
+}
+
+function hash(key, seed, fold,    h, i) {
+	if (fold)
+		key = tolower(key)
+
+	h = seed
+	for (i = 1; i <= length(key); i++)
+		h = (h * 33 + Ord[substr(key, i, 1)]) % 16777216
+	return h
+}
+
+# Find the smallest table that has a seed with no collisions.
+function search(    size, seed, i, slot, used) {
+	for (size = N; size <= 8 * N; size++) {
+		for (seed = 0; seed < 4096; seed++) {
+			split("", used)
+			for (i = 1; i <= N; i++) {
+				slot = hash(Keys[i], seed, Fold) % size
+				if (slot in used)
+					break
+				used[slot] = i
+			}
+			if (i > N) {
+				Size = size
+				Seed = seed
+				for (slot in used)
+					Slots[slot] = used[slot]
+				return
+			}
+		}
+	}
+	fatal("failed to find a perfect hash function")
+}
+
+function add(key, value,    folded) {
+	folded = Fold ? tolower(key) : key
+	if (folded in Seen)
+		fatal("duplicate keyword: " key)
+	Seen[folded] = 1
+
+	Keys[++N] = key
+	Values[N] = value
+}
+
+function generate(    i, slot, entry, hashchar, compare) {
+	search()
+	hashchar = Fold ? "tolower_ascii ((unsigned char) s[i])" \
+		: "(unsigned char) s[i]"
+	compare = Fold ? "strncasecmp_ascii (table[slot].key, s, len)" \
+		: "memcmp (table[slot].key, s, len)"
+
+	print "static int"
+	print Name " (const char *s, size_t len)"
+	print "{"
+	print "\tstatic const struct { const char *key; size_t len; int value; }"
+	print "\ttable[" Size "] ="
+	print "\t{"
+	for (slot = 0; slot < Size; slot++) {
+		if (!(slot in Slots))
+			continue
+		i = Slots[slot]
+		entry = "[" slot "] = { \"" Keys[i] "\", " length(Keys[i]) ","
+		if (8 + length(entry " " Values[i] " },") <= 80)
+			print "\t\t" entry " " Values[i] " },"
+		else
+			print "\t\t" entry "\n\t\t\t" Values[i] " },"
+	}
+	print "\t};"
+	print ""
+	print "\tuint32_t hash = " Seed ";"
+	print "\tfor (size_t i = 0; i < len; i++)"
+	print "\t\thash = (hash * 33 + " hashchar ") & 0xFFFFFF;"
+	print ""
+	print "\tsize_t slot = hash % " Size ";"
+	print "\tif (!table[slot].key || table[slot].len != len"
+	print "\t || " compare ")"
+	print "\t\treturn " Default ";"
+	print "\treturn table[slot].value;"
+	print "}"
+}
+
+BEGIN {
+	for (i = 1; i < 256; i++)
+		Ord[sprintf("%c", i)] = i
+}
+
+# Remember X-macro definitions, so that keyword lists can be derived from them.
+Macro && match($0, /^[ \t]*XX \([A-Za-z0-9_]+,[^"]*"[^"]*"\)/) {
+	entry = substr($0, RSTART, RLENGTH)
+	sub(/^[ \t]*XX \(/, "", entry)
+	id = entry
+	sub(/,.*/, "", id)
+	sub(/^[^"]*"/, "", entry)
+	sub(/"\)$/, "", entry)
+	MacroIds[Macro, ++MacroN[Macro]] = id
+	MacroKeys[Macro, MacroN[Macro]] = entry
+}
+Macro && !/\\$/ {
+	Macro = ""
+}
+/^#define [A-Za-z0-9_]+\(XX\)/ {
+	Macro = $2
+	sub(/\(.*/, "", Macro)
+	MacroN[Macro] = 0
+}
+
+State == "list" && /^\/\/   / {
+	print
+	key = $2
+	value = $0
+	sub(/^\/\/   *[^ ]+ +/, "", value)
+	if (key !~ /^[!-~]+$/ || index(key, "\"") || index(key, "\\"))
+		fatal("unsupported keyword: " key)
+	if (value == $0 || value == "")
+		fatal("missing value")
+
+	add(key, value)
+	next
+}
+
+State == "list" {
+	if (!N)
+		fatal("empty keyword list")
+	generate()
+	State = "skip"
+}
+
+State == "skip" {
+	if ($0 == "// perfhash.awk: end") {
+		print
+		State = ""
+	}
+	next
+}
+
+/^\/\/ perfhash\.awk: / {
+	if ($3 == "end")
+		fatal("unexpected end marker")
+	Fold = NF >= 5 && $5 == "fold"
+	if (NF < 4 || NF != 4 + Fold + 3 * ($(5 + Fold) == "xmacro"))
+		fatal("invalid keyword list header")
+
+	Name = $3
+	Default = $4
+	State = "list"
+	N = 0
+	split("", Keys)
+	split("", Values)
+	split("", Seen)
+	split("", Slots)
+
+	if ($(5 + Fold) == "xmacro") {
+		macro = $(6 + Fold)
+		if (!(macro in MacroN))
+			fatal("unknown X-macro: " macro)
+		for (i = 1; i <= MacroN[macro]; i++)
+			add(MacroKeys[macro, i], $(7 + Fold) MacroIds[macro, i])
+	}
+}
+
+{
+	print
+}
+
+END {
+	if (State)
+		fatal("unterminated keyword list")
+}